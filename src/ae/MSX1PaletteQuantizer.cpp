@@ -15,7 +15,11 @@
 
 #include <algorithm>
 #include <cstdarg>
+#include <cstddef>
 #include <cstdio>
+#include <memory>
+#include <new>
+#include <vector>
 
 
 #ifdef AE_OS_WIN
@@ -76,8 +80,11 @@ using MSX1PQCore::nearest_basic_hsb;
 using MSX1PQCore::nearest_palette_hsb;
 using MSX1PQCore::nearest_palette_rgb;
 using MSX1PQCore::quantize_pixel;
+using MSX1PQCore::quantize_pixel_plan;
 using MSX1PQCore::clamp01f;
 using MSX1PQCore::clamp_value;
+using MSX1PQCore::TileRequirements;
+using MSX1PQCore::tile_requirements;
 using MSX1PQCore::MSX1PQ_COLOR_SYS_MSX1;
 using MSX1PQCore::MSX1PQ_COLOR_SYS_MSX2;
 using MSX1PQCore::MSX1PQ_EIGHTDOT_MODE_ATTR_BEST;
@@ -86,6 +93,7 @@ using MSX1PQCore::MSX1PQ_EIGHTDOT_MODE_BEST1;
 using MSX1PQCore::MSX1PQ_EIGHTDOT_MODE_FAST1;
 using MSX1PQCore::MSX1PQ_EIGHTDOT_MODE_NONE;
 using MSX1PQCore::MSX1PQ_EIGHTDOT_MODE_PENALTY_BEST;
+using MSX1PQCore::MSX1PQ_EIGHTDOT_MODE_VITERBI;
 using MSX1PQCore::MSX1PQ_DIST_MODE_HSB;
 using MSX1PQCore::MSX1PQ_DIST_MODE_RGB;
 
@@ -231,9 +239,9 @@ ParamsSetup (
     AEFX_CLR_STRUCT(def);
     PF_ADD_POPUP(
         "8-dot / 2-color",
-        6,
+        7,
         MSX1PQ_EIGHTDOT_MODE_BASIC1,
-        "None|Fast|Basic|Best|Best-Attr|Best-Trans",
+        "None|Fast|Basic|Best|Best-Attr|Best-Trans|Best-Viterbi",
         MSX1PQ_PARAM_USE_8DOT2COL
     );
 
@@ -386,9 +394,10 @@ apply_8dot2col_dispatch_ARGB(
     A_long     width,
     A_long     height,
     A_long     color_system,
-    A_long     mode)
+    A_long     mode,
+    const MSX1PQCore::EightDotSearch* search)
 {
-    if (mode <= MSX1PQ_EIGHTDOT_MODE_NONE || mode >= 7) {
+    if (mode <= MSX1PQ_EIGHTDOT_MODE_NONE || mode > MSX1PQ_EIGHTDOT_MODE_VITERBI) {
         return;
     }
 
@@ -399,19 +408,22 @@ apply_8dot2col_dispatch_ARGB(
 
     switch (mode) {
     case MSX1PQ_EIGHTDOT_MODE_FAST1:
-        MSX1PQCore::apply_8dot2col_fast1(data, pitch, w, h, cs);
+        MSX1PQCore::apply_8dot2col_fast1(data, pitch, w, h, cs, search);
         break;
     case MSX1PQ_EIGHTDOT_MODE_BASIC1:
-        MSX1PQCore::apply_8dot2col_basic1(data, pitch, w, h, cs);
+        MSX1PQCore::apply_8dot2col_basic1(data, pitch, w, h, cs, search);
         break;
     case MSX1PQ_EIGHTDOT_MODE_BEST1:
-        MSX1PQCore::apply_8dot2col_best1(data, pitch, w, h, cs);
+        MSX1PQCore::apply_8dot2col_best1(data, pitch, w, h, cs, search);
         break;
     case MSX1PQ_EIGHTDOT_MODE_ATTR_BEST:
-        MSX1PQCore::apply_8dot2col_attr_best(data, pitch, w, h, cs);
+        MSX1PQCore::apply_8dot2col_attr_best(data, pitch, w, h, cs, search);
         break;
     case MSX1PQ_EIGHTDOT_MODE_PENALTY_BEST:
-        MSX1PQCore::apply_8dot2col_attr_best_penalty(data, pitch, w, h, cs);
+        MSX1PQCore::apply_8dot2col_attr_best_penalty(data, pitch, w, h, cs, search);
+        break;
+    case MSX1PQ_EIGHTDOT_MODE_VITERBI:
+        MSX1PQCore::apply_8dot2col_viterbi(data, pitch, w, h, cs, search);
         break;
     default:
         break;
@@ -425,9 +437,10 @@ apply_8dot2col_dispatch_BGRA(
     A_long            width,
     A_long            height,
     A_long            color_system,
-    A_long            mode)
+    A_long            mode,
+    const MSX1PQCore::EightDotSearch* search)
 {
-    if (mode <= MSX1PQ_EIGHTDOT_MODE_NONE || mode >= 7) {
+    if (mode <= MSX1PQ_EIGHTDOT_MODE_NONE || mode > MSX1PQ_EIGHTDOT_MODE_VITERBI) {
         return;
     }
 
@@ -438,19 +451,22 @@ apply_8dot2col_dispatch_BGRA(
 
     switch (mode) {
     case MSX1PQ_EIGHTDOT_MODE_FAST1:
-        MSX1PQCore::apply_8dot2col_fast1(data, pitch, w, h, cs);
+        MSX1PQCore::apply_8dot2col_fast1(data, pitch, w, h, cs, search);
         break;
     case MSX1PQ_EIGHTDOT_MODE_BASIC1:
-        MSX1PQCore::apply_8dot2col_basic1(data, pitch, w, h, cs);
+        MSX1PQCore::apply_8dot2col_basic1(data, pitch, w, h, cs, search);
         break;
     case MSX1PQ_EIGHTDOT_MODE_BEST1:
-        MSX1PQCore::apply_8dot2col_best1(data, pitch, w, h, cs);
+        MSX1PQCore::apply_8dot2col_best1(data, pitch, w, h, cs, search);
         break;
     case MSX1PQ_EIGHTDOT_MODE_ATTR_BEST:
-        MSX1PQCore::apply_8dot2col_attr_best(data, pitch, w, h, cs);
+        MSX1PQCore::apply_8dot2col_attr_best(data, pitch, w, h, cs, search);
         break;
     case MSX1PQ_EIGHTDOT_MODE_PENALTY_BEST:
-        MSX1PQCore::apply_8dot2col_attr_best_penalty(data, pitch, w, h, cs);
+        MSX1PQCore::apply_8dot2col_attr_best_penalty(data, pitch, w, h, cs, search);
+        break;
+    case MSX1PQ_EIGHTDOT_MODE_VITERBI:
+        MSX1PQCore::apply_8dot2col_viterbi(data, pitch, w, h, cs, search);
         break;
     default:
         break;
@@ -462,13 +478,39 @@ apply_8dot2col_dispatch_BGRA(
 // ---------------------------------------------------------------------------
 
 struct FilterRefcon {
-    // QuantInfo は各レンダー呼び出しごとに値コピーを保持し、
-    // iterate() の並列実行でも他スレッドと状態を共有しない。
-    QuantInfo qi{};
+    // 量子化プランは各レンダー呼び出しごとに QuantInfo から作り直し、
+    // iterate() の並列実行中は読み取り専用で他スレッドと状態を共有しない。
+    MSX1PQCore::QuantPlan plan;
     A_long     global_x0{};
     A_long     global_y0{};
+
+    // テーブルが使えないときのパレット探索用候補グリッド（plan.qi.palette_grid が指す）。
+    // 構築には HSB 距離で約 18 ms かかり 1 画素あたり約 23 ns しか縮まないため、
+    // レンダーごとに作ると 78 万画素未満では損になる。探索パラメータごとにプロセス内で
+    // 共有し、構築は重みを変えたあとの最初のレンダーだけで済ませる。
+    std::shared_ptr<const MSX1PQCore::PaletteGrid> grid;
 };
 
+static void
+PrepareRefcon(
+    FilterRefcon    &refcon,
+    const QuantInfo &qi,
+    A_long          global_x0,
+    A_long          global_y0)
+{
+    refcon.global_x0 = global_x0;
+    refcon.global_y0 = global_y0;
+    MSX1PQCore::compile_quant_plan(qi, true, refcon.plan);
+
+    if (!refcon.plan.use_table) {
+        refcon.grid = MSX1PQCore::acquire_palette_grid(qi);
+    }
+    if (refcon.grid) {
+        refcon.plan.qi.palette_grid = refcon.grid.get();
+        refcon.plan.span_kernel = MSX1PQCore::select_span_kernel(refcon.plan);
+    }
+}
+
 static PF_Err
 FilterImage8 (
     void        *refcon,
@@ -478,23 +520,17 @@ FilterImage8 (
     PF_Pixel8   *outP)
 {
     auto *ref = reinterpret_cast<FilterRefcon*>(refcon);
-    const QuantInfo *qi = &ref->qi;
 
     // 入力色をローカルコピー
     A_u_char r = inP->red;
     A_u_char g = inP->green;
     A_u_char b = inP->blue;
 
-    // 前処理
-    apply_preprocess(qi, r, g, b);
+    const std::int32_t gx = static_cast<std::int32_t>(ref->global_x0 + xL);
+    const std::int32_t gy = static_cast<std::int32_t>(ref->global_y0 + yL);
 
-    const MSX1PQ::QuantColor &qc = quantize_pixel(
-        *qi,
-        r,
-        g,
-        b,
-        static_cast<std::int32_t>(ref->global_x0 + xL),
-        static_cast<std::int32_t>(ref->global_y0 + yL));
+    // 前処理 + 量子化
+    const MSX1PQ::QuantColor qc = quantize_pixel_plan(ref->plan, r, g, b, gx, gy);
 
     outP->alpha = inP->alpha;
     outP->red   = qc.r;
@@ -516,7 +552,6 @@ FilterImageBGRA_8u (
     PF_Pixel8   *outP)
 {
     auto *ref = reinterpret_cast<FilterRefcon*>(refcon);
-    const QuantInfo *qi = &ref->qi;
 
     MSX1PQ_Pixel_BGRA_8u *inBGRA_8uP  = reinterpret_cast<MSX1PQ_Pixel_BGRA_8u*>(inP);
     MSX1PQ_Pixel_BGRA_8u *outBGRA_8uP = reinterpret_cast<MSX1PQ_Pixel_BGRA_8u*>(outP);
@@ -525,15 +560,10 @@ FilterImageBGRA_8u (
     A_u_char g = inBGRA_8uP->green;
     A_u_char b = inBGRA_8uP->blue;
 
-    apply_preprocess(qi, r, g, b);
+    const std::int32_t gx = static_cast<std::int32_t>(ref->global_x0 + xL);
+    const std::int32_t gy = static_cast<std::int32_t>(ref->global_y0 + yL);
 
-    const MSX1PQ::QuantColor &qc = quantize_pixel(
-        *qi,
-        r,
-        g,
-        b,
-        static_cast<std::int32_t>(ref->global_x0 + xL),
-        static_cast<std::int32_t>(ref->global_y0 + yL));
+    const MSX1PQ::QuantColor qc = quantize_pixel_plan(ref->plan, r, g, b, gx, gy);
 
     outBGRA_8uP->alpha = inBGRA_8uP->alpha;
     outBGRA_8uP->red   = qc.r;
@@ -574,8 +604,70 @@ RunIteratePass(
         output_worldP);
 }
 
+// 8dot の帯をホストのスレッドで並列に処理する（iterate_generic）
+struct HostExecutorContext {
+    PF_InData  *in_dataP;
+    PF_OutData *out_data;
+};
+
+struct HostGenericTask {
+    MSX1PQCore::ParallelTaskFunc task;
+    void                         *task_ctx;
+    std::vector<char>            done;   // iterate_generic が失敗したときの残りの判定用
+};
+
+static PF_Err
+RunHostGenericTask(
+    void   *refconPV,
+    A_long /*thread_indexL*/,
+    A_long i,
+    A_long /*iterationsL*/)
+{
+    HostGenericTask *taskP = static_cast<HostGenericTask*>(refconPV);
+    taskP->task(taskP->task_ctx, static_cast<std::int32_t>(i));
+    taskP->done[static_cast<std::size_t>(i)] = 1;
+    return PF_Err_NONE;
+}
+
+static void
+RunOnHostThreads(
+    void                         *run_ctx,
+    std::int32_t                 count,
+    MSX1PQCore::ParallelTaskFunc task,
+    void                         *task_ctx)
+{
+    HostExecutorContext *ctxP = static_cast<HostExecutorContext*>(run_ctx);
+
+    HostGenericTask generic_task;
+    generic_task.task     = task;
+    generic_task.task_ctx = task_ctx;
+    generic_task.done.assign(static_cast<std::size_t>(count), 0);
+
+    AEFX_SuiteScoper<PF_Iterate8Suite2> iterate8Suite(
+        ctxP->in_dataP,
+        kPFIterate8Suite,
+        kPFIterate8SuiteVersion2,
+        ctxP->out_data);
+
+    const PF_Err err = iterate8Suite->iterate_generic(
+        static_cast<A_long>(count),
+        &generic_task,
+        RunHostGenericTask);
+
+    if (err) {
+        // 実行されなかった帯はこのスレッドで処理する
+        for (std::int32_t i = 0; i < count; ++i) {
+            if (!generic_task.done[static_cast<std::size_t>(i)]) {
+                task(task_ctx, i);
+            }
+        }
+    }
+}
+
 static void
 Apply8dot2colARGB(
+    PF_InData                 *in_dataP,
+    PF_OutData                *out_data,
     PF_EffectWorld            *output_worldP,
     const PF_Rect             &rect,
     const QuantInfo           &qi)
@@ -599,17 +691,28 @@ Apply8dot2colARGB(
 
     base += rect.left * static_cast<A_long>(sizeof(PF_Pixel8));
 
+    HostExecutorContext host{in_dataP, out_data};
+    MSX1PQCore::Executor executor;
+    executor.run     = RunOnHostThreads;
+    executor.run_ctx = &host;
+
+    MSX1PQCore::EightDotSearch search = MSX1PQCore::make_eightdot_search(qi);
+    search.executor = &executor;
+
     apply_8dot2col_dispatch_ARGB(
         reinterpret_cast<PF_Pixel8*>(base),
         row_pitch,
         width,
         height,
         qi.color_system,
-        qi.use_8dot2col);
+        qi.use_8dot2col,
+        &search);
 }
 
 static void
 Apply8dot2colBGRA(
+    PF_InData                 *in_dataP,
+    PF_OutData                *out_data,
     PF_EffectWorld            *output_worldP,
     A_long                    width,
     A_long                    height,
@@ -625,13 +728,22 @@ Apply8dot2colBGRA(
         base + output_worldP->extent_hint.top * row_pitch
              + output_worldP->extent_hint.left;
 
+    HostExecutorContext host{in_dataP, out_data};
+    MSX1PQCore::Executor executor;
+    executor.run     = RunOnHostThreads;
+    executor.run_ctx = &host;
+
+    MSX1PQCore::EightDotSearch search = MSX1PQCore::make_eightdot_search(qi);
+    search.executor = &executor;
+
     apply_8dot2col_dispatch_BGRA(
         data,
         row_pitch,
         width,
         height,
         qi.color_system,
-        qi.use_8dot2col);
+        qi.use_8dot2col,
+        &search);
 }
 
 // ---------------------------------------------------------------------------
@@ -692,9 +804,9 @@ Render (
 
             // ---- 1パス目：通常の量子化（ディザなど）----
             FilterRefcon refcon{};
-            refcon.qi = qi;
-            refcon.global_x0 = output->extent_hint.left;
-            refcon.global_y0 = output->extent_hint.top;
+            PrepareRefcon(refcon, qi,
+                          output->extent_hint.left,
+                          output->extent_hint.top);
 
             err = RunIteratePass(
                       in_dataP,
@@ -711,6 +823,8 @@ Render (
                 qi.use_8dot2col != MSX1PQ_EIGHTDOT_MODE_NONE) {
 
                 Apply8dot2colBGRA(
+                    in_dataP,
+                    out_data,
                     reinterpret_cast<PF_EffectWorld*>(output),
                     width,
                     height,
@@ -729,9 +843,9 @@ Render (
 
         // ---- 1パス目：通常の量子化 ----
         FilterRefcon refcon{};
-        refcon.qi = qi;
-        refcon.global_x0 = output->extent_hint.left;
-        refcon.global_y0 = output->extent_hint.top;
+        PrepareRefcon(refcon, qi,
+                      output->extent_hint.left,
+                      output->extent_hint.top);
 
         err = RunIteratePass(
                   in_dataP,
@@ -747,6 +861,8 @@ Render (
         if (!err && !qi.use_palette_color &&
             qi.use_8dot2col != MSX1PQ_EIGHTDOT_MODE_NONE) {
             Apply8dot2colARGB(
+                in_dataP,
+                out_data,
                 reinterpret_cast<PF_EffectWorld*>(output),
                 output->extent_hint,
                 qi);
@@ -757,70 +873,258 @@ Render (
 }
 
 
+// ---------------------------------------------------------------------------
+// スマートレンダー用の共通処理
+// ---------------------------------------------------------------------------
+
+// QuantInfo を PF_CHECKOUT_PARAM で構築（SmartPreRender / SmartRender は params を使えない）
+static PF_Err
+CheckoutQuantInfo(
+    PF_InData *in_dataP,
+    QuantInfo &qi)
+{
+    PF_Err err = PF_Err_NONE;
+    PF_ParamDef param;
+
+    // COLOR_SYSTEM (popup)
+    ERR( CheckoutParam(
+            in_dataP,
+            MSX1PQ_PARAM_COLOR_SYSTEM,
+            param) );
+    qi.color_system = param.u.pd.value;
+    ERR( CheckinParam(in_dataP, param) );
+
+    // USE_DITHER (checkbox)
+    ERR( CheckoutParam(
+            in_dataP,
+            MSX1PQ_PARAM_USE_DITHER,
+            param) );
+    qi.use_dither = (param.u.bd.value != 0);
+    ERR( CheckinParam(in_dataP, param) );
+
+    // USE_PALETTE_COLOR (checkbox)
+    ERR( CheckoutParam(
+            in_dataP,
+            MSX1PQ_PARAM_USE_PALETTE_COLOR,
+            param) );
+    qi.use_palette_color = (param.u.bd.value != 0);
+    ERR( CheckinParam(in_dataP, param) );
+
+    // USE_8DOT2COL (popup)
+    ERR( CheckoutParam(
+            in_dataP,
+            MSX1PQ_PARAM_USE_8DOT2COL,
+            param) );
+    qi.use_8dot2col = param.u.pd.value;
+    ERR( CheckinParam(in_dataP, param) );
+
+    // DISTANCE_MODE (popup)
+    ERR( CheckoutParam(
+            in_dataP,
+            MSX1PQ_PARAM_DISTANCE_MODE,
+            param) );
+    qi.use_hsb = (param.u.pd.value == MSX1PQ_DIST_MODE_HSB);
+    ERR( CheckinParam(in_dataP, param) );
+
+    // WEIGHT_H/S/B (float)
+    ERR( CheckoutParam(
+            in_dataP,
+            MSX1PQ_PARAM_WEIGHT_H,
+            param) );
+    qi.w_h = clamp01f(static_cast<float>(param.u.fs_d.value));
+    ERR( CheckinParam(in_dataP, param) );
+
+    ERR( CheckoutParam(
+            in_dataP,
+            MSX1PQ_PARAM_WEIGHT_S,
+            param) );
+    qi.w_s = clamp01f(static_cast<float>(param.u.fs_d.value));
+    ERR( CheckinParam(in_dataP, param) );
+
+    ERR( CheckoutParam(
+            in_dataP,
+            MSX1PQ_PARAM_WEIGHT_B,
+            param) );
+    qi.w_b = clamp01f(static_cast<float>(param.u.fs_d.value));
+    ERR( CheckinParam(in_dataP, param) );
+
+    // PRE_POSTERIZE
+    ERR( CheckoutParam(
+            in_dataP,
+            MSX1PQ_PARAM_PRE_POSTERIZE,
+            param) );
+    qi.pre_posterize = clamp_value(
+        static_cast<int>(param.u.fs_d.value + 0.5f),
+        0,
+        255);
+    ERR( CheckinParam(in_dataP, param) );
+
+    // PRE_SAT / GAMMA / HIGHLIGHT / HUE
+    ERR( CheckoutParam(
+            in_dataP,
+            MSX1PQ_PARAM_PRE_SAT,
+            param) );
+    qi.pre_sat = static_cast<float>(param.u.fs_d.value);
+    ERR( CheckinParam(in_dataP, param) );
+
+    ERR( CheckoutParam(
+            in_dataP,
+            MSX1PQ_PARAM_PRE_GAMMA,
+            param) );
+    qi.pre_gamma = static_cast<float>(param.u.fs_d.value);
+    ERR( CheckinParam(in_dataP, param) );
+
+    ERR( CheckoutParam(
+            in_dataP,
+            MSX1PQ_PARAM_PRE_HIGHLIGHT,
+            param) );
+    qi.pre_highlight = static_cast<float>(param.u.fs_d.value);
+    ERR( CheckinParam(in_dataP, param) );
+
+    ERR( CheckoutParam(
+            in_dataP,
+            MSX1PQ_PARAM_PRE_HUE,
+            param) );
+    qi.pre_hue = static_cast<float>(param.u.fs_d.value);
+    ERR( CheckinParam(in_dataP, param) );
+
+    // USE_DARK_DITHER
+    ERR( CheckoutParam(
+            in_dataP,
+            MSX1PQ_PARAM_USE_DARK_DITHER,
+            param) );
+    qi.use_dark_dither = (param.u.bd.value != 0);
+    ERR( CheckinParam(in_dataP, param) );
+
+    return err;
+}
+
+// SmartPreRender で決めた入力・出力ワールドの範囲（レイヤー座標）を SmartRender に渡す
+struct SmartRenderRects {
+    PF_Rect input_rect;   // checkout_layer_pixels で得る入力ワールド
+    PF_Rect output_rect;  // checkout_output で得る出力ワールド
+};
+
+static void
+DeleteSmartRenderRects(void *pre_render_data)
+{
+    delete static_cast<SmartRenderRects*>(pre_render_data);
+}
+
+// 左右遷移のあるモードでレイヤーの横幅を調べるための checkout 番号
+static const A_long kExtentCheckoutIdx = MSX1PQ_PARAM_INPUT + 1;
+
+// v 以下 / 以上で最も近い unit の倍数（負の座標にも対応）
+static A_long
+AlignDownL(A_long v, A_long unit)
+{
+    const A_long m = v % unit;
+    return (m < 0) ? (v - m - unit) : (v - m);
+}
+
+static A_long
+AlignUpL(A_long v, A_long unit)
+{
+    return -AlignDownL(-v, unit);
+}
+
+// tile_requirements() の揃え単位を、ディザの位相の周期（横 2・縦 4）の倍数にも広げたもの。
+// フレームの左上をレイヤー座標でこの倍数に置けば、ブロック・セル・ディザの位相が
+// ホストのタイルによらずレイヤー座標で決まる。
+static TileRequirements
+SmartRenderAlignment(const QuantInfo &qi)
+{
+    TileRequirements req = tile_requirements(qi);
+    const std::int32_t block_x = req.align_x;
+    const std::int32_t cell_y  = req.align_y;
+    while (req.align_x % 2 != 0) {
+        req.align_x += block_x;
+    }
+    while (req.align_y % 4 != 0) {
+        req.align_y += cell_y;
+    }
+    return req;
+}
+
+// ワールドの y 行目の先頭（rowbytes が負のときは下の行から並ぶ）
+static PF_Pixel8*
+WorldRow(const PF_EffectWorld *worldP, A_long y)
+{
+    const A_long row_bytes = worldP->rowbytes;
+    char *base = reinterpret_cast<char*>(worldP->data);
+
+    if (row_bytes < 0) {
+        base += (worldP->height - 1 - y) * (-row_bytes);
+    } else {
+        base += y * row_bytes;
+    }
+    return reinterpret_cast<PF_Pixel8*>(base);
+}
+
+
 static PF_Err
 SmartPreRender(
     PF_InData         *in_dataP,
-    PF_OutData        *out_dataP,
+    PF_OutData        * /*out_dataP*/,
     PF_ParamDef       * /*params*/[],
     PF_PreRenderExtra *extraP)
 {
     PF_Err err = PF_Err_NONE;
 
-    // ホストから来た元の要求
+    // ホストから来た元の要求。出力はこの範囲のうち入力のあるところだけを返す
+    // （要求より広げると上位のエフェクトによって表示位置がずれてクリッピングされることがある）
     PF_RenderRequest host_req = extraP->input->output_request;
-    PF_Rect host_rect = host_req.rect;
+    const PF_Rect out_rect = host_req.rect;
     /*
     MyDebugLog("SmartPreRender: host request L=%ld, T=%ld, R=%ld, B=%ld",
-        host_rect.left,
-        host_rect.top,
-        host_rect.right,
-        host_rect.bottom);
-    */
-
-    const A_long comp_w = in_dataP->width;
-    const A_long comp_h = in_dataP->height;
-
-    // 出力用: ホストの request をコンポ内にクランプ（→やめる）
-    PF_Rect out_rect = host_rect;
-    // 変更すると上位のエフェクトによって表示位置がずれてクリッピングされることがある
-    //out_rect.left   = (std::max)(out_rect.left,  (A_long)0);
-    //out_rect.top    = (std::max)(out_rect.top,   (A_long)0);
-    //out_rect.right  = (std::min)(out_rect.right, comp_w);
-    //out_rect.bottom = (std::min)(out_rect.bottom,comp_h);
-    /*
-    MyDebugLog("SmartPreRender: output rect L=%ld, T=%ld, R=%ld, B=%ld",
         out_rect.left,
         out_rect.top,
         out_rect.right,
         out_rect.bottom);
     */
 
-    // 入力用: 横だけ全幅に広げる（→やめる）上下は out_rect に合わせる
-    PF_RenderRequest input_req = host_req;
-    PF_Rect in_roi = out_rect;
-    // ここを広げると前に挟むエフェクトによって位置がずれる不具合が出ることがある
-    //in_roi.left  = 0;
-    //in_roi.right = comp_w;
-    input_req.rect = in_roi;
+    QuantInfo qi{};
+    ERR( CheckoutQuantInfo(in_dataP, qi) );
+    const TileRequirements align = SmartRenderAlignment(qi);
 
-    /*
-    MyDebugLog("SmartPreRender: input rect L=%ld, T=%ld, R=%ld, B=%ld",
-        input_req.rect.left,
-        input_req.rect.top,
-        input_req.rect.right,
-        input_req.rect.bottom);
-    */
+    // 入力用: 8dot 処理のブロック・セルをレイヤー座標でそろえた範囲（ハロー）まで広げる。
+    // 入力と出力のワールドは位置が変わるので、両方の範囲を pre_render_data で SmartRender に渡す。
+    PF_RenderRequest input_req = host_req;
+    input_req.rect.left   = AlignDownL(out_rect.left,   align.align_x);
+    input_req.rect.top    = AlignDownL(out_rect.top,    align.align_y);
+    input_req.rect.right  = AlignUpL(out_rect.right,    align.align_x);
+    input_req.rect.bottom = AlignUpL(out_rect.bottom,   align.align_y);
+
+    // 左右遷移のあるモードは行の左端から続くので、レイヤーの横幅全体を読む
+    if (!err && align.full_rows) {
+        PF_CheckoutResult extent{};
+        err = extraP->cb->checkout_layer(
+                  in_dataP->effect_ref,
+                  MSX1PQ_PARAM_INPUT,
+                  kExtentCheckoutIdx,
+                  &host_req,
+                  in_dataP->current_time,
+                  in_dataP->time_step,
+                  in_dataP->time_scale,
+                  &extent);
+        if (!err) {
+            input_req.rect.left  = AlignDownL(extent.max_result_rect.left, align.align_x);
+            input_req.rect.right = AlignUpL(extent.max_result_rect.right,  align.align_x);
+        }
+    }
 
     PF_CheckoutResult in_result{};
-    err = extraP->cb->checkout_layer(
-              in_dataP->effect_ref,
-              MSX1PQ_PARAM_INPUT,
-              MSX1PQ_PARAM_INPUT,
-              &input_req,
-              in_dataP->current_time,
-              in_dataP->time_step,
-              in_dataP->time_scale,
-              &in_result);
+    if (!err) {
+        err = extraP->cb->checkout_layer(
+                  in_dataP->effect_ref,
+                  MSX1PQ_PARAM_INPUT,
+                  MSX1PQ_PARAM_INPUT,
+                  &input_req,
+                  in_dataP->current_time,
+                  in_dataP->time_step,
+                  in_dataP->time_scale,
+                  &in_result);
+    }
 
     if (!err) {
 
@@ -830,12 +1134,6 @@ SmartPreRender(
             in_result.result_rect.top,
             in_result.result_rect.right,
             in_result.result_rect.bottom);
-
-        MyDebugLog("SmartPreRender: input result max_result rect L=%ld, T=%ld, R=%ld, B=%ld",
-            in_result.max_result_rect.left,
-            in_result.max_result_rect.top,
-            in_result.max_result_rect.right,
-            in_result.max_result_rect.bottom);
         */
 
         // in_result.result_rect との共通部分に
@@ -843,24 +1141,24 @@ SmartPreRender(
             PF_Rect r;
             r.left   = (std::max)(a.left,   b.left);
             r.top    = (std::max)(a.top,    b.top);
-            r.right  = (std::min)(a.right,  b.right);
-            r.bottom = (std::min)(a.bottom, b.bottom);
+            r.right  = (std::max)(r.left, (std::min)(a.right,  b.right));
+            r.bottom = (std::max)(r.top,  (std::min)(a.bottom, b.bottom));
             return r;
         };
 
-        //PF_Rect final_rect = intersect(out_rect, in_result.result_rect);
-        PF_Rect final_rect = in_result.result_rect; // out_rectを変更しなくなったのでintersectもやめる
+        const PF_Rect final_rect = intersect(out_rect, in_result.result_rect);
 
-        /*
-        MyDebugLog("SmartPreRender: final result rect L=%ld, T=%ld, R=%ld, B=%ld",
-            final_rect.left,
-            final_rect.top,
-            final_rect.right,
-            final_rect.bottom);
-        */
+        SmartRenderRects *rects = new (std::nothrow) SmartRenderRects;
+        if (!rects) {
+            return PF_Err_OUT_OF_MEMORY;
+        }
+        rects->input_rect  = in_result.result_rect;
+        rects->output_rect = final_rect;
 
         extraP->output->result_rect     = final_rect;
         extraP->output->max_result_rect = final_rect;
+        extraP->output->pre_render_data = rects;
+        extraP->output->delete_pre_render_data_func = DeleteSmartRenderRects;
     }
 
     return err;
@@ -907,225 +1205,125 @@ SmartRender(
         // --------------------------------------------------------------------
         // QuantInfo を PF_CHECKOUT_PARAM で構築
         // --------------------------------------------------------------------
-        QuantInfo  qi{};
-        PF_ParamDef param;
-
-        // COLOR_SYSTEM (popup)
-        ERR( CheckoutParam(
-                in_dataP,
-                MSX1PQ_PARAM_COLOR_SYSTEM,
-                param) );
-        qi.color_system = param.u.pd.value;
-        ERR( CheckinParam(in_dataP, param) );
-
-        // USE_DITHER (checkbox)
-        ERR( CheckoutParam(
-                in_dataP,
-                MSX1PQ_PARAM_USE_DITHER,
-                param) );
-        qi.use_dither = (param.u.bd.value != 0);
-        ERR( CheckinParam(in_dataP, param) );
-
-        // USE_PALETTE_COLOR (checkbox)
-        ERR( CheckoutParam(
-                in_dataP,
-                MSX1PQ_PARAM_USE_PALETTE_COLOR,
-                param) );
-        qi.use_palette_color = (param.u.bd.value != 0);
-        ERR( CheckinParam(in_dataP, param) );
-
-        // USE_8DOT2COL (popup)
-        ERR( CheckoutParam(
-                in_dataP,
-                MSX1PQ_PARAM_USE_8DOT2COL,
-                param) );
-        qi.use_8dot2col = param.u.pd.value;
-        ERR( CheckinParam(in_dataP, param) );
-
-        // DISTANCE_MODE (popup)
-        ERR( CheckoutParam(
-                in_dataP,
-                MSX1PQ_PARAM_DISTANCE_MODE,
-                param) );
-        qi.use_hsb = (param.u.pd.value == MSX1PQ_DIST_MODE_HSB);
-        ERR( CheckinParam(in_dataP, param) );
-
-        // WEIGHT_H/S/B (float)
-        ERR( CheckoutParam(
-                in_dataP,
-                MSX1PQ_PARAM_WEIGHT_H,
-                param) );
-        qi.w_h = clamp01f(static_cast<float>(param.u.fs_d.value));
-        ERR( CheckinParam(in_dataP, param) );
-
-        ERR( CheckoutParam(
-                in_dataP,
-                MSX1PQ_PARAM_WEIGHT_S,
-                param) );
-        qi.w_s = clamp01f(static_cast<float>(param.u.fs_d.value));
-        ERR( CheckinParam(in_dataP, param) );
-
-        ERR( CheckoutParam(
-                in_dataP,
-                MSX1PQ_PARAM_WEIGHT_B,
-                param) );
-        qi.w_b = clamp01f(static_cast<float>(param.u.fs_d.value));
-        ERR( CheckinParam(in_dataP, param) );
-
-        // PRE_POSTERIZE
-        ERR( CheckoutParam(
-                in_dataP,
-                MSX1PQ_PARAM_PRE_POSTERIZE,
-                param) );
-        qi.pre_posterize = clamp_value(
-            static_cast<int>(param.u.fs_d.value + 0.5f),
-            0,
-            255);
-        ERR( CheckinParam(in_dataP, param) );
-
-        // PRE_SAT / GAMMA / HIGHLIGHT / HUE
-        ERR( CheckoutParam(
-                in_dataP,
-                MSX1PQ_PARAM_PRE_SAT,
-                param) );
-        qi.pre_sat = static_cast<float>(param.u.fs_d.value);
-        ERR( CheckinParam(in_dataP, param) );
-
-        ERR( CheckoutParam(
-                in_dataP,
-                MSX1PQ_PARAM_PRE_GAMMA,
-                param) );
-        qi.pre_gamma = static_cast<float>(param.u.fs_d.value);
-        ERR( CheckinParam(in_dataP, param) );
-
-        ERR( CheckoutParam(
-                in_dataP,
-                MSX1PQ_PARAM_PRE_HIGHLIGHT,
-                param) );
-        qi.pre_highlight = static_cast<float>(param.u.fs_d.value);
-        ERR( CheckinParam(in_dataP, param) );
-
-        ERR( CheckoutParam(
-                in_dataP,
-                MSX1PQ_PARAM_PRE_HUE,
-                param) );
-        qi.pre_hue = static_cast<float>(param.u.fs_d.value);
-        ERR( CheckinParam(in_dataP, param) );
-
-        // USE_DARK_DITHER
-        ERR( CheckoutParam(
-                in_dataP,
-                MSX1PQ_PARAM_USE_DARK_DITHER,
-                param) );
-        qi.use_dark_dither = (param.u.bd.value != 0);
-        ERR( CheckinParam(in_dataP, param) );
+        QuantInfo qi{};
+        ERR( CheckoutQuantInfo(in_dataP, qi) );
 
         // --------------------------------------------------------------------
-        // スマートレンダー用 ROI 揃え（ディザ使用時のみ 8ドット境界にスナップ）
+        // スマートレンダー用 ROI 揃え
+        // 入力・出力ワールドの位置は SmartPreRender が記録したレイヤー座標で合わせる。
+        // 入力は 8dot 処理のブロックとセル（左右遷移のあるモードは行全体）をレイヤー座標で
+        // そろえた範囲まで checkout 済みなので、左上をレイヤー座標で揃え単位の倍数に置いた
+        // フレームとして処理すれば、ホストのタイルの分け方によらず同じ結果になる。
         // --------------------------------------------------------------------
-        const auto align_down8 = [](A_long v) {
-            if (v >= 0) {
-                return (v / 8) * 8;
-            }
-            return -(((-v + 7) / 8) * 8);
-        };
-        const auto align_up8 = [](A_long v) {
-            if (v >= 0) {
-                return ((v + 7) / 8) * 8;
-            }
-            return -(((-v) / 8) * 8);
-        };
-
-        PF_Rect aligned_rect = current_rect;
-        if (qi.use_dither) {
-            aligned_rect.left   = align_down8(current_rect.left);
-            aligned_rect.right  = align_up8(current_rect.right);
+        const SmartRenderRects *rects =
+            static_cast<const SmartRenderRects*>(extraP->input->pre_render_data);
+        if (!err && !rects) {
+            err = PF_Err_BAD_CALLBACK_PARAM;
         }
-        aligned_rect.top    = current_rect.top;
-        aligned_rect.bottom = current_rect.bottom;
-
-        aligned_rect.left = clamp_value(aligned_rect.left, static_cast<A_long>(0), output_worldP->width);
-        aligned_rect.right = clamp_value(aligned_rect.right, aligned_rect.left, output_worldP->width);
-        aligned_rect.top = clamp_value(aligned_rect.top, static_cast<A_long>(0), output_worldP->height);
-        aligned_rect.bottom = clamp_value(aligned_rect.bottom, aligned_rect.top, output_worldP->height);
-
-        const A_long width  = aligned_rect.right  - aligned_rect.left;
-        const A_long height = aligned_rect.bottom - aligned_rect.top;
-
-        // 矩形が空の場合は何もしない
-        if (width > 0 && height > 0) {
-            auto calc_start = [](const PF_EffectWorld *worldP,
-                                 const PF_Rect &rect) -> PF_Pixel8* {
-                const A_long row_bytes = worldP->rowbytes;
-                char *base = reinterpret_cast<char*>(worldP->data);
-
-                if (row_bytes < 0) {
-                    base += (worldP->height - 1 - rect.top) * (-row_bytes);
-                } else {
-                    base += rect.top * row_bytes;
-                }
-
-                base += rect.left * static_cast<A_long>(sizeof(PF_Pixel8));
-
-                return reinterpret_cast<PF_Pixel8*>(base);
-            };
-
-            PF_EffectWorld input_roi  = *input_worldP;
-            PF_EffectWorld output_roi = *output_worldP;
-
-            input_roi.data  = calc_start(input_worldP, aligned_rect);
-            output_roi.data = calc_start(output_worldP, aligned_rect);
-
-            input_roi.width  = width;
-            input_roi.height = height;
-            output_roi.width  = width;
-            output_roi.height = height;
-
-            input_roi.extent_hint.left = 0;
-            input_roi.extent_hint.top  = 0;
-            input_roi.extent_hint.right  = width;
-            input_roi.extent_hint.bottom = height;
-            output_roi.extent_hint.left = 0;
-            output_roi.extent_hint.top  = 0;
-            output_roi.extent_hint.right  = width;
-            output_roi.extent_hint.bottom = height;
-
-            MyDebugLog("### SR: rect by hint L=%ld, T=%ld, R=%ld, B=%ld, aligned rect L=%ld, T=%ld, R=%ld, B=%ld",
-                current_rect.left,
-                current_rect.top,
-                current_rect.right,
-                current_rect.bottom,
-                aligned_rect.left,
-                aligned_rect.top,
-                aligned_rect.right,
-                aligned_rect.bottom);
-
-            FilterRefcon refcon{};
-            refcon.qi = qi;
-            refcon.global_x0 = aligned_rect.left;
-            refcon.global_y0 = aligned_rect.top;
-
-            // ----------------------------------------------------------------
-            // 1パス目：通常量子化
-            // ----------------------------------------------------------------
-            if (!err) {
-                err = RunIteratePass(
-                          in_dataP,
-                          out_data,
-                          height,
-                          &input_roi,
-                          &refcon,
-                          FilterImage8,   // 既存 8bit フィルタ
-                          &output_roi);
-            }
 
-            // ----------------------------------------------------------------
-            // 2パス目：8dot / 2color 後処理
-            // ----------------------------------------------------------------
-            if (!err &&
-                !qi.use_palette_color &&
-                qi.use_8dot2col != MSX1PQ_EIGHTDOT_MODE_NONE) {
-                Apply8dot2colARGB(output_worldP, aligned_rect, qi);
+        if (!err) {
+            const PF_Rect &in_rect  = rects->input_rect;
+            const PF_Rect &out_rect = rects->output_rect;
+
+            // 描く範囲（レイヤー座標、入力のある範囲に限る）
+            PF_Rect tile_rect;
+            tile_rect.left   = (std::max)(out_rect.left + current_rect.left,     in_rect.left);
+            tile_rect.top    = (std::max)(out_rect.top  + current_rect.top,      in_rect.top);
+            tile_rect.right  = (std::min)(out_rect.left + current_rect.right,    in_rect.left + input_worldP->width);
+            tile_rect.bottom = (std::min)(out_rect.top  + current_rect.bottom,   in_rect.top  + input_worldP->height);
+
+            // フレームの左上（レイヤー座標）。入力がレイヤーの端で切れて揃っていないときは
+            // その外側を透明の黒で補う（どのタイルでも同じ内容になる）
+            const TileRequirements align = SmartRenderAlignment(qi);
+            const A_long frame_x0 = AlignDownL(in_rect.left, align.align_x);
+            const A_long frame_y0 = AlignDownL(in_rect.top,  align.align_y);
+            const A_long pad_x    = in_rect.left - frame_x0;
+            const A_long pad_y    = in_rect.top  - frame_y0;
+            const A_long width    = pad_x + input_worldP->width;
+            const A_long height   = pad_y + input_worldP->height;
+
+            MyDebugLog("### SR: tile L=%ld, T=%ld, R=%ld, B=%ld, frame L=%ld, T=%ld, W=%ld, H=%ld",
+                tile_rect.left,
+                tile_rect.top,
+                tile_rect.right,
+                tile_rect.bottom,
+                frame_x0,
+                frame_y0,
+                width,
+                height);
+
+            // 矩形が空の場合は何もしない
+            if (tile_rect.left < tile_rect.right && tile_rect.top < tile_rect.bottom) {
+                try {
+                    const PF_Pixel8 *src = WorldRow(input_worldP, 0);
+                    std::ptrdiff_t src_row_bytes = input_worldP->rowbytes;
+
+                    std::vector<PF_Pixel8> padded;
+                    if (pad_x > 0 || pad_y > 0) {
+                        padded.resize(static_cast<std::size_t>(width) * static_cast<std::size_t>(height),
+                                      PF_Pixel8{});
+                        for (A_long y = 0; y < input_worldP->height; ++y) {
+                            std::copy(WorldRow(input_worldP, y),
+                                      WorldRow(input_worldP, y) + input_worldP->width,
+                                      padded.begin() + (pad_y + y) * width + pad_x);
+                        }
+                        src           = padded.data();
+                        src_row_bytes = static_cast<std::ptrdiff_t>(width) *
+                                        static_cast<std::ptrdiff_t>(sizeof(PF_Pixel8));
+                    }
+
+                    FilterRefcon refcon{};
+                    PrepareRefcon(refcon, qi, frame_x0, frame_y0);
+
+                    MSX1PQCore::PixelLayout layout;
+                    layout.stride = static_cast<std::ptrdiff_t>(sizeof(PF_Pixel8));
+                    layout.r      = static_cast<int>(offsetof(PF_Pixel8, red));
+                    layout.g      = static_cast<int>(offsetof(PF_Pixel8, green));
+                    layout.b      = static_cast<int>(offsetof(PF_Pixel8, blue));
+
+                    // 量子化と 8dot 処理の帯をホストのスレッドで並列に処理する
+                    HostExecutorContext host{in_dataP, out_data};
+                    MSX1PQCore::Executor executor;
+                    executor.run     = RunOnHostThreads;
+                    executor.run_ctx = &host;
+
+                    const MSX1PQCore::EightDotSearch search = MSX1PQCore::make_eightdot_search(qi);
+
+                    std::vector<std::uint8_t> indices(
+                        static_cast<std::size_t>(width) * static_cast<std::size_t>(height));
+                    if (!MSX1PQCore::render_frame(refcon.plan,
+                                                  reinterpret_cast<const std::uint8_t*>(src),
+                                                  src_row_bytes,
+                                                  layout,
+                                                  width,
+                                                  height,
+                                                  indices.data(),
+                                                  width,
+                                                  &search,
+                                                  &executor)) {
+                        err = PF_Err_OUT_OF_MEMORY;
+                    }
+
+                    // 描く範囲だけを出力ワールドへ（アルファは入力のまま）
+                    const MSX1PQ::QuantColor *palette = MSX1PQCore::get_output_palette(refcon.plan.qi);
+                    for (A_long y = tile_rect.top; !err && y < tile_rect.bottom; ++y) {
+                        const PF_Pixel8 *in_row  = WorldRow(input_worldP, y - in_rect.top);
+                        PF_Pixel8       *out_row = WorldRow(output_worldP, y - out_rect.top);
+                        const std::uint8_t *idx_row =
+                            indices.data() + static_cast<std::size_t>(y - frame_y0) * width;
+
+                        for (A_long x = tile_rect.left; x < tile_rect.right; ++x) {
+                            const MSX1PQ::QuantColor &qc = palette[idx_row[x - frame_x0]];
+                            PF_Pixel8 &outP = out_row[x - out_rect.left];
+                            outP.alpha = in_row[x - in_rect.left].alpha;
+                            outP.red   = qc.r;
+                            outP.green = qc.g;
+                            outP.blue  = qc.b;
+                        }
+                    }
+                } catch (const std::bad_alloc&) {
+                    err = PF_Err_OUT_OF_MEMORY;
+                }
             }
         }
     }
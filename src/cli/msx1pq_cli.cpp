@@ -1,15 +1,25 @@
 #include <algorithm>
 #include <array>
+#include <atomic>
 #include <cctype>
+#include <cmath>
+#include <cstddef>
+#include <chrono>
+#include <condition_variable>
 #include <cstdlib>
+#include <deque>
 #include <filesystem>
 #include <fstream>
+#include <iomanip>
 #include <iostream>
 #include <map>
+#include <memory>
+#include <mutex>
 #include <optional>
 #include <stdexcept>
 #include <string>
 #include <sstream>
+#include <thread>
 #include <vector>
 
 #include "../core/MSX1PQCore.h"
@@ -23,6 +33,7 @@ struct CliOptions {
     fs::path output_dir;
     std::string output_prefix;
     bool force{false};
+    bool skip_existing{false};
 
     int color_system{MSX1PQCore::MSX1PQ_COLOR_SYS_MSX1};
     bool out_sc5{false};
@@ -31,6 +42,26 @@ struct CliOptions {
     bool use_palette_color{false};
     bool use_dark_dither{true};
     bool use_preprocess{true};
+    bool use_full_lut{false};
+    bool use_palette_grid{false};
+    bool bench_search{false};
+    bool check_kernels{false};
+    bool eightdot_stats{false};
+    bool eightdot_exhaustive{false};
+    bool bench_8dot{false};
+    bool eightdot_repair{false};
+    bool validate_only{false};
+    int eightdot_beam{0};
+    int threads{0}; // 0: default_thread_count()
+    int jobs{1};    // 同時に処理するファイル数（0: default_thread_count()）
+    // --pipeline: 読み込み・量子化・書き出しの各段のスレッド数（0 ならパイプラインを使わない）
+    int pipeline_read{0};
+    int pipeline_compute{0};
+    int pipeline_write{0};
+    bool pipeline_stats{false};
+    int attr_cell_height{MSX1PQCore::ATTRCELL_HEIGHT};
+    float attr_lambda{static_cast<float>(MSX1PQCore::ATTR_LAMBDA)};
+    float transition_lambda{static_cast<float>(MSX1PQCore::TRANSITION_LAMBDA)};
     int use_8dot2col{MSX1PQCore::MSX1PQ_EIGHTDOT_MODE_BEST1};
     bool use_hsb{true};
     float weight_h{1.0f};
@@ -42,9 +73,10 @@ struct CliOptions {
     float pre_highlight{1.0f};
     float pre_hue{0.0f};
     fs::path pre_lut_path;
-    std::vector<std::uint8_t> pre_lut_data;
-    std::vector<float> pre_lut3d_data;
-    int pre_lut3d_size{0};
+    bool lut_cache{false};
+    MSX1PQCore::PreLutData pre_lut;
+    int bake_preprocess{0}; // 0: なし / 33 / 65 / MSX1PQCore::PREPROCESS_LUT_EXACT
+    MSX1PQCore::PreprocessLut baked_preprocess;
 };
 
 struct RgbaPixel {
@@ -55,6 +87,31 @@ struct RgbaPixel {
 };
 static_assert(sizeof(RgbaPixel) == 4, "RgbaPixel must be tightly packed");
 
+// デコードした RGBA の面。lodepng が確保した領域をそのまま持ち、量子化・RGB への展開・
+// エンコードまでこの上で行う（RgbaPixel は 4 バイト詰めなのでそのまま読み替えられる）
+struct RgbaImage {
+    struct FreeDeleter {
+        void operator()(unsigned char* p) const { std::free(p); }
+    };
+    std::unique_ptr<unsigned char, FreeDeleter> data;
+    unsigned width{0};
+    unsigned height{0};
+
+    const unsigned char* bytes() const { return data.get(); }
+    RgbaPixel* pixels() { return reinterpret_cast<RgbaPixel*>(data.get()); }
+    std::size_t num_pixels() const { return static_cast<std::size_t>(width) * height; }
+};
+
+// 量子化結果: パレットインデックスの面と、インデックスが指すパレット
+// （92色モード以外は基本15色インデックス。RGB へは出力直前にだけ展開する）
+struct IndexedImage {
+    std::vector<std::uint8_t> indices; // [y * width + x]
+    const MSX1PQ::QuantColor* palette{nullptr};
+    int num_colors{0};
+    unsigned width{0};
+    unsigned height{0};
+};
+
 namespace {
 
 std::string to_lower_copy(const std::string& s);
@@ -112,7 +169,13 @@ void print_usage(const char* prog, UsageLanguage lang = UsageLanguage::Japanese)
                   << "  --dither / --no-dither       (デフォルト: dither)\n"
                   << "  --dark-dither / --no-dark-dither (デフォルト: ダークディザーパレットを使用)\n"
                   << "  --no-preprocess             前処理をスキップ\n"
-                  << "  --8dot <none|fast|basic|best|best-attr|best-trans> (デフォルト: best)\n"
+                  << "  --8dot <none|fast|basic|best|best-attr|best-trans|best-viterbi> (デフォルト: best)\n"
+                  << "  --8dot-beam <N>              best-viterbi で各ブロックに残す候補数 (デフォルト: 0 = 全候補で厳密解)\n"
+                  << "  --attr-cell-height <1-64>    best 系の 8dot で使うセルの高さ (デフォルト: 8)\n"
+                  << "  --attr-lambda <0-1000>       best 系の 8dot でセル傾向に掛ける重み (デフォルト: 0.3 0 で無効)\n"
+                  << "  --transition-lambda <0-1000> best-attr/best-trans/best-viterbi の左右遷移ペナルティの重み (デフォルト: 1.0 0 で無効)\n"
+                  << "  --8dot-repair                3色以上の8ドットを含むセルの行だけに 8dot 処理を行う (結果は同じ)\n"
+                  << "  --validate-only              変換せず、入力が横8ドット2色の制限を満たすか検査してJSONで出力\n"
                   << "  --distance <rgb|hsb>         (デフォルト: hsb)\n"
                   << "  --weight-h <0-1> --weight-s <0-1> --weight-b <0-1>\n"
                   << "  --pre-posterize <0-255>      前処理でポスタリゼーションを適用 (デフォルト: 16 1以下は処理なし)\n"
@@ -121,8 +184,22 @@ void print_usage(const char* prog, UsageLanguage lang = UsageLanguage::Japanese)
                   << "  --pre-highlight <0-10>       処理前にハイライトを明るく補正 (デフォルト: 1.0)\n"
                   << "  --pre-hue <-180-180>         処理前に色相を変更 (デフォルト: 0.0)\n"
                   << "  --pre-lut <ファイル>           処理前にRGB LUT(256行のRGB値)や.cube 3D LUTを適用\n"
+                  << "  --lut-cache                  .cubeの解析結果を同じ場所の.lutbinにキャッシュして次回から再利用\n"
+                  << "  --bake-preprocess <33|65|exact> 前処理全体を3D LUTに焼き込んで適用 (33/65は近似, exactは48MBで完全一致)\n"
+                  << "  --threads <N>                量子化と 8dot 処理に使うスレッド数 (デフォルト: 0 = 使えるCPU数)\n"
                   << "  --palette92                  (開発用) ディザ処理を行わず92色パレットで出力\n"
+                  << "  --full-lut                   RGB全色の探索結果テーブル(16MB)を事前構築して使用 (大量のフレーム向け)\n"
+                  << "  --palette-grid               省メモリの候補グリッドでパレット探索を高速化\n"
+                  << "  --bench-search               (開発用) 入力画像でパレット探索方式(走査/グリッド/全色テーブル)の速度を比較\n"
+                  << "  --check-kernels              (開発用) 特殊化カーネルと汎用経路の結果が全モードで一致するか確認 (不一致なら終了コード 1)\n"
+                  << "  --8dot-stats                 (開発用) 8dot のペア探索で打ち切った候補の割合を表示\n"
+                  << "  --8dot-exhaustive            (開発用) 8dot のペア探索を打ち切らず総当たりで行う\n"
+                  << "  --bench-8dot                 (開発用) 入力画像で best-trans と best-viterbi のスコアと速度を比較\n"
+                  << "  -j, --jobs <N>               同時に処理するファイル数 (デフォルト: 1 0 = 使えるCPU数)\n"
+                  << "  --pipeline <R,C,W>           読み込み・量子化・書き出しを別スレッド(各段 R/C/W 本)で重ねて処理\n"
+                  << "  --pipeline-stats             (開発用) パイプラインの段ごとの稼働率を表示\n"
                   << "  -f, --force                  上書き時に確認しない\n"
+                  << "  --skip-existing              既存の出力ファイルは確認せずにスキップ\n"
                   << "  -v, --version                バージョン情報を表示\n"
                   << "  -h, --help                   ロケールに応じてUSAGEを表示\n"
                   << "  --help-ja                    この日本語のUSAGEを表示\n"
@@ -142,9 +219,22 @@ void print_usage(const char* prog, UsageLanguage lang = UsageLanguage::Japanese)
               << "  --color-system <msx1|msx2>   (default: msx1)\n"
               << "  --dither / --no-dither       (default: dither)\n"
               << "  --palette92                  (for dev) Output 92 color palette without dithering\n"
+              << "  --full-lut                   Prebuild a 16MB table of palette search results for all RGB colors (for large batches)\n"
+              << "  --palette-grid               Speed up the palette search with a low-memory candidate grid\n"
+              << "  --bench-search               (for dev) Compare palette search methods (scan/grid/full table) on the inputs\n"
+              << "  --check-kernels              (for dev) Check the specialized span kernels against the generic path in every mode (exit code 1 on mismatch)\n"
+              << "  --8dot-stats                 (for dev) Report how many candidate pairs the 8dot search pruned\n"
+              << "  --8dot-exhaustive            (for dev) Score every candidate pair in the 8dot search (no pruning)\n"
+              << "  --bench-8dot                 (for dev) Compare score and speed of best-trans and best-viterbi on the inputs\n"
               << "  --dark-dither / --no-dark-dither (default: use dark dither palettes)\n"
               << "  --no-preprocess             Skip preprocessing adjustments\n"
-              << "  --8dot <none|fast|basic|best|best-attr|best-trans> (default: best)\n"
+              << "  --8dot <none|fast|basic|best|best-attr|best-trans|best-viterbi> (default: best)\n"
+              << "  --8dot-beam <N>              Candidates kept per block by best-viterbi (default: 0 = all, exact)\n"
+              << "  --attr-cell-height <1-64>    Attribute cell height used by the best 8dot modes (default: 8)\n"
+              << "  --attr-lambda <0-1000>       Weight of the cell tendency in the best 8dot modes (default: 0.3, 0 disables)\n"
+              << "  --transition-lambda <0-1000> Weight of the left/right transition penalty in best-attr/best-trans/best-viterbi (default: 1.0, 0 disables)\n"
+              << "  --8dot-repair                Run the 8dot stage only on cell rows containing 8-dot blocks with 3+ colors (same result)\n"
+              << "  --validate-only              Do not convert; check the inputs against the 2-colors-per-8-dots rule and write a JSON report\n"
               << "  --distance <rgb|hsb>         (default: hsb)\n"
               << "  --weight-h <0-1> --weight-s <0-1> --weight-b <0-1>\n"
               << "  --pre-posterize <0-255>      Apply posterization before processing (default: 16,  skipped if <= 1)\n"
@@ -153,7 +243,14 @@ void print_usage(const char* prog, UsageLanguage lang = UsageLanguage::Japanese)
               << "  --pre-highlight <0-10>       Brighten highlights before processing (default: 1.0)\n"
               << "  --pre-hue <-180-180>         Adjust hue before processing (default: 0.0)\n"
               << "  --pre-lut <file>             Apply RGB LUT (256 rows) or .cube 3D LUT before processing\n"
+              << "  --lut-cache                  Cache the parsed .cube in a .lutbin next to it and reuse it on later runs\n"
+              << "  --bake-preprocess <33|65|exact> Bake the whole preprocess chain into one 3D LUT (33/65: approximate, exact: 48MB, identical)\n"
+              << "  --threads <N>                Threads used for quantizing and the 8dot stage (default: 0 = available CPUs)\n"
+              << "  -j, --jobs <N>               Number of files processed at the same time (default: 1, 0 = available CPUs)\n"
+              << "  --pipeline <R,C,W>           Overlap reading, quantizing and writing on R/C/W threads per stage\n"
+              << "  --pipeline-stats             (for dev) Report the utilization of each pipeline stage\n"
               << "  -f, --force                  Overwrite without confirmation\n"
+              << "  --skip-existing              Skip existing outputs without confirmation\n"
               << "  -v, --version                Show version information\n"
               << "  -h, --help                   Show usage based on locale (Japanese if detected)\n"
               << "  --help-ja                    この日本語のUSAGEを表示\n"
@@ -172,6 +269,7 @@ std::optional<int> parse_8dot_mode(const std::string& value) {
         {"best", MSX1PQCore::MSX1PQ_EIGHTDOT_MODE_BEST1},
         {"best-attr", MSX1PQCore::MSX1PQ_EIGHTDOT_MODE_ATTR_BEST},
         {"best-trans", MSX1PQCore::MSX1PQ_EIGHTDOT_MODE_PENALTY_BEST},
+        {"best-viterbi", MSX1PQCore::MSX1PQ_EIGHTDOT_MODE_VITERBI},
     };
 
     auto it = kMap.find(value);
@@ -221,6 +319,49 @@ bool parse_arguments(int argc, char** argv, CliOptions& opts) {
             opts.use_dither = false;
         } else if (arg == "--palette92") {
             opts.use_palette_color = true;
+        } else if (arg == "--full-lut") {
+            opts.use_full_lut = true;
+        } else if (arg == "--palette-grid") {
+            opts.use_palette_grid = true;
+        } else if (arg == "--check-kernels") {
+            opts.check_kernels = true;
+        } else if (arg == "--bench-search") {
+            opts.bench_search = true;
+        } else if (arg == "--8dot-stats") {
+            opts.eightdot_stats = true;
+        } else if (arg == "--8dot-exhaustive") {
+            opts.eightdot_exhaustive = true;
+        } else if (arg == "--8dot-beam") {
+            opts.eightdot_beam = std::stoi(require_value(arg));
+            if (opts.eightdot_beam < 0) {
+                throw std::runtime_error("--8dot-beam must be 0 or greater");
+            }
+        } else if (arg == "--attr-cell-height") {
+            opts.attr_cell_height = std::stoi(require_value(arg));
+            if (opts.attr_cell_height < 1 || opts.attr_cell_height > MSX1PQCore::MAX_ATTRCELL_HEIGHT) {
+                throw std::runtime_error("--attr-cell-height must be between 1 and 64");
+            }
+        } else if (arg == "--attr-lambda") {
+            opts.attr_lambda = std::stof(require_value(arg));
+            if (!(opts.attr_lambda >= 0.0f && opts.attr_lambda <= 1000.0f)) {
+                throw std::runtime_error("--attr-lambda must be between 0 and 1000");
+            }
+        } else if (arg == "--transition-lambda") {
+            opts.transition_lambda = std::stof(require_value(arg));
+            if (!(opts.transition_lambda >= 0.0f && opts.transition_lambda <= 1000.0f)) {
+                throw std::runtime_error("--transition-lambda must be between 0 and 1000");
+            }
+        } else if (arg == "--threads") {
+            opts.threads = std::stoi(require_value(arg));
+            if (opts.threads < 0) {
+                throw std::runtime_error("--threads must be 0 or greater");
+            }
+        } else if (arg == "--8dot-repair") {
+            opts.eightdot_repair = true;
+        } else if (arg == "--validate-only") {
+            opts.validate_only = true;
+        } else if (arg == "--bench-8dot") {
+            opts.bench_8dot = true;
         } else if (arg == "--dark-dither") {
             opts.use_dark_dither = true;
         } else if (arg == "--no-dark-dither") {
@@ -260,8 +401,40 @@ bool parse_arguments(int argc, char** argv, CliOptions& opts) {
             opts.pre_hue = std::stof(require_value(arg));
         } else if (arg == "--pre-lut") {
             opts.pre_lut_path = require_value(arg);
+        } else if (arg == "--lut-cache") {
+            opts.lut_cache = true;
+        } else if (arg == "--bake-preprocess") {
+            std::string value = require_value(arg);
+            if (value == "33") {
+                opts.bake_preprocess = 33;
+            } else if (value == "65") {
+                opts.bake_preprocess = 65;
+            } else if (value == "exact") {
+                opts.bake_preprocess = MSX1PQCore::PREPROCESS_LUT_EXACT;
+            } else {
+                throw std::runtime_error("Unknown bake size: " + value);
+            }
+        } else if (arg == "--jobs" || arg == "-j") {
+            opts.jobs = std::stoi(require_value(arg));
+            if (opts.jobs < 0) {
+                throw std::runtime_error("--jobs must be 0 or greater");
+            }
+        } else if (arg == "--pipeline") {
+            const std::string value = require_value(arg);
+            char sep1 = 0;
+            char sep2 = 0;
+            std::istringstream iss(value);
+            if (!(iss >> opts.pipeline_read >> sep1 >> opts.pipeline_compute >> sep2 >> opts.pipeline_write) ||
+                sep1 != ',' || sep2 != ',' || !iss.eof() ||
+                opts.pipeline_read < 1 || opts.pipeline_compute < 1 || opts.pipeline_write < 1) {
+                throw std::runtime_error("--pipeline expects three thread counts of 1 or more (e.g. 1,2,1): " + value);
+            }
+        } else if (arg == "--pipeline-stats") {
+            opts.pipeline_stats = true;
         } else if (arg == "--force" || arg == "-f") {
             opts.force = true;
+        } else if (arg == "--skip-existing") {
+            opts.skip_existing = true;
         } else if (arg == "--version" || arg == "-v") {
             print_version(argv[0]);
             return false;
@@ -283,6 +456,14 @@ bool parse_arguments(int argc, char** argv, CliOptions& opts) {
         throw std::runtime_error("--input and --output are required");
     }
 
+    if (opts.pipeline_read > 0 && opts.jobs != 1) {
+        throw std::runtime_error("--pipeline and --jobs cannot be used together");
+    }
+
+    if (opts.force && opts.skip_existing) {
+        throw std::runtime_error("--force and --skip-existing cannot be used together");
+    }
+
     if (opts.out_sc2 && opts.out_sc5) {
         throw std::runtime_error("--out-sc2 and --out-sc5 cannot be used together");
     }
@@ -318,7 +499,19 @@ bool confirm_overwrite(const fs::path& path) {
     return c == 'y';
 }
 
-void quantize_image(std::vector<RgbaPixel>& pixels, unsigned width, unsigned height, const CliOptions& opts) {
+// 出力を書いてよいか。--force なら常に書き、--skip-existing なら既存ファイルを確認せずに
+// 飛ばす。どちらも無ければ尋ねる（--jobs のワーカーを止めないよう、処理の前に呼ぶ）
+bool allow_output(const fs::path& path, const CliOptions& opts) {
+    if (opts.force || !fs::exists(path)) {
+        return true;
+    }
+    if (opts.skip_existing) {
+        return false;
+    }
+    return confirm_overwrite(path);
+}
+
+MSX1PQCore::QuantInfo make_quant_info(const CliOptions& opts) {
     MSX1PQCore::QuantInfo qi{};
     qi.use_dither      = opts.use_dither;
     qi.use_palette_color = opts.use_palette_color;
@@ -334,75 +527,120 @@ void quantize_image(std::vector<RgbaPixel>& pixels, unsigned width, unsigned hei
     qi.pre_hue         = opts.pre_hue;
     qi.use_dark_dither = opts.use_dark_dither;
     qi.color_system    = opts.color_system;
-    qi.pre_lut         = opts.pre_lut_data.empty() ? nullptr : opts.pre_lut_data.data();
-    qi.pre_lut3d       = opts.pre_lut3d_data.empty() ? nullptr : opts.pre_lut3d_data.data();
-    qi.pre_lut3d_size  = opts.pre_lut3d_size;
-
-    for (unsigned y = 0; y < height; ++y) {
-        for (unsigned x = 0; x < width; ++x) {
-            RgbaPixel& px = pixels[y * width + x];
-            std::uint8_t r = px.red;
-            std::uint8_t g = px.green;
-            std::uint8_t b = px.blue;
-
-            if (opts.use_preprocess) {
-                MSX1PQCore::apply_preprocess(&qi, r, g, b);
-            }
-            const MSX1PQ::QuantColor& qc = MSX1PQCore::quantize_pixel(
-                qi,
-                r,
-                g,
-                b,
-                static_cast<std::int32_t>(x),
-                static_cast<std::int32_t>(y));
-
-            px.red   = qc.r;
-            px.green = qc.g;
-            px.blue  = qc.b;
-        }
-    }
-
-    if (!qi.use_palette_color &&
-        qi.use_8dot2col != MSX1PQCore::MSX1PQ_EIGHTDOT_MODE_NONE) {
-        const std::ptrdiff_t pitch = static_cast<std::ptrdiff_t>(width);
-        const std::int32_t w = static_cast<std::int32_t>(width);
-        const std::int32_t h = static_cast<std::int32_t>(height);
-
-        switch (qi.use_8dot2col) {
-        case MSX1PQCore::MSX1PQ_EIGHTDOT_MODE_FAST1:
-            MSX1PQCore::apply_8dot2col_fast1(pixels.data(), pitch, w, h, qi.color_system);
-            break;
-        case MSX1PQCore::MSX1PQ_EIGHTDOT_MODE_BASIC1:
-            MSX1PQCore::apply_8dot2col_basic1(pixels.data(), pitch, w, h, qi.color_system);
-            break;
-        case MSX1PQCore::MSX1PQ_EIGHTDOT_MODE_BEST1:
-            MSX1PQCore::apply_8dot2col_best1(pixels.data(), pitch, w, h, qi.color_system);
-            break;
-        case MSX1PQCore::MSX1PQ_EIGHTDOT_MODE_ATTR_BEST:
-            MSX1PQCore::apply_8dot2col_attr_best(pixels.data(), pitch, w, h, qi.color_system);
-            break;
-        case MSX1PQCore::MSX1PQ_EIGHTDOT_MODE_PENALTY_BEST:
-            MSX1PQCore::apply_8dot2col_attr_best_penalty(pixels.data(), pitch, w, h, qi.color_system);
-            break;
-        default:
-            break;
-        }
-    }
-}
-
-bool write_png(const fs::path& output_path, const std::vector<RgbaPixel>& pixels, unsigned width, unsigned height) {
-    std::vector<unsigned char> raw;
-    raw.reserve(pixels.size() * 4);
-    for (const auto& p : pixels) {
-        raw.push_back(p.red);
-        raw.push_back(p.green);
-        raw.push_back(p.blue);
-        raw.push_back(p.alpha);
-    }
-
-    const unsigned error = lodepng::encode(output_path.string(), raw, width, height);
+    qi.pre_lut         = opts.pre_lut.lut1d.empty() ? nullptr : opts.pre_lut.lut1d.data();
+    qi.pre_lut3d       = opts.pre_lut.lut3d_data;
+    qi.pre_lut3d_size  = opts.pre_lut.lut3d_size;
+    qi.attr_cell_height  = opts.attr_cell_height;
+    qi.attr_lambda       = opts.attr_lambda;
+    qi.transition_lambda = opts.transition_lambda;
+    return qi;
+}
+
+// 入力ごとに変わらない量子化の準備（前処理の計画・全色テーブル・候補グリッド）。
+// 作った後は読み取り専用なので、--jobs のワーカーから同時に使ってよい。
+struct QuantContext {
+    QuantContext() = default;
+    QuantContext(const QuantContext&) = delete;
+    QuantContext& operator=(const QuantContext&) = delete;
+
+    MSX1PQCore::QuantPlan plan;
+    std::shared_ptr<const MSX1PQCore::NearestIndexLut> nearest_lut;
+    MSX1PQCore::PaletteGrid grid; // plan.qi.palette_grid が指す
+};
+
+// with_8dot が false なら量子化だけを行う計画にする（8dot 処理は呼び出し側で行う）
+void prepare_quant_context(const CliOptions& opts, bool with_8dot, QuantContext& ctx) {
+    // 前処理の派生定数と処理関数は一度だけ決めておく
+    // （ポスタリゼーション有効時は色ごとの結果テーブル参照になる）
+    MSX1PQCore::QuantPlan& plan = ctx.plan;
+    MSX1PQCore::compile_quant_plan(make_quant_info(opts), opts.use_preprocess, plan);
+    MSX1PQCore::QuantInfo& qi = plan.qi;
+    if (!with_8dot) {
+        qi.use_8dot2col = MSX1PQCore::MSX1PQ_EIGHTDOT_MODE_NONE;
+    }
+    if (opts.baked_preprocess.size > 0) {
+        MSX1PQCore::attach_preprocess_lut(plan, opts.baked_preprocess);
+    }
+
+    // テーブル参照にならない場合は RGB 全色の探索結果テーブルを使う（プロセス内で共有）
+    if (opts.use_full_lut && !plan.use_table) {
+        ctx.nearest_lut = MSX1PQCore::acquire_nearest_index_lut(qi);
+        qi.nearest_lut = ctx.nearest_lut->indices.data();
+    }
+
+    if (opts.use_palette_grid && !plan.use_table && !qi.nearest_lut &&
+        MSX1PQCore::build_palette_grid(qi, ctx.grid)) {
+        qi.palette_grid = &ctx.grid;
+    }
+
+    // 探索方法が決まったので、設定の組み合わせに合う特殊化カーネルを一度だけ選ぶ
+    // （.cube の 3D LUT は行単位でまとめて適用される）
+    plan.span_kernel = MSX1PQCore::select_span_kernel(plan);
+}
+
+// インデックスの面を作る。8dot 処理は ctx の計画のモードで行う
+// （作業面を確保できず書けなかった帯があれば false）
+bool quantize_image_indices(const QuantContext& ctx, const RgbaImage& frame, const CliOptions& opts, IndexedImage& out,
+                            const MSX1PQCore::EightDotSearch* search) {
+    const unsigned width  = frame.width;
+    const unsigned height = frame.height;
+    const MSX1PQCore::QuantPlan& plan = ctx.plan;
+    const MSX1PQCore::QuantInfo& qi = plan.qi;
+
+    MSX1PQCore::PixelLayout layout;
+    layout.stride = static_cast<std::ptrdiff_t>(sizeof(RgbaPixel));
+    layout.r      = static_cast<int>(offsetof(RgbaPixel, red));
+    layout.g      = static_cast<int>(offsetof(RgbaPixel, green));
+    layout.b      = static_cast<int>(offsetof(RgbaPixel, blue));
+
+    out.palette    = MSX1PQCore::get_output_palette(qi);
+    out.num_colors = qi.use_palette_color ? MSX1PQ::kNumQuantColors : MSX1PQ::kNumBasicColors;
+    out.width      = width;
+    out.height     = height;
+    out.indices.resize(static_cast<std::size_t>(width) * height);
+
+    // 全幅の帯ごとに量子化と 8dot 処理をまとめて並列に描く（結果はスレッド数によらない）
+    MSX1PQCore::Executor executor;
+    executor.num_threads = opts.threads;
+
+    return MSX1PQCore::render_frame(plan,
+                                    frame.bytes(),
+                                    static_cast<std::ptrdiff_t>(width) * layout.stride,
+                                    layout,
+                                    static_cast<std::int32_t>(width),
+                                    static_cast<std::int32_t>(height),
+                                    out.indices.data(),
+                                    static_cast<std::ptrdiff_t>(width),
+                                    search,
+                                    &executor);
+}
+
+bool quantize_image(const QuantContext& ctx, const RgbaImage& frame, const CliOptions& opts, IndexedImage& out,
+                    MSX1PQCore::EightDotStats* stats) {
+    // 8dot 処理も基本15色インデックスの面のまま行う
+    MSX1PQCore::EightDotSearch search;
+    search.prune       = !opts.eightdot_exhaustive;
+    search.stats       = stats;
+    search.beam_width  = opts.eightdot_beam;
+    search.repair_only = opts.eightdot_repair;
+    return quantize_image_indices(ctx, frame, opts, out, &search);
+}
+
+// インデックスの面を RGB に展開する（アルファは元の値を残す）
+void expand_indexed_image(const IndexedImage& image, RgbaImage& frame) {
+    RgbaPixel* pixels = frame.pixels();
+    for (std::size_t i = 0; i < image.indices.size(); ++i) {
+        const MSX1PQ::QuantColor& qc = image.palette[image.indices[i]];
+        pixels[i].red   = qc.r;
+        pixels[i].green = qc.g;
+        pixels[i].blue  = qc.b;
+    }
+}
+
+bool write_png(const fs::path& output_path, const RgbaImage& frame, std::ostream& err) {
+    const unsigned error = lodepng::encode(output_path.string(), frame.bytes(), frame.width, frame.height);
     if (error) {
-        std::cerr << "Failed to write PNG: " << output_path << " (" << lodepng_error_text(error) << ")\n";
+        err << "Failed to write PNG: " << output_path << " (" << lodepng_error_text(error) << ")\n";
         return false;
     }
     return true;
@@ -444,13 +682,23 @@ int nearest_palette_index(const std::array<MSX1PQ::QuantColor, 16>& palette, con
     return best_idx;
 }
 
-bool write_sc5(const fs::path& output_path, const std::vector<RgbaPixel>& pixels, unsigned width, unsigned height, int color_system) {
+bool write_sc5(const fs::path& output_path, const IndexedImage& image, int color_system, std::ostream& err) {
     const auto palette = make_sc5_palette(color_system);
 
+    // 量子化パレットの各色 → SC5 カラーコード（色数ぶんだけ探索する）
+    std::vector<std::uint8_t> code_of(static_cast<size_t>(image.num_colors));
+    for (int i = 0; i < image.num_colors; ++i) {
+        RgbaPixel px{};
+        px.red   = image.palette[i].r;
+        px.green = image.palette[i].g;
+        px.blue  = image.palette[i].b;
+        code_of[static_cast<size_t>(i)] = static_cast<std::uint8_t>(nearest_palette_index(palette, px));
+    }
+
     std::vector<std::uint8_t> color_codes(static_cast<size_t>(kSc5Width * kSc5Height), 0);
 
-    const int copy_width = static_cast<int>(std::min<unsigned>(kSc5Width, width));
-    const int copy_height = static_cast<int>(std::min<unsigned>(kSc5Height, height));
+    const int copy_width = static_cast<int>(std::min<unsigned>(kSc5Width, image.width));
+    const int copy_height = static_cast<int>(std::min<unsigned>(kSc5Height, image.height));
 
     const int src_offset_x = 0;
     const int src_offset_y = 0;
@@ -463,8 +711,8 @@ bool write_sc5(const fs::path& output_path, const std::vector<RgbaPixel>& pixels
         for (int x = 0; x < copy_width; ++x) {
             const unsigned src_x = static_cast<unsigned>(src_offset_x + x);
             const unsigned dst_x = static_cast<unsigned>(dst_offset_x + x);
-            const RgbaPixel& px = pixels[static_cast<size_t>(src_y * width + src_x)];
-            color_codes[static_cast<size_t>(dst_y * kSc5Width + dst_x)] = static_cast<std::uint8_t>(nearest_palette_index(palette, px));
+            const std::uint8_t idx = image.indices[static_cast<size_t>(src_y * image.width + src_x)];
+            color_codes[static_cast<size_t>(dst_y * kSc5Width + dst_x)] = code_of[idx];
         }
     }
 
@@ -480,7 +728,7 @@ bool write_sc5(const fs::path& output_path, const std::vector<RgbaPixel>& pixels
 
     std::ofstream ofs(output_path, std::ios::binary);
     if (!ofs) {
-        std::cerr << "Failed to open output file: " << output_path << "\n";
+        err << "Failed to open output file: " << output_path << "\n";
         return false;
     }
 
@@ -496,13 +744,13 @@ bool write_sc5(const fs::path& output_path, const std::vector<RgbaPixel>& pixels
 
     ofs.write(reinterpret_cast<const char*>(header), 7);
     if (!ofs) {
-        std::cerr << "Failed to write BSAVE header: " << output_path << "\n";
+        err << "Failed to write BSAVE header: " << output_path << "\n";
         return false;
     }
 
     ofs.write(reinterpret_cast<const char*>(packed.data()), static_cast<std::streamsize>(packed.size()));
     if (!ofs) {
-        std::cerr << "Failed to write SC5 data: " << output_path << "\n";
+        err << "Failed to write SC5 data: " << output_path << "\n";
         return false;
     }
 
@@ -510,24 +758,30 @@ bool write_sc5(const fs::path& output_path, const std::vector<RgbaPixel>& pixels
 }
 
 bool write_sc2(const fs::path& output_path,
-               const std::vector<RgbaPixel>& pixels,
-               unsigned width,
-               unsigned height,
-               int color_system) {
-    std::vector<RgbaPixel> canvas(static_cast<size_t>(kSc2Width * kSc2Height));
-
-    RgbaPixel bg{};
-    bg.red = 0;
-    bg.green = 0;
-    bg.blue = 0;
-    bg.alpha = 255;
+               const IndexedImage& image,
+               int color_system,
+               std::ostream& err) {
+    // 量子化パレットの各色 → 基本15色インデックス（基本15色のときは恒等）
+    std::vector<std::uint8_t> basic_of(static_cast<size_t>(image.num_colors));
+    for (int i = 0; i < image.num_colors; ++i) {
+        const MSX1PQ::QuantColor& c = image.palette[i];
+        basic_of[static_cast<size_t>(i)] = static_cast<std::uint8_t>(
+            MSX1PQCore::find_basic_index_from_rgb(c.r, c.g, c.b, color_system));
+    }
+
+    // 画像外は黒で埋める
+    const std::uint8_t bg_basic = static_cast<std::uint8_t>(
+        MSX1PQCore::find_basic_index_from_rgb(0, 0, 0, color_system));
+
+    std::vector<std::uint8_t> canvas(static_cast<size_t>(kSc2Width * kSc2Height));
 
     for (int y = 0; y < kSc2Height; ++y) {
         for (int x = 0; x < kSc2Width; ++x) {
-            if (y < static_cast<int>(height) && x < static_cast<int>(width)) {
-                canvas[static_cast<size_t>(y * kSc2Width + x)] = pixels[static_cast<size_t>(y * width + x)];
+            if (y < static_cast<int>(image.height) && x < static_cast<int>(image.width)) {
+                canvas[static_cast<size_t>(y * kSc2Width + x)] =
+                    basic_of[image.indices[static_cast<size_t>(y * image.width + x)]];
             } else {
-                canvas[static_cast<size_t>(y * kSc2Width + x)] = bg;
+                canvas[static_cast<size_t>(y * kSc2Width + x)] = bg_basic;
             }
         }
     }
@@ -547,13 +801,13 @@ bool write_sc2(const fs::path& output_path,
 
             for (int ry = 0; ry < 8; ++ry) {
                 const int y_base = ty * 8 + ry;
+                const std::uint8_t* cell_row = canvas.data() + static_cast<std::size_t>(y_base * kSc2Width + tx * 8);
 
                 int color_min = 16;
                 int color_max = -1;
 
                 for (int rx = 0; rx < 8; ++rx) {
-                    const RgbaPixel& px = canvas[static_cast<std::size_t>(y_base * kSc2Width + (tx * 8 + rx))];
-                    const int basic_idx = MSX1PQCore::find_basic_index_from_rgb(px.red, px.green, px.blue, color_system);
+                    const int basic_idx = cell_row[rx];
                     color_min = std::min(color_min, basic_idx);
                     color_max = std::max(color_max, basic_idx);
                 }
@@ -568,9 +822,7 @@ bool write_sc2(const fs::path& output_path,
 
                 std::uint8_t pattern_byte = 0;
                 for (int rx = 0; rx < 8; ++rx) {
-                    const RgbaPixel& px = canvas[static_cast<std::size_t>(y_base * kSc2Width + (tx * 8 + rx))];
-                    const int basic_idx = MSX1PQCore::find_basic_index_from_rgb(px.red, px.green, px.blue, color_system);
-                    const int color_code = basic_idx + 1;
+                    const int color_code = cell_row[rx] + 1;
                     pattern_byte <<= 1;
                     if (color_code == fg_color) {
                         pattern_byte |= 0x01;
@@ -588,7 +840,7 @@ bool write_sc2(const fs::path& output_path,
 
     std::ofstream ofs(output_path, std::ios::binary);
     if (!ofs) {
-        std::cerr << "Failed to open output file: " << output_path << "\n";
+        err << "Failed to open output file: " << output_path << "\n";
         return false;
     }
 
@@ -603,51 +855,766 @@ bool write_sc2(const fs::path& output_path,
 
     ofs.write(reinterpret_cast<const char*>(header), 7);
     if (!ofs) {
-        std::cerr << "Failed to write BSAVE header: " << output_path << "\n";
+        err << "Failed to write BSAVE header: " << output_path << "\n";
         return false;
     }
 
     ofs.write(reinterpret_cast<const char*>(vram.data()), static_cast<std::streamsize>(vram.size()));
     if (!ofs) {
-        std::cerr << "Failed to write SC2 data: " << output_path << "\n";
+        err << "Failed to write SC2 data: " << output_path << "\n";
         return false;
     }
 
     return true;
 }
 
-bool process_file(const fs::path& input, const fs::path& output, const CliOptions& opts) {
-    std::vector<unsigned char> raw;
-    unsigned width = 0;
-    unsigned height = 0;
+// PNG を RGBA の面に読み込む。ファイルは mmap してそのままデコーダに渡す
+bool read_input(const fs::path& input, RgbaImage& frame, std::ostream& err) {
+    // 前のフレームの領域は先に返す（デコード中に 2 枚分持たない）
+    frame.data.reset();
+    frame.width  = 0;
+    frame.height = 0;
+
+    MSX1PQCore::MappedFile file;
+    if (!file.open(input.string())) {
+        err << "Failed to open input file: " << input << "\n";
+        return false;
+    }
 
-    const unsigned error = lodepng::decode(raw, width, height, input.string());
+    unsigned char* decoded = nullptr;
+    const unsigned error = lodepng_decode32(&decoded, &frame.width, &frame.height,
+                                            reinterpret_cast<const unsigned char*>(file.bytes), file.length);
+    frame.data.reset(decoded);
     if (error) {
-        std::cerr << "Failed to read PNG: " << input << " (" << lodepng_error_text(error) << ")\n";
+        err << "Failed to read PNG: " << input << " (" << lodepng_error_text(error) << ")\n";
         return false;
     }
+    return true;
+}
+
+// 量子化結果を出力形式で書く（PNG のときは frame を出力色で上書きしてそのままエンコードする）
+bool write_output(const fs::path& output, const CliOptions& opts, const IndexedImage& image, RgbaImage& frame,
+                  std::ostream& err) {
+    if (opts.out_sc5) {
+        return write_sc5(output, image, opts.color_system, err);
+    }
+    if (opts.out_sc2) {
+        return write_sc2(output, image, opts.color_system, err);
+    }
+    expand_indexed_image(image, frame);
+    return write_png(output, frame, err);
+}
 
-    if (raw.size() != static_cast<size_t>(width * height * 4)) {
-        std::cerr << "Unexpected image size for: " << input << "\n";
+// エラーは err に書く（--jobs / --pipeline では入力順に表示するため呼び出し側で溜める）
+bool process_file(const fs::path& input, const fs::path& output, const CliOptions& opts,
+                  const QuantContext& ctx, MSX1PQCore::EightDotStats* stats, std::ostream& err) {
+    RgbaImage frame;
+    if (!read_input(input, frame, err)) {
         return false;
     }
 
-    std::vector<RgbaPixel> pixels(width * height);
-    for (unsigned i = 0; i < width * height; ++i) {
-        pixels[i].red   = raw[i * 4 + 0];
-        pixels[i].green = raw[i * 4 + 1];
-        pixels[i].blue  = raw[i * 4 + 2];
-        pixels[i].alpha = raw[i * 4 + 3];
+    IndexedImage image;
+    if (!quantize_image(ctx, frame, opts, image, stats)) {
+        err << "Not enough memory to quantize: " << input << "\n";
+        return false;
     }
+    return write_output(output, opts, image, frame, err);
+}
 
-    quantize_image(pixels, width, height, opts);
-    if (opts.out_sc5) {
-        return write_sc5(output, pixels, width, height, opts.color_system);
+double elapsed_ms(std::chrono::steady_clock::time_point start) {
+    const auto end = std::chrono::steady_clock::now();
+    return std::chrono::duration<double, std::milli>(end - start).count();
+}
+
+// ------------------------------------------------------------
+// 読み込み → 量子化 → 書き出しのパイプライン（--pipeline）
+// ------------------------------------------------------------
+
+// 変換する 1 ファイル分の情報と結果
+struct FileJob {
+    fs::path input;
+    fs::path output;
+    std::string message; // 入力順に表示する結果の行
+    std::string errors;  // 処理中のエラー（message の前に標準エラーへ入力順に表示する）
+    bool ok{false};
+    MSX1PQCore::EightDotStats stats;
+};
+
+struct PipelineStageReport {
+    const char* name{""};
+    int threads{0};
+    double busy_ms{0.0};  // 全スレッドで処理していた時間の合計
+    double wait_ms{0.0};  // 前段（読み込みは空きバッファ）を待っていた時間の合計
+};
+
+struct PipelineReport {
+    PipelineStageReport stages[3];
+    int buffers{0};
+    double wall_ms{0.0};
+};
+
+// フレームバッファの番号を渡す FIFO。番号は決まった数しか無いので、
+// キューに溜まるフレームもその数で頭打ちになる
+class SlotQueue {
+public:
+    void push(std::size_t slot) {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            slots_.push_back(slot);
+        }
+        cond_.notify_one();
     }
-    if (opts.out_sc2) {
-        return write_sc2(output, pixels, width, height, opts.color_system);
+
+    // 閉じられて空なら false
+    bool pop(std::size_t& slot) {
+        std::unique_lock<std::mutex> lock(mutex_);
+        cond_.wait(lock, [this] { return !slots_.empty() || closed_; });
+        if (slots_.empty()) {
+            return false;
+        }
+        slot = slots_.front();
+        slots_.pop_front();
+        return true;
+    }
+
+    void close() {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            closed_ = true;
+        }
+        cond_.notify_all();
+    }
+
+private:
+    std::mutex mutex_;
+    std::condition_variable cond_;
+    std::deque<std::size_t> slots_;
+    bool closed_{false};
+};
+
+// 番号 seq の順にだけ取り出せるキュー（書き出しを入力順に始めるため）
+class OrderedSlotQueue {
+public:
+    explicit OrderedSlotQueue(std::size_t count) : slots_(count, kNone) {}
+
+    void push(std::size_t seq, std::size_t slot) {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            slots_[seq] = slot;
+        }
+        cond_.notify_all();
+    }
+
+    // すべての番号を取り出し終えたら false
+    bool pop(std::size_t& seq, std::size_t& slot) {
+        std::unique_lock<std::mutex> lock(mutex_);
+        cond_.wait(lock, [this] { return next_ == slots_.size() || slots_[next_] != kNone; });
+        if (next_ == slots_.size()) {
+            return false;
+        }
+        seq  = next_;
+        slot = slots_[next_];
+        ++next_;
+        cond_.notify_all();
+        return true;
+    }
+
+private:
+    static constexpr std::size_t kNone = static_cast<std::size_t>(-1);
+    std::mutex mutex_;
+    std::condition_variable cond_;
+    std::vector<std::size_t> slots_;
+    std::size_t next_{0};
+};
+
+// jobs[pending[k]] を読み込み・量子化・書き出しの 3 段で重ねて処理する。
+// 段ごとのスレッド数は opts.pipeline_*、フレームバッファは読み込み + 量子化 × 2 + 書き出しの
+// 数だけ作って使い回すので、定常時のメモリはその枚数分で決まる（デコード結果の面は
+// 次のフレームを読む前に返し、インデックスの面は容量を残したまま使い回す）。
+// 読み込みは空きバッファを取ってから入力順の番号を振り、書き出しは番号順に始める。
+// 書き終えたファイルごとに on_done(jobs の添字) を呼ぶ（複数のスレッドから呼ばれる）。
+template <typename OnDone>
+PipelineReport run_pipeline(std::vector<FileJob>& jobs, const std::vector<std::size_t>& pending,
+                            const CliOptions& opts, const QuantContext& ctx, const OnDone& on_done) {
+    struct FrameSlot {
+        std::size_t seq{0};
+        bool ok{false};
+        RgbaImage frame;
+        IndexedImage image;
+    };
+
+    using Clock = std::chrono::steady_clock;
+
+    PipelineReport report;
+    report.stages[0].name    = "read";
+    report.stages[0].threads = opts.pipeline_read;
+    report.stages[1].name    = "quantize";
+    report.stages[1].threads = opts.pipeline_compute;
+    report.stages[2].name    = "write";
+    report.stages[2].threads = opts.pipeline_write;
+    report.buffers = opts.pipeline_read + opts.pipeline_compute * 2 + opts.pipeline_write;
+
+    std::vector<FrameSlot> slots(static_cast<std::size_t>(report.buffers));
+    SlotQueue free_slots;
+    SlotQueue decoded;
+    OrderedSlotQueue quantized(pending.size());
+    for (std::size_t i = 0; i < slots.size(); ++i) {
+        free_slots.push(i);
+    }
+
+    std::mutex report_mutex;
+    const auto add_times = [&](PipelineStageReport& stage, Clock::duration busy, Clock::duration wait) {
+        std::lock_guard<std::mutex> lock(report_mutex);
+        stage.busy_ms += std::chrono::duration<double, std::milli>(busy).count();
+        stage.wait_ms += std::chrono::duration<double, std::milli>(wait).count();
+    };
+
+    std::atomic<std::size_t> next_read{0};
+    std::atomic<int> readers_left{opts.pipeline_read};
+
+    const auto reader = [&]() {
+        Clock::duration busy{};
+        Clock::duration wait{};
+        for (;;) {
+            const Clock::time_point t0 = Clock::now();
+            std::size_t slot = 0;
+            if (!free_slots.pop(slot)) {
+                break;
+            }
+            const std::size_t seq = next_read.fetch_add(1);
+            if (seq >= pending.size()) {
+                break;
+            }
+            const Clock::time_point t1 = Clock::now();
+            FrameSlot& frame = slots[slot];
+            frame.seq = seq;
+            std::ostringstream err;
+            frame.ok  = read_input(jobs[pending[seq]].input, frame.frame, err);
+            jobs[pending[seq]].errors += err.str();
+            decoded.push(slot);
+            busy += Clock::now() - t1;
+            wait += t1 - t0;
+        }
+        if (readers_left.fetch_sub(1) == 1) {
+            decoded.close();
+        }
+        add_times(report.stages[0], busy, wait);
+    };
+
+    const auto quantizer = [&]() {
+        Clock::duration busy{};
+        Clock::duration wait{};
+        for (;;) {
+            const Clock::time_point t0 = Clock::now();
+            std::size_t slot = 0;
+            if (!decoded.pop(slot)) {
+                break;
+            }
+            const Clock::time_point t1 = Clock::now();
+            FrameSlot& frame = slots[slot];
+            FileJob& job = jobs[pending[frame.seq]];
+            if (frame.ok && !quantize_image(ctx, frame.frame, opts, frame.image, &job.stats)) {
+                std::ostringstream err;
+                err << "Not enough memory to quantize: " << job.input << "\n";
+                job.errors += err.str();
+                frame.ok = false;
+            }
+            quantized.push(frame.seq, slot);
+            busy += Clock::now() - t1;
+            wait += t1 - t0;
+        }
+        add_times(report.stages[1], busy, wait);
+    };
+
+    const auto writer = [&]() {
+        Clock::duration busy{};
+        Clock::duration wait{};
+        for (;;) {
+            const Clock::time_point t0 = Clock::now();
+            std::size_t seq = 0;
+            std::size_t slot = 0;
+            if (!quantized.pop(seq, slot)) {
+                break;
+            }
+            const Clock::time_point t1 = Clock::now();
+            FrameSlot& frame = slots[slot];
+            FileJob& job = jobs[pending[seq]];
+            std::ostringstream err;
+            job.ok = frame.ok && write_output(job.output, opts, frame.image, frame.frame, err);
+            job.errors += err.str();
+            free_slots.push(slot);
+            on_done(pending[seq]);
+            busy += Clock::now() - t1;
+            wait += t1 - t0;
+        }
+        add_times(report.stages[2], busy, wait);
+    };
+
+    const Clock::time_point start = Clock::now();
+    std::vector<std::thread> threads;
+    for (int t = 0; t < opts.pipeline_read; ++t) {
+        threads.emplace_back(reader);
+    }
+    for (int t = 0; t < opts.pipeline_compute; ++t) {
+        threads.emplace_back(quantizer);
+    }
+    for (int t = 0; t < opts.pipeline_write; ++t) {
+        threads.emplace_back(writer);
+    }
+    // 読み込みは書き出しが返したバッファを待つので、書き出しが終わってから空きキューを閉じる
+    for (std::size_t t = threads.size() - static_cast<std::size_t>(opts.pipeline_write); t < threads.size(); ++t) {
+        threads[t].join();
+    }
+    free_slots.close();
+    for (std::size_t t = 0; t + static_cast<std::size_t>(opts.pipeline_write) < threads.size(); ++t) {
+        threads[t].join();
+    }
+    report.wall_ms = std::chrono::duration<double, std::milli>(Clock::now() - start).count();
+    return report;
+}
+
+// 段ごとの稼働率（処理時間 / (経過時間 × スレッド数)）を表示する。稼働率が 100% に近い段が律速
+void print_pipeline_report(const PipelineReport& report, std::size_t frames) {
+    std::cout << "Pipeline: " << frames << " frames, " << report.buffers << " frame buffers, "
+              << std::fixed << std::setprecision(1) << report.wall_ms << " ms\n";
+    for (const PipelineStageReport& stage : report.stages) {
+        const double capacity = report.wall_ms * stage.threads;
+        std::cout << "  " << std::left << std::setw(9) << stage.name << std::right
+                  << stage.threads << " thread(s), busy "
+                  << std::setw(5) << (capacity > 0.0 ? 100.0 * stage.busy_ms / capacity : 0.0) << "%, waiting "
+                  << std::setw(5) << (capacity > 0.0 ? 100.0 * stage.wait_ms / capacity : 0.0) << "%\n";
+    }
+}
+
+// 開発用: 前処理後の入力色に対して、パレット探索の各方式の速度と一致を確認する
+bool bench_search_file(const fs::path& input, const CliOptions& opts) {
+    RgbaImage frame;
+    if (!read_input(input, frame, std::cerr)) {
+        return false;
+    }
+    const unsigned char* raw = frame.bytes();
+    const unsigned width  = frame.width;
+    const unsigned height = frame.height;
+
+    const MSX1PQCore::QuantInfo qi = make_quant_info(opts);
+    const std::size_t num_pixels = static_cast<std::size_t>(width) * height;
+
+    std::vector<std::array<std::uint8_t, 3>> colors(num_pixels);
+    for (std::size_t i = 0; i < num_pixels; ++i) {
+        std::uint8_t r = raw[i * 4 + 0];
+        std::uint8_t g = raw[i * 4 + 1];
+        std::uint8_t b = raw[i * 4 + 2];
+        if (opts.use_preprocess) {
+            MSX1PQCore::apply_preprocess(&qi, r, g, b);
+        }
+        colors[i] = {r, g, b};
+    }
+
+    auto run_search = [&colors](const MSX1PQCore::QuantInfo& search_qi, std::vector<std::uint8_t>& out) {
+        out.resize(colors.size());
+        const auto start = std::chrono::steady_clock::now();
+        for (std::size_t i = 0; i < colors.size(); ++i) {
+            out[i] = static_cast<std::uint8_t>(MSX1PQCore::search_palette_index(
+                search_qi, colors[i][0], colors[i][1], colors[i][2]));
+        }
+        return elapsed_ms(start);
+    };
+    auto ns_per_pixel = [num_pixels](double ms) {
+        return (num_pixels > 0) ? ms * 1.0e6 / static_cast<double>(num_pixels) : 0.0;
+    };
+    auto count_mismatch = [](const std::vector<std::uint8_t>& a, const std::vector<std::uint8_t>& b) {
+        std::size_t n = 0;
+        for (std::size_t i = 0; i < a.size(); ++i) {
+            n += (a[i] != b[i]) ? 1 : 0;
+        }
+        return n;
+    };
+
+    std::cout << "Search benchmark: " << input << " (" << num_pixels << " px)\n";
+
+    std::vector<std::uint8_t> scan_result;
+    const double scan_ms = run_search(qi, scan_result);
+    std::cout << "  scan : " << ns_per_pixel(scan_ms) << " ns/px\n";
+
+    MSX1PQCore::PaletteGrid grid;
+    auto start = std::chrono::steady_clock::now();
+    if (MSX1PQCore::build_palette_grid(qi, grid)) {
+        const double build_ms = elapsed_ms(start);
+        MSX1PQCore::QuantInfo grid_qi = qi;
+        grid_qi.palette_grid = &grid;
+
+        std::vector<std::uint8_t> grid_result;
+        const double grid_ms = run_search(grid_qi, grid_result);
+        const double avg_candidates =
+            static_cast<double>(grid.candidates.size()) / (grid.cell_begin.size() - 1);
+        std::cout << "  grid : build " << build_ms << " ms, " << ns_per_pixel(grid_ms)
+                  << " ns/px, " << avg_candidates << " candidates/cell, "
+                  << count_mismatch(scan_result, grid_result) << " mismatches\n";
+    } else {
+        std::cout << "  grid : not applicable (no dither / 92-color search)\n";
+    }
+
+    start = std::chrono::steady_clock::now();
+    const auto nearest_lut = MSX1PQCore::acquire_nearest_index_lut(qi);
+    const double lut_build_ms = elapsed_ms(start);
+    MSX1PQCore::QuantInfo lut_qi = qi;
+    lut_qi.nearest_lut = nearest_lut->indices.data();
+
+    std::vector<std::uint8_t> lut_result;
+    const double lut_ms = run_search(lut_qi, lut_result);
+    std::cout << "  table: build " << lut_build_ms << " ms, " << ns_per_pixel(lut_ms)
+              << " ns/px, " << count_mismatch(scan_result, lut_result) << " mismatches\n";
+    return true;
+}
+
+// 開発用: 特殊化したスパンカーネル（select_span_kernel）が汎用の画素単位の経路
+// （quantize_pixel_plan）と同じ色を返すかを、モードの全組み合わせで確認する。
+// 探索 5 種（ディザ・92色・ダークディザー・HSB 距離・MSX2）× 前処理 4 種（ポスタリゼーション・
+// HSB 補正・1D LUT・3D LUT）の 512 通りそれぞれについて、追加なし・候補グリッド・全色テーブル・
+// 焼き込み前処理 (exact) のカーネルを追加なしの汎用経路と、焼き込み前処理 (65) のカーネルを
+// 同じ計画の汎用経路と比べる。画素は合成した色と入力画像から間引いた色を、負の座標を含む
+// 複数の行に並べて使う。
+bool check_span_kernels(const std::vector<fs::path>& inputs, const CliOptions& opts) {
+    std::vector<RgbaPixel> pixels;
+    for (int r = 0; r <= 16; ++r) {
+        for (int g = 0; g <= 16; ++g) {
+            for (int b = 0; b <= 16; ++b) {
+                pixels.push_back({static_cast<std::uint8_t>(std::min(255, r * 16)),
+                                  static_cast<std::uint8_t>(std::min(255, g * 16)),
+                                  static_cast<std::uint8_t>(std::min(255, b * 16)), 255});
+            }
+        }
+    }
+    std::uint32_t seed = 12345u;
+    for (int i = 0; i < 4096; ++i) {
+        seed = seed * 1664525u + 1013904223u;
+        pixels.push_back({static_cast<std::uint8_t>(seed >> 24), static_cast<std::uint8_t>(seed >> 16),
+                          static_cast<std::uint8_t>(seed >> 8), 255});
+    }
+    constexpr std::size_t kMaxPixelsPerInput = 16384;
+    for (const fs::path& input : inputs) {
+        RgbaImage frame;
+        if (!read_input(input, frame, std::cerr)) {
+            continue;
+        }
+        const std::size_t step = std::max<std::size_t>(1, frame.num_pixels() / kMaxPixelsPerInput);
+        for (std::size_t i = 0; i < frame.num_pixels(); i += step) {
+            pixels.push_back(frame.pixels()[i]);
+        }
+    }
+
+    // 1D / 3D LUT は値が大きく動く合成データ（並びは読み込んだ LUT と同じ形式）
+    std::vector<std::uint8_t> lut1d(256 * 3);
+    for (int v = 0; v < 256; ++v) {
+        lut1d[static_cast<std::size_t>(v) * 3 + 0] = static_cast<std::uint8_t>(255 - v);
+        lut1d[static_cast<std::size_t>(v) * 3 + 1] = static_cast<std::uint8_t>(v * v / 255);
+        lut1d[static_cast<std::size_t>(v) * 3 + 2] = static_cast<std::uint8_t>(std::min(255, v * 3 / 2));
+    }
+    constexpr int kLut3dSize = 9;
+    std::vector<float> lut3d(static_cast<std::size_t>(kLut3dSize * kLut3dSize * kLut3dSize * 3));
+    for (std::size_t i = 0; i < lut3d.size(); ++i) {
+        const double v = static_cast<double>(i) * 0.6180339887;
+        lut3d[i] = static_cast<float>(v - std::floor(v));
+    }
+
+    const auto make_qi = [&](int search_bits, int pre_bits) {
+        MSX1PQCore::QuantInfo qi = make_quant_info(opts);
+        qi.use_8dot2col      = MSX1PQCore::MSX1PQ_EIGHTDOT_MODE_NONE;
+        qi.color_system      = (search_bits & 1) ? MSX1PQCore::MSX1PQ_COLOR_SYS_MSX2 : MSX1PQCore::MSX1PQ_COLOR_SYS_MSX1;
+        qi.use_dark_dither   = (search_bits & 2) != 0;
+        qi.use_hsb           = (search_bits & 4) != 0;
+        qi.use_dither        = (search_bits & 8) != 0;
+        qi.use_palette_color = (search_bits & 16) != 0;
+        qi.pre_posterize = (pre_bits & 1) ? 16 : 0;
+        const bool adjust = (pre_bits & 2) != 0;
+        qi.pre_sat       = adjust ? 1.3f : 1.0f;
+        qi.pre_gamma     = adjust ? 0.8f : 1.0f;
+        qi.pre_highlight = adjust ? 1.2f : 1.0f;
+        qi.pre_hue       = adjust ? 20.0f : 0.0f;
+        qi.pre_lut        = (pre_bits & 4) ? lut1d.data() : nullptr;
+        qi.pre_lut3d      = (pre_bits & 8) ? lut3d.data() : nullptr;
+        qi.pre_lut3d_size = (pre_bits & 8) ? kLut3dSize : 0;
+        return qi;
+    };
+
+    MSX1PQCore::PixelLayout layout;
+    layout.stride = static_cast<std::ptrdiff_t>(sizeof(RgbaPixel));
+    layout.r      = static_cast<int>(offsetof(RgbaPixel, red));
+    layout.g      = static_cast<int>(offsetof(RgbaPixel, green));
+    layout.b      = static_cast<int>(offsetof(RgbaPixel, blue));
+
+    // 画素を幅 kRowWidth の行に並べ、x = -3、y = -2 から始めてディザの位相をすべて通す
+    constexpr std::int32_t kRowWidth = 1000;
+    std::vector<std::uint8_t> indices(kRowWidth);
+    std::uint64_t checked = 0;
+    int failed_cases = 0;
+    const auto check = [&](const MSX1PQCore::QuantPlan& kernel_plan, const MSX1PQCore::QuantPlan& reference,
+                           int search_bits, int pre_bits, const char* variant) {
+        const MSX1PQ::QuantColor* palette = MSX1PQCore::get_output_palette(kernel_plan.qi);
+        std::uint64_t mismatches = 0;
+        for (std::size_t pos = 0; pos < pixels.size(); pos += kRowWidth) {
+            const std::int32_t n  = static_cast<std::int32_t>(std::min<std::size_t>(kRowWidth, pixels.size() - pos));
+            const std::int32_t x0 = -3;
+            const std::int32_t y  = static_cast<std::int32_t>(pos / kRowWidth) - 2;
+            MSX1PQCore::quantize_span_indices(kernel_plan, reinterpret_cast<const std::uint8_t*>(pixels.data() + pos),
+                                              layout, indices.data(), n, x0, y);
+            for (std::int32_t i = 0; i < n; ++i) {
+                const RgbaPixel& px = pixels[pos + static_cast<std::size_t>(i)];
+                const MSX1PQ::QuantColor want =
+                    MSX1PQCore::quantize_pixel_plan(reference, px.red, px.green, px.blue, x0 + i, y);
+                const MSX1PQ::QuantColor& got = palette[indices[static_cast<std::size_t>(i)]];
+                if (got.r != want.r || got.g != want.g || got.b != want.b) {
+                    ++mismatches;
+                }
+            }
+        }
+        checked += pixels.size();
+        if (mismatches > 0) {
+            ++failed_cases;
+            std::cout << "Mismatch: search " << search_bits << ", preprocess " << pre_bits << ", " << variant
+                      << ": " << mismatches << " px\n";
+        }
+    };
+
+    // 全色テーブルはプロセス内のキャッシュを使い回せるよう、探索の設定を外側に回す
+    int cases = 0;
+    for (int search_bits = 0; search_bits < 32; ++search_bits) {
+        for (int pre_bits = 0; pre_bits < 16; ++pre_bits) {
+            const MSX1PQCore::QuantInfo qi = make_qi(search_bits, pre_bits);
+            MSX1PQCore::QuantPlan bare;
+            MSX1PQCore::compile_quant_plan(qi, true, bare);
+            check(bare, bare, search_bits, pre_bits, "bare");
+            ++cases;
+
+            if (bare.use_table) {
+                continue;
+            }
+            MSX1PQCore::PaletteGrid grid;
+            if (MSX1PQCore::build_palette_grid(qi, grid)) {
+                MSX1PQCore::QuantPlan plan;
+                MSX1PQCore::compile_quant_plan(qi, true, plan);
+                plan.qi.palette_grid = &grid;
+                plan.span_kernel = MSX1PQCore::select_span_kernel(plan);
+                check(plan, bare, search_bits, pre_bits, "grid");
+            }
+            const std::shared_ptr<const MSX1PQCore::NearestIndexLut> nearest = MSX1PQCore::acquire_nearest_index_lut(qi);
+            MSX1PQCore::QuantPlan plan;
+            MSX1PQCore::compile_quant_plan(qi, true, plan);
+            plan.qi.nearest_lut = nearest->indices.data();
+            plan.span_kernel = MSX1PQCore::select_span_kernel(plan);
+            check(plan, bare, search_bits, pre_bits, "full-lut");
+        }
+    }
+
+    // 焼き込み前処理は前処理の設定だけで決まるので、前処理を外側に回して一度ずつ作る
+    for (int pre_bits = 0; pre_bits < 16; ++pre_bits) {
+        MSX1PQCore::QuantPlan source;
+        MSX1PQCore::compile_quant_plan(make_qi(0, pre_bits), true, source);
+        MSX1PQCore::PreprocessLut baked65;
+        MSX1PQCore::PreprocessLut exact;
+        const bool has65    = MSX1PQCore::build_preprocess_lut(source, 65, baked65);
+        const bool hasexact = MSX1PQCore::build_preprocess_lut(source, MSX1PQCore::PREPROCESS_LUT_EXACT, exact);
+        for (int search_bits = 0; search_bits < 32; ++search_bits) {
+            const MSX1PQCore::QuantInfo qi = make_qi(search_bits, pre_bits);
+            MSX1PQCore::QuantPlan bare;
+            MSX1PQCore::compile_quant_plan(qi, true, bare);
+            if (has65) {
+                MSX1PQCore::QuantPlan plan;
+                MSX1PQCore::compile_quant_plan(qi, true, plan);
+                if (MSX1PQCore::attach_preprocess_lut(plan, baked65)) {
+                    check(plan, plan, search_bits, pre_bits, "baked-65");
+                }
+            }
+            if (hasexact) {
+                MSX1PQCore::QuantPlan plan;
+                MSX1PQCore::compile_quant_plan(qi, true, plan);
+                if (MSX1PQCore::attach_preprocess_lut(plan, exact)) {
+                    check(plan, bare, search_bits, pre_bits, "baked-exact");
+                }
+            }
+        }
+    }
+
+    std::cout << "Span kernel check: " << cases << " mode combinations, " << checked << " px checked, "
+              << failed_cases << " failed\n";
+    return failed_cases == 0;
+}
+
+// 開発用: 遷移ペナルティ付きの 8dot を左からの貪欲法と Viterbi / ビーム探索で比べる
+// （同じ量子化結果に対して単一スレッドで実行し、スコアの合計と 1 メガピクセルあたりの時間を出す）
+bool bench_8dot_file(const fs::path& input, const CliOptions& opts) {
+    RgbaImage frame;
+    if (!read_input(input, frame, std::cerr)) {
+        return false;
+    }
+    const unsigned width  = frame.width;
+    const unsigned height = frame.height;
+    if (opts.use_palette_color) {
+        std::cerr << "8dot benchmark is not applicable to --palette92\n";
+        return false;
+    }
+
+    const std::size_t num_pixels = frame.num_pixels();
+
+    QuantContext ctx;
+    prepare_quant_context(opts, false, ctx);
+    IndexedImage image;
+    if (!quantize_image_indices(ctx, frame, opts, image, nullptr)) {
+        std::cerr << "Not enough memory to quantize: " << input << "\n";
+        return false;
+    }
+
+    auto run_8dot = [&](int mode, int beam_width, MSX1PQCore::EightDotStats& stats) {
+        std::vector<std::uint8_t> plane = image.indices;
+        MSX1PQCore::EightDotSearch search = MSX1PQCore::make_eightdot_search(make_quant_info(opts));
+        search.prune      = !opts.eightdot_exhaustive;
+        search.stats      = &stats;
+        search.beam_width = beam_width;
+        const auto start = std::chrono::steady_clock::now();
+        MSX1PQCore::apply_8dot2col_indices(mode,
+                                           plane.data(),
+                                           static_cast<std::ptrdiff_t>(width),
+                                           static_cast<std::int32_t>(width),
+                                           static_cast<std::int32_t>(height),
+                                           opts.color_system,
+                                           &search);
+        return elapsed_ms(start);
+    };
+    const double megapixels = static_cast<double>(num_pixels) / 1.0e6;
+    auto ms_per_mpx = [megapixels](double ms) {
+        return (megapixels > 0.0) ? ms / megapixels : 0.0;
+    };
+
+    const std::ios::fmtflags flags = std::cout.flags();
+    const std::streamsize precision = std::cout.precision();
+    std::cout << std::fixed;
+
+    std::cout << "8dot benchmark: " << input << " (" << num_pixels << " px, single thread)\n";
+
+    MSX1PQCore::EightDotStats greedy;
+    const double greedy_ms = run_8dot(MSX1PQCore::MSX1PQ_EIGHTDOT_MODE_PENALTY_BEST, 0, greedy);
+    std::cout << "  greedy         : score " << std::setprecision(0) << greedy.score
+              << ", " << std::setprecision(2) << ms_per_mpx(greedy_ms) << " ms/Mpx\n";
+
+    std::vector<int> beam_widths = {0, 16, 8, 4, 2, 1};
+    if (std::find(beam_widths.begin(), beam_widths.end(), opts.eightdot_beam) == beam_widths.end()) {
+        beam_widths.push_back(opts.eightdot_beam);
+    }
+    for (const int beam_width : beam_widths) {
+        MSX1PQCore::EightDotStats viterbi;
+        const double viterbi_ms =
+            run_8dot(MSX1PQCore::MSX1PQ_EIGHTDOT_MODE_VITERBI, beam_width, viterbi);
+        const double delta = viterbi.score - greedy.score;
+        const double delta_percent = (greedy.score > 0.0) ? 100.0 * delta / greedy.score : 0.0;
+
+        std::ostringstream label;
+        if (beam_width > 0) {
+            label << "beam " << beam_width;
+        } else {
+            label << "exact";
+        }
+        std::cout << "  viterbi " << std::left << std::setw(7) << label.str() << std::right
+                  << ": score " << std::setprecision(0) << viterbi.score
+                  << " (" << std::showpos << std::setprecision(1) << delta << ", " << std::setprecision(6) << delta_percent
+                  << std::noshowpos << "%), "
+                  << std::setprecision(2) << ms_per_mpx(viterbi_ms) << " ms/Mpx\n";
+    }
+
+    std::cout.flags(flags);
+    std::cout.precision(precision);
+    return true;
+}
+
+// JSON 文字列として書き出す（引用符と制御文字をエスケープ）
+std::string json_quote(const std::string& s) {
+    std::ostringstream oss;
+    oss << '"';
+    for (const char ch : s) {
+        const unsigned char c = static_cast<unsigned char>(ch);
+        if (c == '"' || c == '\\') {
+            oss << '\\' << ch;
+        } else if (c < 0x20) {
+            oss << "\\u" << std::hex << std::setw(4) << std::setfill('0') << static_cast<int>(c)
+                << std::dec << std::setfill(' ');
+        } else {
+            oss << ch;
+        }
+    }
+    oss << '"';
+    return oss.str();
+}
+
+// 入力を変換せずに横8ドット2色の制限を検査し、JSON で書き出す
+// 各画素は 8dot 処理と同じく最も近い基本色として数える（基本色と一致しない画素数も記録する）
+bool validate_file(const fs::path& input, const fs::path& output, const CliOptions& opts, bool& legal) {
+    // 違反ブロックの座標は先頭からこの件数まで書き出す
+    constexpr std::size_t kMaxListedViolations = 1000;
+
+    RgbaImage frame;
+    if (!read_input(input, frame, std::cerr)) {
+        return false;
+    }
+    const unsigned char* raw = frame.bytes();
+    const unsigned width  = frame.width;
+    const unsigned height = frame.height;
+
+    const MSX1PQ::BasicColorHash& hash = (opts.color_system == MSX1PQCore::MSX1PQ_COLOR_SYS_MSX2)
+        ? MSX1PQ::kBasicColorHashMsx2
+        : MSX1PQ::kBasicColorHashMsx1;
+
+    const std::size_t num_pixels = static_cast<std::size_t>(width) * height;
+    std::vector<std::uint8_t> indices(num_pixels);
+    std::uint64_t off_palette = 0;
+    for (std::size_t i = 0; i < num_pixels; ++i) {
+        const std::uint8_t r = raw[i * 4 + 0];
+        const std::uint8_t g = raw[i * 4 + 1];
+        const std::uint8_t b = raw[i * 4 + 2];
+        if (MSX1PQ::exact_basic_index(hash, r, g, b) < 0) {
+            ++off_palette;
+        }
+        indices[i] = static_cast<std::uint8_t>(
+            MSX1PQCore::find_basic_index_from_rgb(r, g, b, opts.color_system));
+    }
+
+    MSX1PQCore::EightDotReport report;
+    legal = MSX1PQCore::validate_8dot2col_indices(indices.data(),
+                                                  static_cast<std::ptrdiff_t>(width),
+                                                  static_cast<std::int32_t>(width),
+                                                  static_cast<std::int32_t>(height),
+                                                  &report,
+                                                  kMaxListedViolations);
+
+    std::ofstream ofs(output);
+    if (!ofs) {
+        std::cerr << "Failed to open output file: " << output << "\n";
+        return false;
+    }
+
+    ofs << "{\n"
+        << "  \"input\": " << json_quote(input.string()) << ",\n"
+        << "  \"width\": " << width << ",\n"
+        << "  \"height\": " << height << ",\n"
+        << "  \"color_system\": \""
+        << ((opts.color_system == MSX1PQCore::MSX1PQ_COLOR_SYS_MSX2) ? "msx2" : "msx1") << "\",\n"
+        << "  \"legal\": " << (legal ? "true" : "false") << ",\n"
+        << "  \"off_palette_pixels\": " << off_palette << ",\n"
+        << "  \"blocks\": " << report.blocks << ",\n"
+        << "  \"violating_blocks\": " << report.violating_blocks << ",\n"
+        << "  \"violations\": [";
+    for (std::size_t i = 0; i < report.violations.size(); ++i) {
+        const MSX1PQCore::EightDotViolation& v = report.violations[i];
+        ofs << (i ? ",\n" : "\n")
+            << "    {\"x\": " << v.x << ", \"y\": " << v.y << ", \"colors\": " << v.colors << "}";
     }
-    return write_png(output, pixels, width, height);
+    ofs << (report.violations.empty() ? "]" : "\n  ]") << ",\n"
+        << "  \"violations_truncated\": "
+        << (report.violations.size() < report.violating_blocks ? "true" : "false") << "\n"
+        << "}\n";
+    if (!ofs) {
+        std::cerr << "Failed to write report: " << output << "\n";
+        return false;
+    }
+    return true;
 }
 
 std::vector<fs::path> collect_inputs(const fs::path& input_path) {
@@ -689,11 +1656,23 @@ int main(int argc, char** argv) {
             std::cerr << "LUT file does not exist: " << opts.pre_lut_path << "\n";
             return 1;
         }
-        if (!MSX1PQCore::load_pre_lut(opts.pre_lut_path.string(), opts.pre_lut_data, opts.pre_lut3d_data, opts.pre_lut3d_size)) {
+        if (!MSX1PQCore::load_pre_lut(opts.pre_lut_path.string(), opts.lut_cache, opts.pre_lut)) {
             return 1;
         }
     }
 
+    // 前処理の焼き込みは全入力で共通なので最初に 1 回だけ行う
+    if (opts.bake_preprocess > 0 && opts.use_preprocess) {
+        MSX1PQCore::QuantPlan plan;
+        MSX1PQCore::compile_quant_plan(make_quant_info(opts), true, plan);
+        if (!MSX1PQCore::build_preprocess_lut(plan, opts.bake_preprocess, opts.baked_preprocess) &&
+            opts.bake_preprocess == MSX1PQCore::PREPROCESS_LUT_EXACT &&
+            MSX1PQCore::build_preprocess_lut(plan, 65, opts.baked_preprocess)) {
+            // 48MB を確保できなければ 65^3 の近似に切り替える
+            std::cerr << "Warning: not enough memory for the exact preprocess LUT, using 65^3 instead\n";
+        }
+    }
+
     if (!fs::exists(opts.output_dir)) {
         fs::create_directories(opts.output_dir);
     }
@@ -704,8 +1683,63 @@ int main(int argc, char** argv) {
         return 1;
     }
 
-    int success_count = 0;
-    for (const auto& input : inputs) {
+    if (opts.check_kernels) {
+        return check_span_kernels(inputs, opts) ? 0 : 1;
+    }
+
+    if (opts.bench_search) {
+        for (const auto& input : inputs) {
+            bench_search_file(input, opts);
+        }
+        return 0;
+    }
+
+    if (opts.bench_8dot) {
+        for (const auto& input : inputs) {
+            bench_8dot_file(input, opts);
+        }
+        return 0;
+    }
+
+    // 検査のみ: 入力ごとに <名前>.json を書き出す
+    // 終了コードは全入力が制限を満たせば 0、違反があれば 2、失敗があれば 1
+    if (opts.validate_only) {
+        bool any_failed  = false;
+        bool any_illegal = false;
+        for (const auto& input : inputs) {
+            fs::path output_filename = input.filename();
+            if (!opts.output_prefix.empty()) {
+                output_filename = fs::path(opts.output_prefix + output_filename.string());
+            }
+            output_filename.replace_extension(".json");
+
+            fs::path out_path = opts.output_dir / output_filename;
+            if (!allow_output(out_path, opts)) {
+                std::cout << "Skipped: " << out_path << "\n";
+                continue;
+            }
+
+            bool legal = false;
+            if (!validate_file(input, out_path, opts, legal)) {
+                any_failed = true;
+                continue;
+            }
+            std::cout << (legal ? "Valid: " : "Invalid: ") << input << " -> " << out_path << "\n";
+            if (!legal) {
+                any_illegal = true;
+            }
+        }
+        if (any_failed) {
+            return 1;
+        }
+        return any_illegal ? 2 : 0;
+    }
+
+    // 出力先と上書きの可否は、ワーカーを動かす前にメインスレッドで入力順に決める
+    std::vector<FileJob> jobs(inputs.size());
+    std::vector<std::size_t> pending;
+    for (std::size_t i = 0; i < inputs.size(); ++i) {
+        const fs::path& input = inputs[i];
         fs::path output_filename = input.filename();
         if (!opts.output_prefix.empty()) {
             output_filename = fs::path(opts.output_prefix + output_filename.string());
@@ -717,25 +1751,112 @@ int main(int argc, char** argv) {
             output_filename.replace_extension(".sc2");
         }
 
-        fs::path out_path = opts.output_dir / output_filename;
-        if (fs::exists(out_path) && !opts.force) {
-            if (!confirm_overwrite(out_path)) {
-                std::cout << "Skipped: " << out_path << "\n";
-                continue;
+        FileJob& job = jobs[i];
+        job.input  = input;
+        job.output = opts.output_dir / output_filename;
+
+        std::ostringstream message;
+        if (!allow_output(job.output, opts)) {
+            message << "Skipped: " << job.output << "\n";
+        } else if (!has_png_extension(input)) {
+            message << "Skip (not PNG): " << input << "\n";
+        } else {
+            pending.push_back(i);
+        }
+        job.message = message.str();
+    }
+
+    // 同時に処理するファイル数。スレッド数が自動のときは CPU をファイル間で分け合う
+    const bool use_pipeline = opts.pipeline_read > 0;
+    const int num_jobs = use_pipeline
+        ? opts.pipeline_compute
+        : std::max(1, std::min(opts.jobs > 0 ? opts.jobs : MSX1PQCore::default_thread_count(),
+                               static_cast<int>(pending.size())));
+    if (opts.threads == 0 && num_jobs > 1) {
+        opts.threads = std::max(1, MSX1PQCore::default_thread_count() / num_jobs);
+    }
+
+    QuantContext ctx;
+    prepare_quant_context(opts, true, ctx);
+
+    // 終わったファイルの行は、それより前のファイルがすべて終わってから入力順に表示する
+    std::mutex print_mutex;
+    std::vector<char> done(jobs.size(), 1);
+    for (std::size_t i : pending) {
+        done[i] = 0;
+    }
+    std::size_t next_print = 0;
+    const auto print_ready = [&]() {
+        for (; next_print < jobs.size() && done[next_print]; ++next_print) {
+            const FileJob& job = jobs[next_print];
+            if (!job.errors.empty()) {
+                std::cout.flush();
+                std::cerr << job.errors;
             }
+            std::cout << job.message;
+        }
+        std::cout.flush();
+    };
+    print_ready();
+
+    const auto finish = [&](std::size_t i) {
+        FileJob& job = jobs[i];
+        if (job.ok) {
+            std::ostringstream message;
+            message << "Processed: " << job.input << " -> " << job.output << "\n";
+            job.message = message.str();
         }
+        std::lock_guard<std::mutex> lock(print_mutex);
+        done[i] = 1;
+        print_ready();
+    };
 
-        if (!has_png_extension(input)) {
-            std::cout << "Skip (not PNG): " << input << "\n";
-            continue;
+    if (use_pipeline) {
+        const PipelineReport report = run_pipeline(jobs, pending, opts, ctx, finish);
+        if (opts.pipeline_stats) {
+            print_pipeline_report(report, pending.size());
         }
+    } else {
+        MSX1PQCore::Executor executor;
+        executor.num_threads = num_jobs;
+        MSX1PQCore::parallel_for(&executor, static_cast<std::int32_t>(pending.size()), [&](std::int32_t k) {
+            const std::size_t i = pending[static_cast<std::size_t>(k)];
+            FileJob& job = jobs[i];
+            std::ostringstream err;
+            job.ok = process_file(job.input, job.output, opts, ctx, &job.stats, err);
+            job.errors = err.str();
+            finish(i);
+        });
+    }
 
-        if (process_file(input, out_path, opts)) {
-            std::cout << "Processed: " << input << " -> " << out_path << "\n";
+    // 統計は入力順に足す（--jobs によらず同じ値になる）
+    MSX1PQCore::EightDotStats eightdot_stats;
+    int success_count = 0;
+    for (const FileJob& job : jobs) {
+        eightdot_stats.blocks          += job.stats.blocks;
+        eightdot_stats.candidate_pairs += job.stats.candidate_pairs;
+        eightdot_stats.scored_pairs    += job.stats.scored_pairs;
+        eightdot_stats.score           += job.stats.score;
+        if (job.ok) {
             ++success_count;
         }
     }
 
+    if (opts.eightdot_stats) {
+        const std::uint64_t candidates = eightdot_stats.candidate_pairs;
+        const std::uint64_t pruned     = candidates - eightdot_stats.scored_pairs;
+        std::cout << "8dot pair search: " << eightdot_stats.blocks << " blocks, "
+                  << candidates << " candidate pairs, "
+                  << eightdot_stats.scored_pairs << " scored, "
+                  << pruned << " pruned";
+        if (candidates > 0) {
+            std::cout << " (" << std::fixed << std::setprecision(1)
+                      << 100.0 * static_cast<double>(pruned) / static_cast<double>(candidates)
+                      << "%)";
+        }
+        std::cout << "\n";
+    }
+
     if (success_count == 0) {
         return 1;
     }
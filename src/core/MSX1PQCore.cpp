@@ -1,15 +1,138 @@
 #include "MSX1PQCore.h"
 
 #include <algorithm>
-#include <array>
+#include <atomic>
+#include <cerrno>
 #include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
 #include <fstream>
 #include <iostream>
-#include <sstream>
+#include <memory>
+#include <mutex>
+#include <new>
 #include <string>
+#include <thread>
+#include <type_traits>
 #include <vector>
 
+// C++17 の std::from_chars(float) が使える環境ではロケール非依存の高速な数値変換を使う
+#if defined(__has_include)
+#if __has_include(<charconv>) && \
+    ((defined(_MSVC_LANG) && _MSVC_LANG >= 201703L) || __cplusplus >= 201703L)
+#include <charconv>
+#endif
+#endif
+#if defined(__cpp_lib_to_chars) && __cpp_lib_to_chars >= 201611L
+#define MSX1PQ_HAS_FLOAT_FROM_CHARS 1
+#endif
+
+#if defined(_WIN32)
+#ifndef WIN32_LEAN_AND_MEAN
+#define WIN32_LEAN_AND_MEAN
+#endif
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+#if defined(__linux__)
+#include <sched.h>
+#endif
+
+#if defined(__x86_64__) || defined(_M_X64) || defined(__i386__) || defined(_M_IX86)
+#define MSX1PQ_HAS_X86_SIMD 1
+#include <immintrin.h>
+#if defined(_MSC_VER)
+#include <intrin.h>
+#endif
+#endif
+
+// GCC / Clang では関数単位で命令セットを有効にする（MSVC は指定不要）
+#if defined(MSX1PQ_HAS_X86_SIMD) && (defined(__GNUC__) || defined(__clang__))
+#define MSX1PQ_TARGET_SSE41 __attribute__((target("sse4.1")))
+#define MSX1PQ_TARGET_AVX2  __attribute__((target("avx2")))
+#else
+#define MSX1PQ_TARGET_SSE41
+#define MSX1PQ_TARGET_AVX2
+#endif
+
 namespace MSX1PQCore {
+
+MappedFile::~MappedFile()
+{
+    if (!bytes) {
+        return;
+    }
+#if defined(_WIN32)
+    UnmapViewOfFile(bytes);
+#else
+    munmap(const_cast<char*>(bytes), length);
+#endif
+}
+
+bool MappedFile::open(const std::string& path)
+{
+#if defined(_WIN32)
+    HANDLE file = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr,
+                              OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+    if (file == INVALID_HANDLE_VALUE) {
+        return false;
+    }
+    LARGE_INTEGER file_size;
+    if (!GetFileSizeEx(file, &file_size)) {
+        CloseHandle(file);
+        return false;
+    }
+    if (file_size.QuadPart == 0) {
+        CloseHandle(file);
+        return true;
+    }
+    HANDLE mapping = CreateFileMappingA(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+    CloseHandle(file);
+    if (!mapping) {
+        return false;
+    }
+    // ビューが残っている間はマッピングも有効なのでハンドルはすぐ閉じてよい
+    void* view = MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+    CloseHandle(mapping);
+    if (!view) {
+        return false;
+    }
+    bytes  = static_cast<const char*>(view);
+    length = static_cast<std::size_t>(file_size.QuadPart);
+    return true;
+#else
+    const int fd = ::open(path.c_str(), O_RDONLY);
+    if (fd < 0) {
+        return false;
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode)) {
+        ::close(fd);
+        return false;
+    }
+    if (st.st_size == 0) {
+        ::close(fd);
+        return true;
+    }
+    void* view = mmap(nullptr, static_cast<std::size_t>(st.st_size), PROT_READ, MAP_PRIVATE, fd, 0);
+    ::close(fd);
+    if (view == MAP_FAILED) {
+        return false;
+    }
+    bytes  = static_cast<const char*>(view);
+    length = static_cast<std::size_t>(st.st_size);
+    return true;
+#endif
+}
+
 namespace {
 
 inline float max3f(float a, float b, float c)
@@ -42,83 +165,396 @@ std::string get_lower_extension(const std::string& path)
     return to_lower_copy(path.substr(dot));
 }
 
-bool parse_cube_lut(std::istream& file, std::vector<float>& out3d, int& lut_size)
+// ---- LUT ファイルの解析（ファイル全体をマッピングしたバッファを直接読む） ----
+
+inline bool is_space_char(char c)
+{
+    return c == ' ' || c == '\t' || c == '\r' || c == '\n' || c == '\v' || c == '\f';
+}
+
+inline const char* skip_spaces(const char* p, const char* end)
 {
-    lut_size = 0;
-    out3d.clear();
+    while (p < end && is_space_char(*p)) {
+        ++p;
+    }
+    return p;
+}
 
-    std::vector<std::array<float, 3>> rows;
-    std::string line;
+// 先頭の数値部分だけを読む（std::stof / istream と同じく後続の文字は無視）
+// 読めなければ nullptr を返す
+const char* parse_float_prefix(const char* p, const char* end, float& out)
+{
+#if defined(MSX1PQ_HAS_FLOAT_FROM_CHARS)
+    if (p < end && *p == '+') {
+        ++p;
+    }
+    const std::from_chars_result res = std::from_chars(p, end, out);
+    if (res.ec != std::errc()) {
+        return nullptr;
+    }
+    return res.ptr;
+#else
+    // strtof は NUL 終端が必要なので 1トークン分だけ退避して変換する
+    char buf[64];
+    std::size_t n = 0;
+    while (p + n < end && n + 1 < sizeof(buf) && !is_space_char(p[n])) {
+        buf[n] = p[n];
+        ++n;
+    }
+    buf[n] = '\0';
+    char* stop = nullptr;
+    errno = 0;
+    out = std::strtof(buf, &stop);
+    if (stop == buf || errno == ERANGE) {
+        return nullptr;
+    }
+    return p + (stop - buf);
+#endif
+}
 
-    auto normalize_value = [](float v, float max_value) {
-        if (max_value <= 1.0f) {
-            return clamp_value(v, 0.0f, 1.0f);
+const char* parse_int_prefix(const char* p, const char* end, int& out)
+{
+    bool negative = false;
+    if (p < end && (*p == '+' || *p == '-')) {
+        negative = (*p == '-');
+        ++p;
+    }
+    if (p >= end || *p < '0' || *p > '9') {
+        return nullptr;
+    }
+    long long v = 0;
+    while (p < end && *p >= '0' && *p <= '9') {
+        v = v * 10 + (*p - '0');
+        if (v > 0x7fffffffLL) {
+            return nullptr;
         }
-        return clamp_value(v / max_value, 0.0f, 1.0f);
-    };
+        ++p;
+    }
+    out = static_cast<int>(negative ? -v : v);
+    return p;
+}
 
-    while (std::getline(file, line)) {
-        const auto hash_pos = line.find('#');
-        if (hash_pos != std::string::npos) {
-            line = line.substr(0, hash_pos);
-        }
+// 1行ずつ [begin, end) を渡す（# 以降のコメントは除去済み）
+template <typename LineFn>
+void for_each_line(const char* data, std::size_t size, LineFn fn)
+{
+    const char* p   = data;
+    const char* end = data + size;
+    while (p < end) {
+        const char* nl = static_cast<const char*>(std::memchr(p, '\n', static_cast<std::size_t>(end - p)));
+        const char* line_end = nl ? nl : end;
+        const char* hash = static_cast<const char*>(std::memchr(p, '#', static_cast<std::size_t>(line_end - p)));
+        fn(p, hash ? hash : line_end);
+        p = nl ? nl + 1 : end;
+    }
+}
 
-        std::istringstream iss(line);
-        std::string token;
-        if (!(iss >> token)) {
-            continue;
+bool parse_cube_lut(const char* data, std::size_t size, std::vector<float>& out3d, int& lut_size)
+{
+    lut_size = 0;
+    out3d.clear();
+
+    static const char kSizeKeyword[] = "LUT_3D_SIZE";
+    const std::size_t keyword_len = sizeof(kSizeKeyword) - 1;
+
+    for_each_line(data, size, [&](const char* p, const char* end) {
+        p = skip_spaces(p, end);
+        if (p >= end) {
+            return;
+        }
+        const char* token_end = p;
+        while (token_end < end && !is_space_char(*token_end)) {
+            ++token_end;
         }
 
-        if (token == "LUT_3D_SIZE") {
-            iss >> lut_size;
-            continue;
+        if (static_cast<std::size_t>(token_end - p) == keyword_len &&
+            std::memcmp(p, kSizeKeyword, keyword_len) == 0) {
+            int value = 0;
+            if (!parse_int_prefix(skip_spaces(token_end, end), end, value)) {
+                value = 0;
+            }
+            lut_size = value;
+            if (lut_size > 0 && lut_size <= 256 && out3d.empty()) {
+                out3d.reserve(static_cast<std::size_t>(lut_size) * lut_size * lut_size * 3);
+            }
+            return;
         }
 
-        float r, g, b;
-        try {
-            r = std::stof(token);
-        } catch (...) {
-            continue;
+        float rgb[3];
+        if (!parse_float_prefix(p, token_end, rgb[0])) {
+            return;
         }
-        if (!(iss >> g >> b)) {
-            continue;
+        const char* q = token_end;
+        for (int c = 1; c < 3; ++c) {
+            q = parse_float_prefix(skip_spaces(q, end), end, rgb[c]);
+            if (!q) {
+                return;
+            }
         }
-        rows.push_back({r, g, b});
-    }
+        out3d.insert(out3d.end(), rgb, rgb + 3);
+    });
 
-    if (rows.empty()) {
+    const std::size_t num_rows = out3d.size() / 3;
+    if (num_rows == 0) {
+        out3d.clear();
         return false;
     }
 
     if (lut_size == 0) {
-        lut_size = static_cast<int>(std::round(std::cbrt(static_cast<double>(rows.size()))));
+        lut_size = static_cast<int>(std::round(std::cbrt(static_cast<double>(num_rows))));
     }
 
     const std::size_t expected_entries = static_cast<std::size_t>(lut_size) * lut_size * lut_size;
-    if (expected_entries != rows.size()) {
+    if (lut_size <= 0 || expected_entries != num_rows) {
+        out3d.clear();
         return false;
     }
 
     float max_value = 1.0f;
-    for (const auto& row : rows) {
-        max_value = std::max({max_value, row[0], row[1], row[2]});
+    for (float v : out3d) {
+        max_value = std::max(max_value, v);
+    }
+
+    for (float& v : out3d) {
+        v = (max_value <= 1.0f)
+            ? clamp_value(v, 0.0f, 1.0f)
+            : clamp_value(v / max_value, 0.0f, 1.0f);
+    }
+
+    return true;
+}
+
+bool parse_rgb_lut(const char* data, std::size_t size, std::vector<std::uint8_t>& out1d)
+{
+    out1d.clear();
+    out1d.reserve(256 * 3);
+
+    bool ok = true;
+    for_each_line(data, size, [&](const char* p, const char* end) {
+        while (ok) {
+            // カンマ / セミコロン区切りも空白として扱う
+            while (p < end && (is_space_char(*p) || *p == ',' || *p == ';')) {
+                ++p;
+            }
+            int v = 0;
+            const char* next = parse_int_prefix(p, end, v);
+            if (!next) {
+                return;
+            }
+            if (v < 0 || v > 255) {
+                std::cerr << "LUT value out of range (0-255): " << v << "\n";
+                ok = false;
+                return;
+            }
+            out1d.push_back(static_cast<std::uint8_t>(v));
+            p = next;
+        }
+    });
+    if (!ok) {
+        out1d.clear();
+        return false;
+    }
+
+    if (out1d.size() != 256 * 3) {
+        std::cerr << "LUT must contain 256 RGB triplets (found " << out1d.size() << " values)\n";
+        out1d.clear();
+        return false;
+    }
+    return true;
+}
+
+// ---- .lutbin キャッシュ ----
+// [ヘッダー 64 バイト][正規化済み float RGB × size^3]（ホストのエンディアン）
+
+const char          kLutBinMagic[8]  = { 'M', 'S', 'X', '1', 'P', 'Q', 'L', 'B' };
+const std::uint32_t kLutBinVersion   = 1;
+const std::uint32_t kLutBinByteOrder = 0x01020304u;
+const int           kLutBinMaxSize   = 256;
+
+struct LutBinHeader {
+    char          magic[8];
+    std::uint32_t version;
+    std::uint32_t byte_order;
+    std::uint32_t lut_size;
+    std::uint32_t reserved;
+    std::uint64_t source_size;   // 元の .cube のバイト数
+    std::uint64_t source_hash;   // 元の .cube の content_hash64
+    std::uint64_t payload_hash;  // float テーブルの content_hash64
+    std::uint8_t  padding[16];
+};
+static_assert(sizeof(LutBinHeader) == 64, "LutBinHeader must be 64 bytes");
+
+// FNV-1a を 8 バイト単位に広げた内容ハッシュ（キャッシュの照合用で暗号強度は不要）
+std::uint64_t content_hash64(const void* data, std::size_t size)
+{
+    const unsigned char* p = static_cast<const unsigned char*>(data);
+    const std::uint64_t prime = 0x100000001b3ULL;
+    std::uint64_t h = 0xcbf29ce484222325ULL ^ static_cast<std::uint64_t>(size);
+    std::size_t i = 0;
+    for (; i + 8 <= size; i += 8) {
+        std::uint64_t word;
+        std::memcpy(&word, p + i, sizeof(word));
+        h = (h ^ word) * prime;
+        h ^= h >> 29;
+    }
+    for (; i < size; ++i) {
+        h = (h ^ p[i]) * prime;
+    }
+    return h;
+}
+
+std::string lutbin_path_for(const std::string& path)
+{
+    const std::string::size_type dot   = path.find_last_of('.');
+    const std::string::size_type slash = path.find_last_of("/\\");
+    if (dot == std::string::npos || (slash != std::string::npos && dot < slash)) {
+        return path + ".lutbin";
+    }
+    return path.substr(0, dot) + ".lutbin";
+}
+
+// 検証に通ればマッピングしたまま out に設定する
+bool map_lutbin(const std::string& cache_path,
+                std::uint64_t source_size,
+                std::uint64_t source_hash,
+                PreLutData& out)
+{
+    auto mapped = std::make_shared<MappedFile>();
+    if (!mapped->open(cache_path) || mapped->length < sizeof(LutBinHeader)) {
+        return false;
+    }
+
+    LutBinHeader header;
+    std::memcpy(&header, mapped->bytes, sizeof(header));
+    if (std::memcmp(header.magic, kLutBinMagic, sizeof(kLutBinMagic)) != 0 ||
+        header.version != kLutBinVersion ||
+        header.byte_order != kLutBinByteOrder ||
+        header.lut_size < 2 || header.lut_size > static_cast<std::uint32_t>(kLutBinMaxSize) ||
+        header.source_size != source_size ||
+        header.source_hash != source_hash) {
+        return false;
+    }
+
+    const std::size_t n = header.lut_size;
+    const std::size_t payload_size = n * n * n * 3 * sizeof(float);
+    if (mapped->length != sizeof(LutBinHeader) + payload_size) {
+        return false;
+    }
+    const char* payload = mapped->bytes + sizeof(LutBinHeader);
+    if (content_hash64(payload, payload_size) != header.payload_hash) {
+        return false;
+    }
+
+    out.lut3d_data = reinterpret_cast<const float*>(payload);
+    out.lut3d_size = static_cast<int>(n);
+    out.mapping    = mapped;
+    return true;
+}
+
+bool write_lutbin(const std::string& cache_path,
+                  std::uint64_t source_size,
+                  std::uint64_t source_hash,
+                  const std::vector<float>& lut3d,
+                  int lut_size)
+{
+    if (lut_size < 2 || lut_size > kLutBinMaxSize) {
+        return false;
     }
 
-    out3d.reserve(rows.size() * 3);
-    for (const auto& row : rows) {
-        out3d.push_back(normalize_value(row[0], max_value));
-        out3d.push_back(normalize_value(row[1], max_value));
-        out3d.push_back(normalize_value(row[2], max_value));
+    const std::size_t payload_size = lut3d.size() * sizeof(float);
+
+    LutBinHeader header;
+    std::memset(&header, 0, sizeof(header));
+    std::memcpy(header.magic, kLutBinMagic, sizeof(kLutBinMagic));
+    header.version      = kLutBinVersion;
+    header.byte_order   = kLutBinByteOrder;
+    header.lut_size     = static_cast<std::uint32_t>(lut_size);
+    header.source_size  = source_size;
+    header.source_hash  = source_hash;
+    header.payload_hash = content_hash64(lut3d.data(), payload_size);
+
+    // 他のプロセスが古いキャッシュを mmap していても壊さないよう、同じディレクトリの
+    // 一時ファイルに書き切ってから置き換える（書き込み途中で落ちても半端なキャッシュは残らない）
+    static std::atomic<unsigned> temp_serial{0};
+#if defined(_WIN32)
+    const unsigned long pid = static_cast<unsigned long>(GetCurrentProcessId());
+#else
+    const unsigned long pid = static_cast<unsigned long>(getpid());
+#endif
+    const std::string temp_path = cache_path + ".tmp" + std::to_string(pid) + "_" +
+                                  std::to_string(temp_serial.fetch_add(1));
+
+    std::ofstream file(temp_path.c_str(), std::ios::binary | std::ios::trunc);
+    if (!file.is_open()) {
+        std::cerr << "Failed to write LUT cache: " << cache_path << "\n";
+        return false;
+    }
+    file.write(reinterpret_cast<const char*>(&header), sizeof(header));
+    file.write(reinterpret_cast<const char*>(lut3d.data()), static_cast<std::streamsize>(payload_size));
+    file.close();
+    if (!file) {
+        std::cerr << "Failed to write LUT cache: " << cache_path << "\n";
+        std::remove(temp_path.c_str());
+        return false;
     }
 
+#if defined(_WIN32)
+    const bool renamed = MoveFileExA(temp_path.c_str(), cache_path.c_str(), MOVEFILE_REPLACE_EXISTING) != 0;
+#else
+    const bool renamed = std::rename(temp_path.c_str(), cache_path.c_str()) == 0;
+#endif
+    if (!renamed) {
+        std::cerr << "Failed to write LUT cache: " << cache_path << "\n";
+        std::remove(temp_path.c_str());
+        return false;
+    }
     return true;
 }
 
-// パレットのHSBを一度だけ計算してキャッシュ
-bool  g_palette_hsb_initialized = false;
-float g_palette_h[256];
-float g_palette_s[256];
-float g_palette_b[256];
+enum SimdLevel {
+    SIMD_LEVEL_NONE  = 0,
+    SIMD_LEVEL_SSE41 = 1,
+    SIMD_LEVEL_AVX2  = 2
+};
+
+SimdLevel detect_simd_level()
+{
+#if defined(MSX1PQ_HAS_X86_SIMD)
+#if defined(_MSC_VER)
+    int info[4];
+    __cpuid(info, 0);
+    const int max_leaf = info[0];
+
+    __cpuid(info, 1);
+    const bool sse41   = (info[2] & (1 << 19)) != 0;
+    const bool osxsave = (info[2] & (1 << 27)) != 0;
+    const bool avx     = (info[2] & (1 << 28)) != 0;
+
+    bool avx2 = false;
+    if (max_leaf >= 7 && osxsave && avx && (_xgetbv(0) & 0x6) == 0x6) {
+        __cpuidex(info, 7, 0);
+        avx2 = (info[1] & (1 << 5)) != 0;
+    }
+#else
+    __builtin_cpu_init();
+    const bool sse41 = __builtin_cpu_supports("sse4.1") != 0;
+    const bool avx2  = __builtin_cpu_supports("avx2") != 0;
+#endif
+    if (avx2) {
+        return SIMD_LEVEL_AVX2;
+    }
+    if (sse41) {
+        return SIMD_LEVEL_SSE41;
+    }
+#endif
+    return SIMD_LEVEL_NONE;
+}
+
+SimdLevel simd_level()
+{
+    static const SimdLevel level = detect_simd_level();
+    return level;
+}
 
 } // namespace
 
@@ -134,103 +570,61 @@ bool load_pre_lut(const std::string& path,
                   std::vector<float>& out3d,
                   int& lut3d_size)
 {
-    out1d.clear();
-    out3d.clear();
-    lut3d_size = 0;
+    PreLutData data;
+    const bool ok = load_pre_lut(path, false, data);
+    out1d.swap(data.lut1d);
+    out3d.swap(data.lut3d);
+    lut3d_size = ok ? data.lut3d_size : 0;
+    return ok;
+}
 
-    std::ifstream file(path.c_str());
-    if (!file.is_open()) {
+bool load_pre_lut(const std::string& path, bool use_cache, PreLutData& out)
+{
+    out.lut1d.clear();
+    out.lut3d.clear();
+    out.lut3d_data = nullptr;
+    out.lut3d_size = 0;
+    out.mapping.reset();
+
+    MappedFile source;
+    if (!source.open(path)) {
         std::cerr << "Failed to open LUT file: " << path << "\n";
         return false;
     }
+    const char* bytes = source.bytes ? source.bytes : "";
 
     const std::string ext = get_lower_extension(path);
     if (ext == ".cube") {
-        if (parse_cube_lut(file, out3d, lut3d_size)) {
-            return true;
-        }
-
-        file.clear();
-        file.seekg(0);
-    }
-
-    std::vector<int> values;
-    values.reserve(256 * 3);
-
-    std::string line;
-    while (std::getline(file, line)) {
-        const auto comment_pos = line.find('#');
-        if (comment_pos != std::string::npos) {
-            line = line.substr(0, comment_pos);
-        }
-        for (char& c : line) {
-            if (c == ',' || c == ';') {
-                c = ' ';
+        std::string   cache_path;
+        std::uint64_t source_hash = 0;
+        if (use_cache) {
+            cache_path  = lutbin_path_for(path);
+            source_hash = content_hash64(bytes, source.length);
+            if (map_lutbin(cache_path, source.length, source_hash, out)) {
+                return true;
             }
         }
 
-        std::istringstream iss(line);
-        int v;
-        while (iss >> v) {
-            if (v < 0 || v > 255) {
-                std::cerr << "LUT value out of range (0-255): " << v << "\n";
-                return false;
+        if (parse_cube_lut(bytes, source.length, out.lut3d, out.lut3d_size)) {
+            out.lut3d_data = out.lut3d.data();
+            if (use_cache) {
+                write_lutbin(cache_path, source.length, source_hash, out.lut3d, out.lut3d_size);
             }
-            values.push_back(v);
+            return true;
         }
+        out.lut3d_size = 0;
     }
 
-    if (values.size() != 256 * 3) {
-        std::cerr << "LUT must contain 256 RGB triplets (found " << values.size() << " values)\n";
-        return false;
-    }
-
-    out1d.resize(values.size());
-    for (std::size_t i = 0; i < values.size(); ++i) {
-        out1d[i] = static_cast<std::uint8_t>(values[i]);
-    }
-
-    return true;
+    return parse_rgb_lut(bytes, source.length, out.lut1d);
 }
 
 void rgb_to_hsb(std::uint8_t r8, std::uint8_t g8, std::uint8_t b8,
                 float &h, float &s, float &v)
 {
-    float r = r8 / 255.0f;
-    float g = g8 / 255.0f;
-    float b = b8 / 255.0f;
-
-    float maxc = max3f(r, g, b);
-    float minc = min3f(r, g, b);
-    float delta = maxc - minc;
-
-    v = maxc;
-
-    if (maxc <= 0.0f) {
-        s = 0.0f;
-        h = 0.0f;
-        return;
-    }
-
-    s = (delta <= 0.0f) ? 0.0f : (delta / maxc);
-
-    if (delta <= 0.0f) {
-        h = 0.0f;
-    } else {
-        float hue;
-        if (maxc == r) {
-            hue = (g - b) / delta;
-        } else if (maxc == g) {
-            hue = 2.0f + (b - r) / delta;
-        } else {
-            hue = 4.0f + (r - g) / delta;
-        }
-        hue *= 60.0f;
-        if (hue < 0.0f) {
-            hue += 360.0f;
-        }
-        h = hue / 360.0f; // 0〜1 に正規化
-    }
+    const MSX1PQ::HsbColor hsb = MSX1PQ::rgb8_to_hsb(r8, g8, b8);
+    h = hsb.h;
+    s = hsb.s;
+    v = hsb.v;
 }
 
 void hsb_to_rgb(float h, float s, float v,
@@ -268,13 +662,13 @@ void hsb_to_rgb(float h, float s, float v,
     b8 = static_cast<std::uint8_t>(clamp01f(b) * 255.0f + 0.5f);
 }
 
-void apply_preprocess(const QuantInfo *qi,
-                      std::uint8_t &r8,
-                      std::uint8_t &g8,
-                      std::uint8_t &b8)
-{
-    if (!qi) return;
+namespace {
 
+void apply_pre_lut(const QuantInfo *qi,
+                   std::uint8_t &r8,
+                   std::uint8_t &g8,
+                   std::uint8_t &b8)
+{
     if (qi->pre_lut3d && qi->pre_lut3d_size > 1) {
         const int lut_size = qi->pre_lut3d_size;
         const float scale  = static_cast<float>(lut_size - 1);
@@ -371,37 +765,29 @@ void apply_preprocess(const QuantInfo *qi,
         g8 = apply_lut(g8, 1);
         b8 = apply_lut(b8, 2);
     }
+}
 
-    const int posterize_levels = clamp_value(qi->pre_posterize, 0, 255);
-    const bool do_posterize = (posterize_levels > 1);
-    const bool do_hsv_adjust =
-        (qi->pre_sat > 0.0f) || (qi->pre_gamma > 0.0f) ||
-        (qi->pre_highlight > 0.0f) || (qi->pre_hue != 0.0f);
-
-    if (!do_posterize && !do_hsv_adjust) {
-        return;
-    }
-
-    if (do_posterize) {
-        const float scale = static_cast<float>(posterize_levels - 1);
-        auto posterize_channel = [scale](std::uint8_t v) -> std::uint8_t {
-            float normalized = static_cast<float>(v) / 255.0f;
-            float quantized = roundf(normalized * scale) / scale;
-            int quantized8 = static_cast<int>(quantized * 255.0f + 0.5f);
-            if (quantized8 < 0) quantized8 = 0;
-            if (quantized8 > 255) quantized8 = 255;
-            return static_cast<std::uint8_t>(quantized8);
-        };
-
-        r8 = posterize_channel(r8);
-        g8 = posterize_channel(g8);
-        b8 = posterize_channel(b8);
-    }
+inline std::uint8_t posterize_channel(std::uint8_t v, float scale)
+{
+    float normalized = static_cast<float>(v) / 255.0f;
+    float quantized = roundf(normalized * scale) / scale;
+    int quantized8 = static_cast<int>(quantized * 255.0f + 0.5f);
+    if (quantized8 < 0) quantized8 = 0;
+    if (quantized8 > 255) quantized8 = 255;
+    return static_cast<std::uint8_t>(quantized8);
+}
 
-    if (!do_hsv_adjust) {
-        return;
-    }
+bool has_hsb_adjust(const QuantInfo *qi)
+{
+    return (qi->pre_sat > 0.0f) || (qi->pre_gamma > 0.0f) ||
+           (qi->pre_highlight > 0.0f) || (qi->pre_hue != 0.0f);
+}
 
+void apply_hsb_adjust(const QuantInfo *qi,
+                      std::uint8_t &r8,
+                      std::uint8_t &g8,
+                      std::uint8_t &b8)
+{
     float h, s, v;
     rgb_to_hsb(r8, g8, b8, h, s, v);
 
@@ -432,26 +818,43 @@ void apply_preprocess(const QuantInfo *qi,
     hsb_to_rgb(h, s, v, r8, g8, b8);
 }
 
-void ensure_palette_hsb_initialized()
+} // namespace
+
+void apply_preprocess(const QuantInfo *qi,
+                      std::uint8_t &r8,
+                      std::uint8_t &g8,
+                      std::uint8_t &b8)
 {
-    if (g_palette_hsb_initialized) {
+    if (!qi) return;
+
+    apply_pre_lut(qi, r8, g8, b8);
+
+    const int posterize_levels = clamp_value(qi->pre_posterize, 0, 255);
+    const bool do_posterize = (posterize_levels > 1);
+    const bool do_hsv_adjust = has_hsb_adjust(qi);
+
+    if (!do_posterize && !do_hsv_adjust) {
         return;
     }
-    for (int i = 0; i < MSX1PQ::kNumQuantColors; i++) {
-        float h, s, v;
-        rgb_to_hsb(MSX1PQ::kQuantColors[i].r,
-                   MSX1PQ::kQuantColors[i].g,
-                   MSX1PQ::kQuantColors[i].b,
-                   h, s, v);
-        g_palette_h[i] = h;
-        g_palette_s[i] = s;
-        g_palette_b[i] = v;
+
+    if (do_posterize) {
+        const float scale = static_cast<float>(posterize_levels - 1);
+        r8 = posterize_channel(r8, scale);
+        g8 = posterize_channel(g8, scale);
+        b8 = posterize_channel(b8, scale);
+    }
+
+    if (!do_hsv_adjust) {
+        return;
     }
-    g_palette_hsb_initialized = true;
+
+    apply_hsb_adjust(qi, r8, g8, b8);
 }
 
-int nearest_palette_rgb(std::uint8_t r8, std::uint8_t g8, std::uint8_t b8,
-                        int num_colors)
+namespace {
+
+int nearest_palette_rgb_scalar(std::uint8_t r8, std::uint8_t g8, std::uint8_t b8,
+                               int num_colors)
 {
     int   best_idx = 0;
     float best_d2  = 1.0e30f;
@@ -471,22 +874,17 @@ int nearest_palette_rgb(std::uint8_t r8, std::uint8_t g8, std::uint8_t b8,
     return best_idx;
 }
 
-int nearest_palette_hsb(std::uint8_t r8, std::uint8_t g8, std::uint8_t b8,
-                        float w_h, float w_s, float w_b,
-                        int num_colors)
+int nearest_palette_hsb_scalar(float h, float s, float v,
+                               float w_h, float w_s, float w_b,
+                               int num_colors)
 {
-    ensure_palette_hsb_initialized();
-
-    float h, s, v;
-    rgb_to_hsb(r8, g8, b8, h, s, v);
-
     int   best_idx = 0;
     float best_d2  = 1.0e30f;
 
     for (int i = 0; i < num_colors; ++i) {
-        float dh = h - g_palette_h[i];
-        float ds = s - g_palette_s[i];
-        float dv = v - g_palette_b[i];
+        float dh = h - MSX1PQ::kPaletteSoA.h[i];
+        float ds = s - MSX1PQ::kPaletteSoA.s[i];
+        float dv = v - MSX1PQ::kPaletteSoA.v[i];
 
         float d2 = (w_h * dh * dh +
                     w_s * ds * ds +
@@ -500,28 +898,248 @@ int nearest_palette_hsb(std::uint8_t r8, std::uint8_t g8, std::uint8_t b8,
     return best_idx;
 }
 
-int nearest_basic_hsb(std::uint8_t r8, std::uint8_t g8, std::uint8_t b8,
-                      float w_h, float w_s, float w_b)
+#if defined(MSX1PQ_HAS_X86_SIMD)
+
+// ------------------------------------------------------------
+// SIMD カーネル
+// 各レーンで「厳密に小さいときだけ更新」し、最後に最小距離のレーンのうち
+// 最小インデックスを選ぶことでスカラー版と同じタイブレークになる。
+// 距離の式は演算順までスカラー版と揃えてあり、FMA は使わない。
+// ------------------------------------------------------------
+
+MSX1PQ_TARGET_AVX2
+inline int argmin_avx2(__m256 best_d2, __m256i best_idx)
 {
-    ensure_palette_hsb_initialized();
+    __m256 m = _mm256_min_ps(best_d2, _mm256_permute2f128_ps(best_d2, best_d2, 1));
+    m = _mm256_min_ps(m, _mm256_shuffle_ps(m, m, _MM_SHUFFLE(1, 0, 3, 2)));
+    m = _mm256_min_ps(m, _mm256_shuffle_ps(m, m, _MM_SHUFFLE(2, 3, 0, 1)));
 
-    float h, s, v;
-    rgb_to_hsb(r8, g8, b8, h, s, v);
+    const __m256i eq = _mm256_castps_si256(_mm256_cmp_ps(best_d2, m, _CMP_EQ_OQ));
+    __m256i idx = _mm256_blendv_epi8(_mm256_set1_epi32(0x7fffffff), best_idx, eq);
+    idx = _mm256_min_epi32(idx, _mm256_permute2x128_si256(idx, idx, 1));
+    idx = _mm256_min_epi32(idx, _mm256_shuffle_epi32(idx, _MM_SHUFFLE(1, 0, 3, 2)));
+    idx = _mm256_min_epi32(idx, _mm256_shuffle_epi32(idx, _MM_SHUFFLE(2, 3, 0, 1)));
+    return _mm256_cvtsi256_si32(idx);
+}
 
-    float wh = clamp01f(w_h);
-    float ws = clamp01f(w_s);
-    float wb = clamp01f(w_b);
+MSX1PQ_TARGET_AVX2
+int nearest_palette_rgb_avx2(std::uint8_t r8, std::uint8_t g8, std::uint8_t b8,
+                             int num_colors)
+{
+    const __m256  vr    = _mm256_set1_ps(static_cast<float>(r8));
+    const __m256  vg    = _mm256_set1_ps(static_cast<float>(g8));
+    const __m256  vb    = _mm256_set1_ps(static_cast<float>(b8));
+    const __m256i limit = _mm256_set1_epi32(num_colors);
+    const __m256i step  = _mm256_set1_epi32(8);
+
+    __m256i idx      = _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7);
+    __m256  best_d2  = _mm256_set1_ps(1.0e30f);
+    __m256i best_idx = _mm256_setzero_si256();
+
+    for (int i = 0; i < num_colors; i += 8) {
+        const __m256 dr = _mm256_sub_ps(vr, _mm256_load_ps(&MSX1PQ::kPaletteSoA.r[i]));
+        const __m256 dg = _mm256_sub_ps(vg, _mm256_load_ps(&MSX1PQ::kPaletteSoA.g[i]));
+        const __m256 db = _mm256_sub_ps(vb, _mm256_load_ps(&MSX1PQ::kPaletteSoA.b[i]));
+        const __m256 d2 = _mm256_add_ps(
+            _mm256_add_ps(_mm256_mul_ps(dr, dr), _mm256_mul_ps(dg, dg)),
+            _mm256_mul_ps(db, db));
+
+        const __m256 valid = _mm256_castsi256_ps(_mm256_cmpgt_epi32(limit, idx));
+        const __m256 lt    = _mm256_and_ps(_mm256_cmp_ps(d2, best_d2, _CMP_LT_OQ), valid);
+
+        best_d2  = _mm256_blendv_ps(best_d2, d2, lt);
+        best_idx = _mm256_castps_si256(_mm256_blendv_ps(
+            _mm256_castsi256_ps(best_idx), _mm256_castsi256_ps(idx), lt));
+        idx = _mm256_add_epi32(idx, step);
+    }
+    return argmin_avx2(best_d2, best_idx);
+}
+
+MSX1PQ_TARGET_AVX2
+int nearest_palette_hsb_avx2(float h, float s, float v,
+                             float w_h, float w_s, float w_b,
+                             int num_colors)
+{
+    const __m256  vh    = _mm256_set1_ps(h);
+    const __m256  vs    = _mm256_set1_ps(s);
+    const __m256  vv    = _mm256_set1_ps(v);
+    const __m256  wh    = _mm256_set1_ps(w_h);
+    const __m256  ws    = _mm256_set1_ps(w_s);
+    const __m256  wb    = _mm256_set1_ps(w_b);
+    const __m256i limit = _mm256_set1_epi32(num_colors);
+    const __m256i step  = _mm256_set1_epi32(8);
+
+    __m256i idx      = _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7);
+    __m256  best_d2  = _mm256_set1_ps(1.0e30f);
+    __m256i best_idx = _mm256_setzero_si256();
+
+    for (int i = 0; i < num_colors; i += 8) {
+        const __m256 dh = _mm256_sub_ps(vh, _mm256_load_ps(&MSX1PQ::kPaletteSoA.h[i]));
+        const __m256 ds = _mm256_sub_ps(vs, _mm256_load_ps(&MSX1PQ::kPaletteSoA.s[i]));
+        const __m256 dv = _mm256_sub_ps(vv, _mm256_load_ps(&MSX1PQ::kPaletteSoA.v[i]));
+        const __m256 d2 = _mm256_add_ps(
+            _mm256_add_ps(_mm256_mul_ps(_mm256_mul_ps(wh, dh), dh),
+                          _mm256_mul_ps(_mm256_mul_ps(ws, ds), ds)),
+            _mm256_mul_ps(_mm256_mul_ps(wb, dv), dv));
+
+        const __m256 valid = _mm256_castsi256_ps(_mm256_cmpgt_epi32(limit, idx));
+        const __m256 lt    = _mm256_and_ps(_mm256_cmp_ps(d2, best_d2, _CMP_LT_OQ), valid);
+
+        best_d2  = _mm256_blendv_ps(best_d2, d2, lt);
+        best_idx = _mm256_castps_si256(_mm256_blendv_ps(
+            _mm256_castsi256_ps(best_idx), _mm256_castsi256_ps(idx), lt));
+        idx = _mm256_add_epi32(idx, step);
+    }
+    return argmin_avx2(best_d2, best_idx);
+}
+
+MSX1PQ_TARGET_SSE41
+inline int argmin_sse41(__m128 best_d2, __m128i best_idx)
+{
+    __m128 m = _mm_min_ps(best_d2, _mm_shuffle_ps(best_d2, best_d2, _MM_SHUFFLE(1, 0, 3, 2)));
+    m = _mm_min_ps(m, _mm_shuffle_ps(m, m, _MM_SHUFFLE(2, 3, 0, 1)));
+
+    const __m128i eq = _mm_castps_si128(_mm_cmpeq_ps(best_d2, m));
+    __m128i idx = _mm_blendv_epi8(_mm_set1_epi32(0x7fffffff), best_idx, eq);
+    idx = _mm_min_epi32(idx, _mm_shuffle_epi32(idx, _MM_SHUFFLE(1, 0, 3, 2)));
+    idx = _mm_min_epi32(idx, _mm_shuffle_epi32(idx, _MM_SHUFFLE(2, 3, 0, 1)));
+    return _mm_cvtsi128_si32(idx);
+}
+
+MSX1PQ_TARGET_SSE41
+int nearest_palette_rgb_sse41(std::uint8_t r8, std::uint8_t g8, std::uint8_t b8,
+                              int num_colors)
+{
+    const __m128  vr    = _mm_set1_ps(static_cast<float>(r8));
+    const __m128  vg    = _mm_set1_ps(static_cast<float>(g8));
+    const __m128  vb    = _mm_set1_ps(static_cast<float>(b8));
+    const __m128i limit = _mm_set1_epi32(num_colors);
+    const __m128i step  = _mm_set1_epi32(4);
+
+    __m128i idx      = _mm_setr_epi32(0, 1, 2, 3);
+    __m128  best_d2  = _mm_set1_ps(1.0e30f);
+    __m128i best_idx = _mm_setzero_si128();
+
+    for (int i = 0; i < num_colors; i += 4) {
+        const __m128 dr = _mm_sub_ps(vr, _mm_load_ps(&MSX1PQ::kPaletteSoA.r[i]));
+        const __m128 dg = _mm_sub_ps(vg, _mm_load_ps(&MSX1PQ::kPaletteSoA.g[i]));
+        const __m128 db = _mm_sub_ps(vb, _mm_load_ps(&MSX1PQ::kPaletteSoA.b[i]));
+        const __m128 d2 = _mm_add_ps(
+            _mm_add_ps(_mm_mul_ps(dr, dr), _mm_mul_ps(dg, dg)),
+            _mm_mul_ps(db, db));
+
+        const __m128 valid = _mm_castsi128_ps(_mm_cmpgt_epi32(limit, idx));
+        const __m128 lt    = _mm_and_ps(_mm_cmplt_ps(d2, best_d2), valid);
+
+        best_d2  = _mm_blendv_ps(best_d2, d2, lt);
+        best_idx = _mm_castps_si128(_mm_blendv_ps(
+            _mm_castsi128_ps(best_idx), _mm_castsi128_ps(idx), lt));
+        idx = _mm_add_epi32(idx, step);
+    }
+    return argmin_sse41(best_d2, best_idx);
+}
+
+MSX1PQ_TARGET_SSE41
+int nearest_palette_hsb_sse41(float h, float s, float v,
+                              float w_h, float w_s, float w_b,
+                              int num_colors)
+{
+    const __m128  vh    = _mm_set1_ps(h);
+    const __m128  vs    = _mm_set1_ps(s);
+    const __m128  vv    = _mm_set1_ps(v);
+    const __m128  wh    = _mm_set1_ps(w_h);
+    const __m128  ws    = _mm_set1_ps(w_s);
+    const __m128  wb    = _mm_set1_ps(w_b);
+    const __m128i limit = _mm_set1_epi32(num_colors);
+    const __m128i step  = _mm_set1_epi32(4);
+
+    __m128i idx      = _mm_setr_epi32(0, 1, 2, 3);
+    __m128  best_d2  = _mm_set1_ps(1.0e30f);
+    __m128i best_idx = _mm_setzero_si128();
+
+    for (int i = 0; i < num_colors; i += 4) {
+        const __m128 dh = _mm_sub_ps(vh, _mm_load_ps(&MSX1PQ::kPaletteSoA.h[i]));
+        const __m128 ds = _mm_sub_ps(vs, _mm_load_ps(&MSX1PQ::kPaletteSoA.s[i]));
+        const __m128 dv = _mm_sub_ps(vv, _mm_load_ps(&MSX1PQ::kPaletteSoA.v[i]));
+        const __m128 d2 = _mm_add_ps(
+            _mm_add_ps(_mm_mul_ps(_mm_mul_ps(wh, dh), dh),
+                       _mm_mul_ps(_mm_mul_ps(ws, ds), ds)),
+            _mm_mul_ps(_mm_mul_ps(wb, dv), dv));
+
+        const __m128 valid = _mm_castsi128_ps(_mm_cmpgt_epi32(limit, idx));
+        const __m128 lt    = _mm_and_ps(_mm_cmplt_ps(d2, best_d2), valid);
+
+        best_d2  = _mm_blendv_ps(best_d2, d2, lt);
+        best_idx = _mm_castps_si128(_mm_blendv_ps(
+            _mm_castsi128_ps(best_idx), _mm_castsi128_ps(idx), lt));
+        idx = _mm_add_epi32(idx, step);
+    }
+    return argmin_sse41(best_d2, best_idx);
+}
+
+#endif // MSX1PQ_HAS_X86_SIMD
+
+} // namespace
+
+int nearest_palette_rgb(std::uint8_t r8, std::uint8_t g8, std::uint8_t b8,
+                        int num_colors)
+{
+
+#if defined(MSX1PQ_HAS_X86_SIMD)
+    switch (simd_level()) {
+    case SIMD_LEVEL_AVX2:
+        return nearest_palette_rgb_avx2(r8, g8, b8, num_colors);
+    case SIMD_LEVEL_SSE41:
+        return nearest_palette_rgb_sse41(r8, g8, b8, num_colors);
+    default:
+        break;
+    }
+#endif
+    return nearest_palette_rgb_scalar(r8, g8, b8, num_colors);
+}
+
+int nearest_palette_hsb(std::uint8_t r8, std::uint8_t g8, std::uint8_t b8,
+                        float w_h, float w_s, float w_b,
+                        int num_colors)
+{
+
+    float h, s, v;
+    rgb_to_hsb(r8, g8, b8, h, s, v);
+
+#if defined(MSX1PQ_HAS_X86_SIMD)
+    switch (simd_level()) {
+    case SIMD_LEVEL_AVX2:
+        return nearest_palette_hsb_avx2(h, s, v, w_h, w_s, w_b, num_colors);
+    case SIMD_LEVEL_SSE41:
+        return nearest_palette_hsb_sse41(h, s, v, w_h, w_s, w_b, num_colors);
+    default:
+        break;
+    }
+#endif
+    return nearest_palette_hsb_scalar(h, s, v, w_h, w_s, w_b, num_colors);
+}
+
+int nearest_basic_hsb(std::uint8_t r8, std::uint8_t g8, std::uint8_t b8,
+                      float w_h, float w_s, float w_b)
+{
+
+    float h, s, v;
+    rgb_to_hsb(r8, g8, b8, h, s, v);
+
+    float wh = clamp01f(w_h);
+    float ws = clamp01f(w_s);
+    float wb = clamp01f(w_b);
 
     int   best_idx = 0;
     float best_d2  = 1.0e30f;
 
     for (int i = 0; i < MSX1PQ::kNumBasicColors; i++) {
-        float dh = std::fabs(h - g_palette_h[i]);
+        float dh = std::fabs(h - MSX1PQ::kPaletteSoA.h[i]);
         if (dh > 0.5f) {
             dh = 1.0f - dh;
         }
-        float ds = s - g_palette_s[i];
-        float dv = v - g_palette_b[i];
+        float ds = s - MSX1PQ::kPaletteSoA.s[i];
+        float dv = v - MSX1PQ::kPaletteSoA.v[i];
 
         float d2 =
             (wh * dh) * (wh * dh) +
@@ -546,6 +1164,16 @@ const MSX1PQ::QuantColor* get_basic_palette(int color_system)
 int find_basic_index_from_rgb(std::uint8_t r, std::uint8_t g, std::uint8_t b,
                               int color_system)
 {
+    // 量子化済みの画素は基本色そのものなので、まず完全一致を引く
+    const int exact = MSX1PQ::exact_basic_index(
+        (color_system == MSX1PQ_COLOR_SYS_MSX2) ? MSX1PQ::kBasicColorHashMsx2
+                                                : MSX1PQ::kBasicColorHashMsx1,
+        r, g, b);
+    if (exact >= 0) {
+        return exact;
+    }
+
+    // 基本色以外の入力だけ最近傍を走査する
     const MSX1PQ::QuantColor* table = get_basic_palette(color_system);
 
     int  best_idx  = 0;
@@ -565,6 +1193,58 @@ int find_basic_index_from_rgb(std::uint8_t r, std::uint8_t g, std::uint8_t b,
     return best_idx;
 }
 
+const MSX1PQ::QuantColor* get_output_palette(const QuantInfo& qi)
+{
+    return qi.use_palette_color
+        ? MSX1PQ::kQuantColors
+        : get_basic_palette(qi.color_system);
+}
+
+int search_palette_index(const QuantInfo& qi,
+                         std::uint8_t r,
+                         std::uint8_t g,
+                         std::uint8_t b)
+{
+    if (qi.nearest_lut) {
+        return qi.nearest_lut[rgb_key(r, g, b)];
+    }
+
+    if (qi.use_palette_color || qi.use_dither) {
+        if (qi.palette_grid) {
+            return nearest_palette_grid(*qi.palette_grid, r, g, b);
+        }
+
+        int num_colors = MSX1PQ::kNumQuantColors;
+        if (!qi.use_palette_color && !qi.use_dark_dither) {
+            num_colors = MSX1PQ::kFirstDarkDitherIndex;
+        }
+
+        return qi.use_hsb
+            ? nearest_palette_hsb(r, g, b, qi.w_h, qi.w_s, qi.w_b, num_colors)
+            : nearest_palette_rgb(r, g, b, num_colors);
+    }
+
+    if (qi.use_hsb) {
+        return nearest_basic_hsb(r, g, b, qi.w_h, qi.w_s, qi.w_b);
+    }
+    return MSX1PQ::nearest_basic_rgb(r, g, b);
+}
+
+int quantize_pixel_index(const QuantInfo& qi,
+                         std::uint8_t r,
+                         std::uint8_t g,
+                         std::uint8_t b,
+                         std::int32_t x,
+                         std::int32_t y)
+{
+    const int idx = search_palette_index(qi, r, g, b);
+
+    if (!qi.use_palette_color && qi.use_dither) {
+        return MSX1PQ::palette_index_to_basic_index(idx, x, y);
+    }
+    return idx;
+}
+
 MSX1PQ::QuantColor quantize_pixel(const QuantInfo& qi,
                                   std::uint8_t r,
                                   std::uint8_t g,
@@ -572,58 +1252,2856 @@ MSX1PQ::QuantColor quantize_pixel(const QuantInfo& qi,
                                   std::int32_t x,
                                   std::int32_t y)
 {
-    if (qi.use_palette_color) {
-        const int palette_idx = qi.use_hsb
-            ? nearest_palette_hsb(r, g, b, qi.w_h, qi.w_s, qi.w_b, MSX1PQ::kNumQuantColors)
-            : nearest_palette_rgb(r, g, b, MSX1PQ::kNumQuantColors);
+    return get_output_palette(qi)[quantize_pixel_index(qi, r, g, b, x, y)];
+}
+
+bool build_posterize_table(const QuantInfo& qi, PosterizeTable& table)
+{
+    table.levels  = 0;
+    table.phases  = 0;
+    table.palette = nullptr;
+    table.indices.clear();
 
-        return MSX1PQ::kQuantColors[palette_idx];
+    const int levels = clamp_value(qi.pre_posterize, 0, 255);
+    if (levels <= 1 || levels > POSTERIZE_TABLE_MAX_LEVELS) {
+        return false;
     }
 
-    int basic_idx = 0;
+    // ポスタリゼーションの段階値と、入力値 → 段階インデックスの対応
+    const float scale = static_cast<float>(levels - 1);
+    std::uint8_t level_value[POSTERIZE_TABLE_MAX_LEVELS];
+    for (int k = 0; k < levels; ++k) {
+        int v = static_cast<int>((static_cast<float>(k) / scale) * 255.0f + 0.5f);
+        level_value[k] = static_cast<std::uint8_t>(clamp_value(v, 0, 255));
+    }
+    for (int v = 0; v < 256; ++v) {
+        const float normalized = static_cast<float>(v) / 255.0f;
+        table.level_of[v] = static_cast<std::uint8_t>(roundf(normalized * scale));
+    }
 
-    if (qi.use_dither) {
-        int num_colors = MSX1PQ::kNumQuantColors;
-        if (!qi.use_dark_dither) {
-            num_colors = MSX1PQ::kFirstDarkDitherIndex;
+    // ディザ時のみ位相ごとに結果が変わる
+    const bool use_phases = !qi.use_palette_color && qi.use_dither;
+    const int  phases     = use_phases ? DITHER_PHASES : 1;
+    const bool do_hsv_adjust = has_hsb_adjust(&qi);
+
+    const std::size_t num_entries =
+        static_cast<std::size_t>(levels) * levels * levels;
+    table.indices.resize(num_entries * phases);
+
+    std::size_t key = 0;
+    for (int lr = 0; lr < levels; ++lr) {
+        for (int lg = 0; lg < levels; ++lg) {
+            for (int lb = 0; lb < levels; ++lb, ++key) {
+                std::uint8_t r = level_value[lr];
+                std::uint8_t g = level_value[lg];
+                std::uint8_t b = level_value[lb];
+                if (do_hsv_adjust) {
+                    apply_hsb_adjust(&qi, r, g, b);
+                }
+
+                const int palette_idx = search_palette_index(qi, r, g, b);
+                if (!use_phases) {
+                    table.indices[key] = static_cast<std::uint8_t>(palette_idx);
+                    continue;
+                }
+
+                for (int phase = 0; phase < DITHER_PHASES; ++phase) {
+                    const int basic_idx = MSX1PQ::palette_index_to_basic_index(
+                        palette_idx, phase & 1, phase >> 1);
+                    table.indices[phase * num_entries + key] =
+                        static_cast<std::uint8_t>(basic_idx);
+                }
+            }
         }
+    }
 
-        const int palette_idx = qi.use_hsb
-            ? nearest_palette_hsb(r, g, b, qi.w_h, qi.w_s, qi.w_b, num_colors)
-            : nearest_palette_rgb(r, g, b, num_colors);
+    table.levels  = levels;
+    table.phases  = phases;
+    table.palette = get_output_palette(qi);
+    return true;
+}
 
-        basic_idx = MSX1PQ::palette_index_to_basic_index(palette_idx, x, y);
-    } else if (qi.use_hsb) {
-        basic_idx = nearest_basic_hsb(r, g, b, qi.w_h, qi.w_s, qi.w_b);
-    } else {
-        basic_idx = MSX1PQ::nearest_basic_rgb(r, g, b);
+namespace {
+
+// LUT 適用後の値で色ごと結果テーブルを引く（table.palette のインデックス）
+inline int lookup_posterize_index(const PosterizeTable& table,
+                                  std::uint8_t r,
+                                  std::uint8_t g,
+                                  std::uint8_t b,
+                                  std::int32_t x,
+                                  std::int32_t y)
+{
+    const std::size_t levels = static_cast<std::size_t>(table.levels);
+    std::size_t key =
+        (table.level_of[r] * levels + table.level_of[g]) * levels + table.level_of[b];
+    if (table.phases > 1) {
+        key += static_cast<std::size_t>(dither_phase(x, y)) * levels * levels * levels;
     }
+    return table.indices[key];
+}
+
+MSX1PQ::QuantColor lookup_posterize_table(const PosterizeTable& table,
+                                          std::uint8_t r,
+                                          std::uint8_t g,
+                                          std::uint8_t b,
+                                          std::int32_t x,
+                                          std::int32_t y)
+{
+    return table.palette[lookup_posterize_index(table, r, g, b, x, y)];
+}
 
-    const MSX1PQ::QuantColor* palette =
-        (qi.color_system == MSX1PQ_COLOR_SYS_MSX2)
-            ? MSX1PQ::kBasicColorsMsx2
-            : MSX1PQ::kQuantColors;
+} // namespace
 
-    return palette[basic_idx];
+MSX1PQ::QuantColor quantize_pixel_posterized(const QuantInfo& qi,
+                                             const PosterizeTable& table,
+                                             std::uint8_t r,
+                                             std::uint8_t g,
+                                             std::uint8_t b,
+                                             std::int32_t x,
+                                             std::int32_t y)
+{
+    apply_pre_lut(&qi, r, g, b);
+    return lookup_posterize_table(table, r, g, b, x, y);
 }
 
-int transition_cost_pair(int prevA, int prevB, int a, int b)
+// ------------------------------------------------------------
+// 量子化プラン
+// ------------------------------------------------------------
+namespace {
+
+void apply_hsb_adjust_plan(const QuantPlan& plan,
+                           std::uint8_t &r8,
+                           std::uint8_t &g8,
+                           std::uint8_t &b8)
 {
-    const int COST_SAME          = 0;
-    const int COST_SAME_BUT_SWAP = 3;
-    const int COST_DIFFERENT     = 8;
+    float h, s, v;
+    rgb_to_hsb(r8, g8, b8, h, s, v);
 
-    if (prevA < 0 || prevB < 0) {
-        return COST_SAME;
+    if (plan.do_hue) {
+        h += plan.hue_offset;
     }
 
-    if ((a == prevA && b == prevB)) return COST_SAME;
-    if ((a == prevB && b == prevA)) return COST_SAME_BUT_SWAP;
-    if (a == prevA || b == prevB)   return COST_SAME_BUT_SWAP;
-    if (a == prevB || b == prevA)   return COST_SAME_BUT_SWAP;
+    if (plan.do_sat) {
+        s *= plan.sat_scale;
+    }
 
-    return COST_DIFFERENT;
+    if (plan.do_gamma) {
+        // v は max(r, g, b) / 255 なので 256 通りしかない
+        std::uint8_t maxc = (r8 > g8) ? r8 : g8;
+        maxc = (maxc > b8) ? maxc : b8;
+        v = plan.gamma_curve[maxc];
+    }
+
+    if (plan.do_highlight) {
+        if (v > 0.5f) {
+            float t = (v - 0.5f) / 0.5f;
+            t *= plan.highlight_scale;
+            t  = clamp01f(t);
+            v  = 0.5f + t * 0.5f;
+        }
+    }
+
+    hsb_to_rgb(h, s, v, r8, g8, b8);
 }
 
-} // namespace MSX1PQCore
+// LUT 以降の前処理（ポスタリゼーション・HSB 補正）
+void apply_adjust_plan(const QuantPlan& plan,
+                       std::uint8_t &r8,
+                       std::uint8_t &g8,
+                       std::uint8_t &b8)
+{
+    if (plan.do_posterize) {
+        r8 = plan.posterize_lut[r8];
+        g8 = plan.posterize_lut[g8];
+        b8 = plan.posterize_lut[b8];
+    }
+
+    if (plan.do_hsb_adjust) {
+        apply_hsb_adjust_plan(plan, r8, g8, b8);
+    }
+}
+
+MSX1PQ::QuantColor quantize_plan_direct(const QuantPlan& plan,
+                                        std::uint8_t r,
+                                        std::uint8_t g,
+                                        std::uint8_t b,
+                                        std::int32_t x,
+                                        std::int32_t y)
+{
+    return quantize_pixel(plan.qi, r, g, b, x, y);
+}
+
+MSX1PQ::QuantColor quantize_plan_lut_only(const QuantPlan& plan,
+                                          std::uint8_t r,
+                                          std::uint8_t g,
+                                          std::uint8_t b,
+                                          std::int32_t x,
+                                          std::int32_t y)
+{
+    apply_pre_lut(&plan.qi, r, g, b);
+    return quantize_pixel(plan.qi, r, g, b, x, y);
+}
+
+MSX1PQ::QuantColor quantize_plan_preprocess(const QuantPlan& plan,
+                                            std::uint8_t r,
+                                            std::uint8_t g,
+                                            std::uint8_t b,
+                                            std::int32_t x,
+                                            std::int32_t y)
+{
+    apply_preprocess_plan(plan, r, g, b);
+    return quantize_pixel(plan.qi, r, g, b, x, y);
+}
+
+MSX1PQ::QuantColor quantize_plan_table(const QuantPlan& plan,
+                                       std::uint8_t r,
+                                       std::uint8_t g,
+                                       std::uint8_t b,
+                                       std::int32_t x,
+                                       std::int32_t y)
+{
+    return quantize_pixel_posterized(plan.qi, plan.table, r, g, b, x, y);
+}
+
+// ---- LUT 適用済みの画素用 ----
+MSX1PQ::QuantColor quantize_plan_adjust_after_lut(const QuantPlan& plan,
+                                                  std::uint8_t r,
+                                                  std::uint8_t g,
+                                                  std::uint8_t b,
+                                                  std::int32_t x,
+                                                  std::int32_t y)
+{
+    apply_adjust_plan(plan, r, g, b);
+    return quantize_pixel(plan.qi, r, g, b, x, y);
+}
+
+MSX1PQ::QuantColor quantize_plan_table_after_lut(const QuantPlan& plan,
+                                                 std::uint8_t r,
+                                                 std::uint8_t g,
+                                                 std::uint8_t b,
+                                                 std::int32_t x,
+                                                 std::int32_t y)
+{
+    return lookup_posterize_table(plan.table, r, g, b, x, y);
+}
+
+void build_pre_lut3d_axes(const QuantInfo& qi, PreLut3dAxes& axes)
+{
+    // apply_pre_lut の sample() と同じ計算を入力値ごとに済ませておく
+    const int   lut_size = qi.pre_lut3d_size;
+    const float scale    = static_cast<float>(lut_size - 1);
+    const std::int32_t axis_stride[3] = {
+        3,
+        lut_size * 3,
+        lut_size * lut_size * 3
+    };
+    for (int v = 0; v < 256; ++v) {
+        float pos  = (static_cast<float>(v) / 255.0f) * scale;
+        int   idx0 = static_cast<int>(floorf(pos));
+        int   idx1 = idx0 + 1;
+        float t    = pos - static_cast<float>(idx0);
+        if (idx1 >= lut_size) {
+            idx1 = lut_size - 1;
+        }
+        for (int axis = 0; axis < 3; ++axis) {
+            axes.off0[axis][v] = idx0 * axis_stride[axis];
+            axes.off1[axis][v] = idx1 * axis_stride[axis];
+            axes.t[axis][v]    = t;
+        }
+    }
+    axes.lut = qi.pre_lut3d;
+}
+
+inline float lerp_lut3d(float a, float b, float t)
+{
+    return a + (b - a) * t;
+}
+
+void apply_pre_lut3d_row_scalar(const PreLut3dAxes& axes,
+                                std::uint8_t* r,
+                                std::uint8_t* g,
+                                std::uint8_t* b,
+                                std::size_t   count,
+                                std::ptrdiff_t pixel_stride)
+{
+    for (std::size_t i = 0; i < count; ++i) {
+        const std::ptrdiff_t p = static_cast<std::ptrdiff_t>(i) * pixel_stride;
+        const std::uint8_t r8 = r[p];
+        const std::uint8_t g8 = g[p];
+        const std::uint8_t b8 = b[p];
+
+        const std::int32_t x0 = axes.off0[0][r8], x1 = axes.off1[0][r8];
+        const std::int32_t y0 = axes.off0[1][g8], y1 = axes.off1[1][g8];
+        const std::int32_t z0 = axes.off0[2][b8], z1 = axes.off1[2][b8];
+        const float tx = axes.t[0][r8];
+        const float ty = axes.t[1][g8];
+        const float tz = axes.t[2][b8];
+
+        const float* c000 = axes.lut + (x0 + y0 + z0);
+        const float* c100 = axes.lut + (x1 + y0 + z0);
+        const float* c010 = axes.lut + (x0 + y1 + z0);
+        const float* c110 = axes.lut + (x1 + y1 + z0);
+        const float* c001 = axes.lut + (x0 + y0 + z1);
+        const float* c101 = axes.lut + (x1 + y0 + z1);
+        const float* c011 = axes.lut + (x0 + y1 + z1);
+        const float* c111 = axes.lut + (x1 + y1 + z1);
+
+        std::uint8_t* out[3] = { r + p, g + p, b + p };
+        for (int c = 0; c < 3; ++c) {
+            float c00 = lerp_lut3d(c000[c], c100[c], tx);
+            float c01 = lerp_lut3d(c001[c], c101[c], tx);
+            float c10 = lerp_lut3d(c010[c], c110[c], tx);
+            float c11 = lerp_lut3d(c011[c], c111[c], tx);
+
+            float c0 = lerp_lut3d(c00, c10, ty);
+            float c1 = lerp_lut3d(c01, c11, ty);
+            float v  = lerp_lut3d(c0, c1, tz);
+            *out[c] = static_cast<std::uint8_t>(clamp_value(v * 255.0f + 0.5f, 0.0f, 255.0f));
+        }
+    }
+}
 
+#if defined(MSX1PQ_HAS_X86_SIMD)
+
+MSX1PQ_TARGET_AVX2
+inline __m256 lerp_lut3d_avx2(__m256 a, __m256 b, __m256 t)
+{
+    return _mm256_add_ps(a, _mm256_mul_ps(_mm256_sub_ps(b, a), t));
+}
+
+// 8 画素ずつ格子点を gather して三線形補間する（演算順はスカラー版と同じ）
+MSX1PQ_TARGET_AVX2
+void apply_pre_lut3d_row_avx2(const PreLut3dAxes& axes,
+                              std::uint8_t* r,
+                              std::uint8_t* g,
+                              std::uint8_t* b,
+                              std::size_t   count,
+                              std::ptrdiff_t pixel_stride)
+{
+    const __m256 v255  = _mm256_set1_ps(255.0f);
+    const __m256 vhalf = _mm256_set1_ps(0.5f);
+    const __m256 vzero = _mm256_setzero_ps();
+
+    std::uint8_t* channels[3] = { r, g, b };
+
+    std::size_t i = 0;
+    for (; i + 8 <= count; i += 8) {
+        alignas(32) std::int32_t in[3][8];
+        for (int k = 0; k < 8; ++k) {
+            const std::ptrdiff_t p = static_cast<std::ptrdiff_t>(i + k) * pixel_stride;
+            in[0][k] = r[p];
+            in[1][k] = g[p];
+            in[2][k] = b[p];
+        }
+
+        __m256i lo[3], hi[3];
+        __m256  t[3];
+        for (int axis = 0; axis < 3; ++axis) {
+            const __m256i v = _mm256_load_si256(reinterpret_cast<const __m256i*>(in[axis]));
+            lo[axis] = _mm256_i32gather_epi32(reinterpret_cast<const int*>(axes.off0[axis]), v, 4);
+            hi[axis] = _mm256_i32gather_epi32(reinterpret_cast<const int*>(axes.off1[axis]), v, 4);
+            t[axis]  = _mm256_i32gather_ps(axes.t[axis], v, 4);
+        }
+
+        const __m256i o000 = _mm256_add_epi32(_mm256_add_epi32(lo[0], lo[1]), lo[2]);
+        const __m256i o100 = _mm256_add_epi32(_mm256_add_epi32(hi[0], lo[1]), lo[2]);
+        const __m256i o010 = _mm256_add_epi32(_mm256_add_epi32(lo[0], hi[1]), lo[2]);
+        const __m256i o110 = _mm256_add_epi32(_mm256_add_epi32(hi[0], hi[1]), lo[2]);
+        const __m256i o001 = _mm256_add_epi32(_mm256_add_epi32(lo[0], lo[1]), hi[2]);
+        const __m256i o101 = _mm256_add_epi32(_mm256_add_epi32(hi[0], lo[1]), hi[2]);
+        const __m256i o011 = _mm256_add_epi32(_mm256_add_epi32(lo[0], hi[1]), hi[2]);
+        const __m256i o111 = _mm256_add_epi32(_mm256_add_epi32(hi[0], hi[1]), hi[2]);
+
+        for (int c = 0; c < 3; ++c) {
+            const float* base = axes.lut + c;
+            const __m256 c00 = lerp_lut3d_avx2(_mm256_i32gather_ps(base, o000, 4),
+                                               _mm256_i32gather_ps(base, o100, 4), t[0]);
+            const __m256 c01 = lerp_lut3d_avx2(_mm256_i32gather_ps(base, o001, 4),
+                                               _mm256_i32gather_ps(base, o101, 4), t[0]);
+            const __m256 c10 = lerp_lut3d_avx2(_mm256_i32gather_ps(base, o010, 4),
+                                               _mm256_i32gather_ps(base, o110, 4), t[0]);
+            const __m256 c11 = lerp_lut3d_avx2(_mm256_i32gather_ps(base, o011, 4),
+                                               _mm256_i32gather_ps(base, o111, 4), t[0]);
+
+            const __m256 c0 = lerp_lut3d_avx2(c00, c10, t[1]);
+            const __m256 c1 = lerp_lut3d_avx2(c01, c11, t[1]);
+            __m256 v = lerp_lut3d_avx2(c0, c1, t[2]);
+
+            v = _mm256_add_ps(_mm256_mul_ps(v, v255), vhalf);
+            v = _mm256_min_ps(_mm256_max_ps(v, vzero), v255);
+
+            alignas(32) std::int32_t out[8];
+            _mm256_store_si256(reinterpret_cast<__m256i*>(out), _mm256_cvttps_epi32(v));
+            std::uint8_t* dst = channels[c];
+            for (int k = 0; k < 8; ++k) {
+                dst[static_cast<std::ptrdiff_t>(i + k) * pixel_stride] =
+                    static_cast<std::uint8_t>(out[k]);
+            }
+        }
+    }
+
+    if (i < count) {
+        const std::ptrdiff_t p = static_cast<std::ptrdiff_t>(i) * pixel_stride;
+        apply_pre_lut3d_row_scalar(axes, r + p, g + p, b + p, count - i, pixel_stride);
+    }
+}
+
+#endif // MSX1PQ_HAS_X86_SIMD
+
+} // namespace
+
+void compile_quant_plan(const QuantInfo& qi, bool use_preprocess, QuantPlan& plan)
+{
+    plan.qi = qi;
+    if (!use_preprocess) {
+        // 前処理なし: LUT とポスタリゼーション・HSB 補正を無効化した設定で探索する
+        plan.qi.pre_lut        = nullptr;
+        plan.qi.pre_lut3d      = nullptr;
+        plan.qi.pre_lut3d_size = 0;
+        plan.qi.pre_posterize  = 0;
+        plan.qi.pre_sat        = 0.0f;
+        plan.qi.pre_gamma      = 0.0f;
+        plan.qi.pre_highlight  = 0.0f;
+        plan.qi.pre_hue        = 0.0f;
+    }
+    const QuantInfo& pq = plan.qi;
+
+    plan.use_pre_lut = (pq.pre_lut3d && pq.pre_lut3d_size >= 2) || pq.pre_lut;
+
+    const int posterize_levels = clamp_value(pq.pre_posterize, 0, 255);
+    plan.do_posterize = (posterize_levels > 1);
+    if (plan.do_posterize) {
+        const float scale = static_cast<float>(posterize_levels - 1);
+        for (int v = 0; v < 256; ++v) {
+            plan.posterize_lut[v] = posterize_channel(static_cast<std::uint8_t>(v), scale);
+        }
+    }
+
+    plan.do_hue       = (pq.pre_hue != 0.0f);
+    plan.do_sat       = (pq.pre_sat > 0.0f);
+    plan.do_gamma     = (pq.pre_gamma > 0.0f);
+    plan.do_highlight = (pq.pre_highlight > 0.0f);
+    plan.do_hsb_adjust = plan.do_hue || plan.do_sat || plan.do_gamma || plan.do_highlight;
+
+    plan.hue_offset      = pq.pre_hue / 360.0f;
+    plan.sat_scale       = 1.0f + (1.25f - 1.0f) * pq.pre_sat;
+    plan.highlight_scale = 1.0f + (1.3f - 1.0f) * pq.pre_highlight;
+    if (plan.do_gamma) {
+        const float gamma = 1.0f + (1.2f - 1.0f) * pq.pre_gamma;
+        for (int i = 0; i < 256; ++i) {
+            plan.gamma_curve[i] = powf(static_cast<float>(i) / 255.0f, gamma);
+        }
+    }
+
+    plan.use_table = use_preprocess && build_posterize_table(pq, plan.table);
+
+    plan.lut3d.lut = nullptr;
+    if (pq.pre_lut3d && pq.pre_lut3d_size > 1) {
+        build_pre_lut3d_axes(pq, plan.lut3d);
+    }
+
+    plan.num_search_colors = (!pq.use_palette_color && !pq.use_dark_dither)
+        ? MSX1PQ::kFirstDarkDitherIndex
+        : MSX1PQ::kNumQuantColors;
+
+    if (plan.use_table) {
+        plan.quantize           = quantize_plan_table;
+        plan.quantize_after_lut = quantize_plan_table_after_lut;
+    } else if (plan.do_posterize || plan.do_hsb_adjust) {
+        plan.quantize           = quantize_plan_preprocess;
+        plan.quantize_after_lut = quantize_plan_adjust_after_lut;
+    } else if (plan.use_pre_lut) {
+        plan.quantize           = quantize_plan_lut_only;
+        plan.quantize_after_lut = quantize_plan_direct;
+    } else {
+        plan.quantize           = quantize_plan_direct;
+        plan.quantize_after_lut = quantize_plan_direct;
+    }
+    plan.span_kernel = select_span_kernel(plan);
+}
+
+void apply_preprocess_plan(const QuantPlan& plan,
+                           std::uint8_t &r8,
+                           std::uint8_t &g8,
+                           std::uint8_t &b8)
+{
+    if (plan.use_pre_lut) {
+        apply_pre_lut(&plan.qi, r8, g8, b8);
+    }
+
+    apply_adjust_plan(plan, r8, g8, b8);
+}
+
+void apply_pre_lut3d_row(const QuantPlan& plan,
+                         std::uint8_t* r,
+                         std::uint8_t* g,
+                         std::uint8_t* b,
+                         std::size_t   count,
+                         std::ptrdiff_t pixel_stride)
+{
+    if (!plan.lut3d.lut || count == 0) {
+        return;
+    }
+#if defined(MSX1PQ_HAS_X86_SIMD)
+    if (simd_level() >= SIMD_LEVEL_AVX2) {
+        apply_pre_lut3d_row_avx2(plan.lut3d, r, g, b, count, pixel_stride);
+        return;
+    }
+#endif
+    apply_pre_lut3d_row_scalar(plan.lut3d, r, g, b, count, pixel_stride);
+}
+
+// ------------------------------------------------------------
+// 候補グリッド
+// ------------------------------------------------------------
+namespace {
+
+// 区間 [lo, hi] 上の点と p の 1軸距離の最小・最大
+inline void axis_bounds(double p, double lo, double hi, double& dmin, double& dmax)
+{
+    dmin = (p < lo) ? (lo - p) : ((p > hi) ? (p - hi) : 0.0);
+    const double a = std::fabs(p - lo);
+    const double b = std::fabs(p - hi);
+    dmax = (a > b) ? a : b;
+}
+
+inline int grid_cell_index(int ci, int cj, int ck)
+{
+    return (ci * PALETTE_GRID_DIM + cj) * PALETTE_GRID_DIM + ck;
+}
+
+inline int hsb_grid_coord(float t)
+{
+    const int c = static_cast<int>(t * static_cast<float>(PALETTE_GRID_DIM));
+    return clamp_value(c, 0, PALETTE_GRID_DIM - 1);
+}
+
+} // namespace
+
+bool build_palette_grid(const QuantInfo& qi, PaletteGrid& grid)
+{
+    grid.cell_begin.clear();
+    grid.candidates.clear();
+    grid.num_colors = 0;
+
+    if (!qi.use_palette_color && !qi.use_dither) {
+        return false;
+    }
+
+
+    int num_colors = MSX1PQ::kNumQuantColors;
+    if (!qi.use_palette_color && !qi.use_dark_dither) {
+        num_colors = MSX1PQ::kFirstDarkDitherIndex;
+    }
+
+    grid.num_colors = num_colors;
+    grid.use_hsb    = qi.use_hsb;
+    grid.w_h        = qi.w_h;
+    grid.w_s        = qi.w_s;
+    grid.w_b        = qi.w_b;
+
+    const int num_cells = PALETTE_GRID_DIM * PALETTE_GRID_DIM * PALETTE_GRID_DIM;
+    grid.cell_begin.resize(static_cast<std::size_t>(num_cells) + 1);
+    grid.candidates.reserve(static_cast<std::size_t>(num_cells) * 4);
+
+    // 軸ごと・セル座標ごと・色ごとの (重み付き) 最小 / 最大距離^2 を先に求めておく
+    const double weights[3] = {qi.w_h, qi.w_s, qi.w_b};
+    const float* palette_axis[3] = {
+        grid.use_hsb ? MSX1PQ::kPaletteSoA.h : MSX1PQ::kPaletteSoA.r,
+        grid.use_hsb ? MSX1PQ::kPaletteSoA.s : MSX1PQ::kPaletteSoA.g,
+        grid.use_hsb ? MSX1PQ::kPaletteSoA.v : MSX1PQ::kPaletteSoA.b
+    };
+    std::vector<double> axis_min2(3 * PALETTE_GRID_DIM * MSX1PQ::kPaletteSoaSize);
+    std::vector<double> axis_max2(3 * PALETTE_GRID_DIM * MSX1PQ::kPaletteSoaSize);
+    auto axis_at = [](int axis, int coord, int i) {
+        return (axis * PALETTE_GRID_DIM + coord) * MSX1PQ::kPaletteSoaSize + i;
+    };
+
+    for (int axis = 0; axis < 3; ++axis) {
+        const double wa = grid.use_hsb ? weights[axis] : 1.0;
+        for (int coord = 0; coord < PALETTE_GRID_DIM; ++coord) {
+            double lo, hi;
+            if (grid.use_hsb) {
+                lo = static_cast<double>(coord) / PALETTE_GRID_DIM;
+                hi = static_cast<double>(coord + 1) / PALETTE_GRID_DIM;
+            } else {
+                const int step = 256 / PALETTE_GRID_DIM;
+                lo = static_cast<double>(coord * step);
+                hi = static_cast<double>(coord * step + step - 1);
+            }
+            for (int i = 0; i < num_colors; ++i) {
+                double dmin, dmax;
+                axis_bounds(palette_axis[axis][i], lo, hi, dmin, dmax);
+                axis_min2[axis_at(axis, coord, i)] = wa * dmin * dmin;
+                axis_max2[axis_at(axis, coord, i)] = wa * dmax * dmax;
+            }
+        }
+    }
+
+    double dmin2[MSX1PQ::kPaletteSoaSize];
+
+    for (int ci = 0; ci < PALETTE_GRID_DIM; ++ci) {
+        for (int cj = 0; cj < PALETTE_GRID_DIM; ++cj) {
+            for (int ck = 0; ck < PALETTE_GRID_DIM; ++ck) {
+                const int cell = grid_cell_index(ci, cj, ck);
+                grid.cell_begin[cell] = static_cast<std::uint32_t>(grid.candidates.size());
+
+                // セル内の全点について「どれかの色までの距離の上限」の最小値を求め、
+                // それ以下に近づける色だけを候補に残す
+                const double* min_i = &axis_min2[axis_at(0, ci, 0)];
+                const double* min_j = &axis_min2[axis_at(1, cj, 0)];
+                const double* min_k = &axis_min2[axis_at(2, ck, 0)];
+                const double* max_i = &axis_max2[axis_at(0, ci, 0)];
+                const double* max_j = &axis_max2[axis_at(1, cj, 0)];
+                const double* max_k = &axis_max2[axis_at(2, ck, 0)];
+
+                double best_max2 = 1.0e300;
+                for (int i = 0; i < num_colors; ++i) {
+                    dmin2[i] = min_i[i] + min_j[i] + min_k[i];
+                    const double mx2 = max_i[i] + max_j[i] + max_k[i];
+                    if (mx2 < best_max2) {
+                        best_max2 = mx2;
+                    }
+                }
+
+                // HSB は float で距離を測るので丸め誤差ぶんの余裕を持たせる
+                const double limit = grid.use_hsb
+                    ? best_max2 * (1.0 + 1.0e-4) + 1.0e-9
+                    : best_max2;
+
+                for (int i = 0; i < num_colors; ++i) {
+                    if (dmin2[i] <= limit) {
+                        grid.candidates.push_back(static_cast<std::uint8_t>(i));
+                    }
+                }
+            }
+        }
+    }
+    grid.cell_begin[num_cells] = static_cast<std::uint32_t>(grid.candidates.size());
+    return true;
+}
+
+int nearest_palette_grid(const PaletteGrid& grid,
+                         std::uint8_t r8, std::uint8_t g8, std::uint8_t b8)
+{
+    int   best_idx = 0;
+    float best_d2  = 1.0e30f;
+
+    if (grid.use_hsb) {
+        float h, s, v;
+        rgb_to_hsb(r8, g8, b8, h, s, v);
+
+        const int cell = grid_cell_index(hsb_grid_coord(h), hsb_grid_coord(s), hsb_grid_coord(v));
+        const std::uint32_t end = grid.cell_begin[cell + 1];
+        for (std::uint32_t c = grid.cell_begin[cell]; c < end; ++c) {
+            const int i = grid.candidates[c];
+            float dh = h - MSX1PQ::kPaletteSoA.h[i];
+            float ds = s - MSX1PQ::kPaletteSoA.s[i];
+            float dv = v - MSX1PQ::kPaletteSoA.v[i];
+
+            float d2 = (grid.w_h * dh * dh +
+                        grid.w_s * ds * ds +
+                        grid.w_b * dv * dv);
+
+            if (d2 < best_d2) {
+                best_d2  = d2;
+                best_idx = i;
+            }
+        }
+        return best_idx;
+    }
+
+    static_assert(256 / PALETTE_GRID_DIM == 8, "RGB grid cell is 8 levels wide");
+    const int shift = 3;
+    const int cell = grid_cell_index(r8 >> shift, g8 >> shift, b8 >> shift);
+    const std::uint32_t end = grid.cell_begin[cell + 1];
+    for (std::uint32_t c = grid.cell_begin[cell]; c < end; ++c) {
+        const int i = grid.candidates[c];
+        float dr = static_cast<float>(r8) - MSX1PQ::kPaletteSoA.r[i];
+        float dg = static_cast<float>(g8) - MSX1PQ::kPaletteSoA.g[i];
+        float db = static_cast<float>(b8) - MSX1PQ::kPaletteSoA.b[i];
+        float d2 = dr*dr + dg*dg + db*db;
+
+        if (d2 < best_d2) {
+            best_d2  = d2;
+            best_idx = i;
+        }
+    }
+    return best_idx;
+}
+
+// ------------------------------------------------------------
+// RGB 全色 → 探索結果テーブル
+// ------------------------------------------------------------
+namespace {
+
+struct NearestLutKey {
+    int   num_colors; // 0: 基本15色探索
+    bool  use_hsb;
+    float w_h;
+    float w_s;
+    float w_b;
+
+    bool operator==(const NearestLutKey& o) const
+    {
+        return num_colors == o.num_colors && use_hsb == o.use_hsb &&
+               w_h == o.w_h && w_s == o.w_s && w_b == o.w_b;
+    }
+};
+
+NearestLutKey make_nearest_lut_key(const QuantInfo& qi)
+{
+    NearestLutKey key{};
+    if (qi.use_palette_color) {
+        key.num_colors = MSX1PQ::kNumQuantColors;
+    } else if (qi.use_dither) {
+        key.num_colors = qi.use_dark_dither
+            ? MSX1PQ::kNumQuantColors
+            : MSX1PQ::kFirstDarkDitherIndex;
+    }
+    key.use_hsb = qi.use_hsb;
+    if (qi.use_hsb) {
+        // RGB 距離では重みを使わないので同じテーブルを共有する
+        key.w_h = qi.w_h;
+        key.w_s = qi.w_s;
+        key.w_b = qi.w_b;
+    }
+    return key;
+}
+
+struct NearestLutSlot {
+    NearestLutKey key{};
+    std::once_flag built;
+    std::shared_ptr<NearestIndexLut> lut;
+};
+
+// 保持するテーブル数の上限（1枚 16MB）
+const std::size_t kMaxCachedNearestLuts = 2;
+
+std::mutex g_nearest_lut_mutex;
+std::vector<std::shared_ptr<NearestLutSlot>> g_nearest_lut_cache;
+
+// R 成分 0..255 をハードウェアスレッド数で分割し、fn(r_begin, r_end) を並列実行する
+template <typename Fn>
+void parallel_for_red(const Fn& fn)
+{
+    unsigned num_threads = static_cast<unsigned>(default_thread_count());
+    num_threads = std::min(num_threads, 256u);
+
+    std::vector<std::thread> workers;
+    workers.reserve(num_threads - 1);
+    for (unsigned t = 1; t < num_threads; ++t) {
+        const int r_begin = static_cast<int>(256 * t / num_threads);
+        const int r_end   = static_cast<int>(256 * (t + 1) / num_threads);
+        workers.emplace_back(fn, r_begin, r_end);
+    }
+    fn(0, static_cast<int>(256 / num_threads));
+    for (auto& w : workers) {
+        w.join();
+    }
+}
+
+void fill_nearest_lut(const QuantInfo& qi, NearestIndexLut& lut)
+{
+    QuantInfo search_qi = qi;
+    search_qi.nearest_lut = nullptr;
+
+    lut.indices.resize(NEAREST_LUT_ENTRIES);
+    std::uint8_t* out = lut.indices.data();
+
+    auto fill_red_range = [&search_qi, out](int r_begin, int r_end) {
+        for (int r = r_begin; r < r_end; ++r) {
+            for (int g = 0; g < 256; ++g) {
+                std::uint8_t* row = out + rgb_key(static_cast<std::uint8_t>(r),
+                                                  static_cast<std::uint8_t>(g), 0);
+                for (int b = 0; b < 256; ++b) {
+                    row[b] = static_cast<std::uint8_t>(search_palette_index(
+                        search_qi,
+                        static_cast<std::uint8_t>(r),
+                        static_cast<std::uint8_t>(g),
+                        static_cast<std::uint8_t>(b)));
+                }
+            }
+        }
+    };
+
+    parallel_for_red(fill_red_range);
+}
+
+} // namespace
+
+std::shared_ptr<const NearestIndexLut> acquire_nearest_index_lut(const QuantInfo& qi)
+{
+    const NearestLutKey key = make_nearest_lut_key(qi);
+
+    std::shared_ptr<NearestLutSlot> slot;
+    {
+        std::lock_guard<std::mutex> lock(g_nearest_lut_mutex);
+        for (const auto& cached : g_nearest_lut_cache) {
+            if (cached->key == key) {
+                slot = cached;
+                break;
+            }
+        }
+        if (!slot) {
+            slot = std::make_shared<NearestLutSlot>();
+            slot->key = key;
+            if (g_nearest_lut_cache.size() >= kMaxCachedNearestLuts) {
+                g_nearest_lut_cache.erase(g_nearest_lut_cache.begin());
+            }
+            g_nearest_lut_cache.push_back(slot);
+        }
+    }
+
+    // 初回利用時に1回だけ構築（同じキーの他スレッドは完了を待つ）
+    std::call_once(slot->built, [&qi, &slot]() {
+        auto lut = std::make_shared<NearestIndexLut>();
+        fill_nearest_lut(qi, *lut);
+        slot->lut = lut;
+    });
+    return slot->lut;
+}
+
+// ------------------------------------------------------------
+// 候補グリッドのキャッシュ（キーは全色テーブルと同じ探索パラメータ）
+// ------------------------------------------------------------
+namespace {
+
+struct PaletteGridSlot {
+    NearestLutKey key{};
+    std::once_flag built;
+    std::shared_ptr<PaletteGrid> grid;
+};
+
+// 保持するグリッド数の上限（1枚 数百KB）
+const std::size_t kMaxCachedPaletteGrids = 4;
+
+std::mutex g_palette_grid_mutex;
+std::vector<std::shared_ptr<PaletteGridSlot>> g_palette_grid_cache;
+
+} // namespace
+
+std::shared_ptr<const PaletteGrid> acquire_palette_grid(const QuantInfo& qi)
+{
+    if (!qi.use_palette_color && !qi.use_dither) {
+        return nullptr;
+    }
+    const NearestLutKey key = make_nearest_lut_key(qi);
+
+    std::shared_ptr<PaletteGridSlot> slot;
+    {
+        std::lock_guard<std::mutex> lock(g_palette_grid_mutex);
+        for (const auto& cached : g_palette_grid_cache) {
+            if (cached->key == key) {
+                slot = cached;
+                break;
+            }
+        }
+        if (!slot) {
+            slot = std::make_shared<PaletteGridSlot>();
+            slot->key = key;
+            if (g_palette_grid_cache.size() >= kMaxCachedPaletteGrids) {
+                g_palette_grid_cache.erase(g_palette_grid_cache.begin());
+            }
+            g_palette_grid_cache.push_back(slot);
+        }
+    }
+
+    std::call_once(slot->built, [&qi, &slot]() {
+        auto grid = std::make_shared<PaletteGrid>();
+        if (build_palette_grid(qi, *grid)) {
+            slot->grid = grid;
+        }
+    });
+    return slot->grid;
+}
+
+// ------------------------------------------------------------
+// 前処理チェーンの 3D LUT
+// ------------------------------------------------------------
+namespace {
+
+// 焼き込み対象: 色ごと結果テーブル使用時は LUT 部分だけ、それ以外は前処理全体
+void sample_plan_preprocess(const QuantPlan& plan,
+                            std::uint8_t r8,
+                            std::uint8_t g8,
+                            std::uint8_t b8,
+                            std::uint8_t* out)
+{
+    if (plan.use_table) {
+        apply_pre_lut(&plan.qi, r8, g8, b8);
+    } else {
+        apply_preprocess_plan(plan, r8, g8, b8);
+    }
+    out[0] = r8;
+    out[1] = g8;
+    out[2] = b8;
+}
+
+MSX1PQ::QuantColor quantize_plan_baked(const QuantPlan& plan,
+                                       std::uint8_t r,
+                                       std::uint8_t g,
+                                       std::uint8_t b,
+                                       std::int32_t x,
+                                       std::int32_t y)
+{
+    apply_preprocess_lut(*plan.baked_lut, r, g, b);
+    return quantize_pixel(plan.qi, r, g, b, x, y);
+}
+
+MSX1PQ::QuantColor quantize_plan_baked_table(const QuantPlan& plan,
+                                             std::uint8_t r,
+                                             std::uint8_t g,
+                                             std::uint8_t b,
+                                             std::int32_t x,
+                                             std::int32_t y)
+{
+    apply_preprocess_lut(*plan.baked_lut, r, g, b);
+    return lookup_posterize_table(plan.table, r, g, b, x, y);
+}
+
+} // namespace
+
+bool build_preprocess_lut(const QuantPlan& plan, int size, PreprocessLut& lut)
+{
+    const bool has_work = plan.use_table
+        ? plan.use_pre_lut
+        : (plan.use_pre_lut || plan.do_posterize || plan.do_hsb_adjust);
+    if (!has_work || size < 2 || size > PREPROCESS_LUT_EXACT) {
+        return false;
+    }
+
+    const std::size_t num_nodes =
+        static_cast<std::size_t>(size) * static_cast<std::size_t>(size) * static_cast<std::size_t>(size);
+    try {
+        lut.rgb.assign(num_nodes * 3, 0);
+    } catch (const std::bad_alloc&) {
+        lut.rgb.clear();
+        lut.rgb.shrink_to_fit();
+        lut.size = 0;
+        return false;
+    }
+    lut.size         = size;
+    lut.pre_lut_only = plan.use_table;
+    std::uint8_t* out = lut.rgb.data();
+
+    if (size == PREPROCESS_LUT_EXACT) {
+        parallel_for_red([&plan, out](int r_begin, int r_end) {
+            for (int r = r_begin; r < r_end; ++r) {
+                for (int g = 0; g < 256; ++g) {
+                    for (int b = 0; b < 256; ++b) {
+                        const std::size_t key = rgb_key(static_cast<std::uint8_t>(r),
+                                                        static_cast<std::uint8_t>(g),
+                                                        static_cast<std::uint8_t>(b));
+                        sample_plan_preprocess(plan,
+                                               static_cast<std::uint8_t>(r),
+                                               static_cast<std::uint8_t>(g),
+                                               static_cast<std::uint8_t>(b),
+                                               out + key * 3);
+                    }
+                }
+            }
+        });
+    } else {
+        // 格子点は整数入力値 round(k * 255 / (size - 1)) に置き、格子点上では前処理と一致させる
+        std::uint8_t node_value[PREPROCESS_LUT_EXACT];
+        for (int k = 0; k < size; ++k) {
+            node_value[k] = static_cast<std::uint8_t>((k * 255 + (size - 1) / 2) / (size - 1));
+        }
+        int k = 0;
+        for (int v = 0; v < 256; ++v) {
+            while (k < size - 2 && v >= node_value[k + 1]) {
+                ++k;
+            }
+            const int span = node_value[k + 1] - node_value[k];
+            lut.node_of[v] = static_cast<std::uint8_t>(k);
+            lut.frac_of[v] = static_cast<std::uint16_t>(((v - node_value[k]) * 256 + span / 2) / span);
+        }
+
+        std::uint8_t* p = out;
+        for (int ri = 0; ri < size; ++ri) {
+            for (int gi = 0; gi < size; ++gi) {
+                for (int bi = 0; bi < size; ++bi, p += 3) {
+                    sample_plan_preprocess(plan, node_value[ri], node_value[gi], node_value[bi], p);
+                }
+            }
+        }
+    }
+
+    return true;
+}
+
+bool attach_preprocess_lut(QuantPlan& plan, const PreprocessLut& lut)
+{
+    if (lut.size < 2 || lut.pre_lut_only != plan.use_table) {
+        return false;
+    }
+    plan.baked_lut = &lut;
+    plan.quantize  = plan.use_table ? quantize_plan_baked_table : quantize_plan_baked;
+    plan.span_kernel = select_span_kernel(plan);
+    return true;
+}
+
+void apply_preprocess_lut(const PreprocessLut& lut,
+                          std::uint8_t &r8,
+                          std::uint8_t &g8,
+                          std::uint8_t &b8)
+{
+    const std::uint8_t* base = lut.rgb.data();
+
+    if (lut.size == PREPROCESS_LUT_EXACT) {
+        const std::uint8_t* c = base + rgb_key(r8, g8, b8) * 3;
+        r8 = c[0];
+        g8 = c[1];
+        b8 = c[2];
+        return;
+    }
+
+    // 四面体補間（重みはすべて非負で合計 256）
+    const std::size_t n  = static_cast<std::size_t>(lut.size);
+    const std::size_t sr = n * n * 3;
+    const std::size_t sg = n * 3;
+    const std::size_t sb = 3;
+    const int fr = lut.frac_of[r8];
+    const int fg = lut.frac_of[g8];
+    const int fb = lut.frac_of[b8];
+    const std::uint8_t* c000 = base + lut.node_of[r8] * sr + lut.node_of[g8] * sg + lut.node_of[b8] * sb;
+    const std::uint8_t* c111 = c000 + sr + sg + sb;
+
+    const std::uint8_t* c1;
+    const std::uint8_t* c2;
+    int w0, w1, w2, w3;
+    if (fr >= fg) {
+        if (fg >= fb) {          // r >= g >= b
+            c1 = c000 + sr;      c2 = c000 + sr + sg;
+            w0 = 256 - fr;       w1 = fr - fg;  w2 = fg - fb;  w3 = fb;
+        } else if (fr >= fb) {   // r >= b > g
+            c1 = c000 + sr;      c2 = c000 + sr + sb;
+            w0 = 256 - fr;       w1 = fr - fb;  w2 = fb - fg;  w3 = fg;
+        } else {                 // b > r >= g
+            c1 = c000 + sb;      c2 = c000 + sr + sb;
+            w0 = 256 - fb;       w1 = fb - fr;  w2 = fr - fg;  w3 = fg;
+        }
+    } else {
+        if (fr >= fb) {          // g > r >= b
+            c1 = c000 + sg;      c2 = c000 + sr + sg;
+            w0 = 256 - fg;       w1 = fg - fr;  w2 = fr - fb;  w3 = fb;
+        } else if (fg >= fb) {   // g >= b > r
+            c1 = c000 + sg;      c2 = c000 + sg + sb;
+            w0 = 256 - fg;       w1 = fg - fb;  w2 = fb - fr;  w3 = fr;
+        } else {                 // b > g > r
+            c1 = c000 + sb;      c2 = c000 + sg + sb;
+            w0 = 256 - fb;       w1 = fb - fg;  w2 = fg - fr;  w3 = fr;
+        }
+    }
+
+    r8 = static_cast<std::uint8_t>((c000[0] * w0 + c1[0] * w1 + c2[0] * w2 + c111[0] * w3 + 128) >> 8);
+    g8 = static_cast<std::uint8_t>((c000[1] * w0 + c1[1] * w1 + c2[1] * w2 + c111[1] * w3 + 128) >> 8);
+    b8 = static_cast<std::uint8_t>((c000[2] * w0 + c1[2] * w1 + c2[2] * w2 + c111[2] * w3 + 128) >> 8);
+}
+
+// ------------------------------------------------------------
+// 行・スパン単位の量子化
+// ------------------------------------------------------------
+namespace {
+
+// 一度に作業配列へ取り込む画素数
+const std::int32_t kSpanChunk = 256;
+
+// LUT 段の種類
+enum SpanLutStage {
+    SPAN_LUT_NONE,
+    SPAN_LUT_ROWS,    // 3D LUT をチャンク単位で適用 (apply_pre_lut3d_row)
+    SPAN_LUT_PIXEL,   // apply_pre_lut（1D LUT）
+    SPAN_LUT_BAKED    // 焼き込み済み前処理 LUT（ポスタリゼーション・HSB 補正込み）
+};
+
+// 探索方法（search_palette_index の分岐に対応）
+enum SpanSearch {
+    SPAN_SEARCH_TABLE,
+    SPAN_SEARCH_NEAREST_LUT,
+    SPAN_SEARCH_GRID,
+    SPAN_SEARCH_PALETTE_HSB,
+    SPAN_SEARCH_PALETTE_RGB,
+    SPAN_SEARCH_BASIC_HSB,
+    SPAN_SEARCH_BASIC_RGB
+};
+
+// 作業配列の count 画素を前処理し、get_output_palette() のインデックスを求める。
+// モードはすべてテンプレート引数で決まり、ループ内に分岐は残らない。
+template<SpanLutStage Lut, bool Posterize, bool HsbAdjust, SpanSearch Search, bool ExpandDither>
+void span_kernel(const QuantPlan& plan,
+                 std::uint8_t* r,
+                 std::uint8_t* g,
+                 std::uint8_t* b,
+                 std::uint8_t* out,
+                 std::int32_t count,
+                 std::int32_t x0,
+                 std::int32_t y)
+{
+    const QuantInfo& qi = plan.qi;
+
+    if (Lut == SPAN_LUT_ROWS) {
+        apply_pre_lut3d_row(plan, r, g, b, static_cast<std::size_t>(count), 1);
+    }
+
+    for (std::int32_t i = 0; i < count; ++i) {
+        std::uint8_t r8 = r[i];
+        std::uint8_t g8 = g[i];
+        std::uint8_t b8 = b[i];
+
+        if (Lut == SPAN_LUT_PIXEL) {
+            apply_pre_lut(&qi, r8, g8, b8);
+        } else if (Lut == SPAN_LUT_BAKED) {
+            apply_preprocess_lut(*plan.baked_lut, r8, g8, b8);
+        }
+        if (Posterize) {
+            r8 = plan.posterize_lut[r8];
+            g8 = plan.posterize_lut[g8];
+            b8 = plan.posterize_lut[b8];
+        }
+        if (HsbAdjust) {
+            apply_hsb_adjust_plan(plan, r8, g8, b8);
+        }
+
+        int idx;
+        switch (Search) {
+        case SPAN_SEARCH_TABLE:
+            idx = lookup_posterize_index(plan.table, r8, g8, b8, x0 + i, y);
+            break;
+        case SPAN_SEARCH_NEAREST_LUT:
+            idx = qi.nearest_lut[rgb_key(r8, g8, b8)];
+            break;
+        case SPAN_SEARCH_GRID:
+            idx = nearest_palette_grid(*qi.palette_grid, r8, g8, b8);
+            break;
+        case SPAN_SEARCH_PALETTE_HSB:
+            idx = nearest_palette_hsb(r8, g8, b8, qi.w_h, qi.w_s, qi.w_b, plan.num_search_colors);
+            break;
+        case SPAN_SEARCH_PALETTE_RGB:
+            idx = nearest_palette_rgb(r8, g8, b8, plan.num_search_colors);
+            break;
+        case SPAN_SEARCH_BASIC_HSB:
+            idx = nearest_basic_hsb(r8, g8, b8, qi.w_h, qi.w_s, qi.w_b);
+            break;
+        case SPAN_SEARCH_BASIC_RGB:
+        default:
+            idx = MSX1PQ::nearest_basic_rgb(r8, g8, b8);
+            break;
+        }
+
+        if (ExpandDither) {
+            // 探索結果は 0..kNumQuantColors-1 に収まるのでクランプは不要
+            idx = MSX1PQ::dither_basic_index_table()[idx][MSX1PQ::dither_phase_of(x0 + i, y)];
+        }
+        out[i] = static_cast<std::uint8_t>(idx);
+    }
+}
+
+// ---- 実行時の設定 → インスタンスの選択 ----
+template<SpanLutStage Lut, bool Posterize, bool HsbAdjust, SpanSearch Search>
+QuantSpanKernel pick_span_kernel(bool expand_dither)
+{
+    return expand_dither
+        ? &span_kernel<Lut, Posterize, HsbAdjust, Search, true>
+        : &span_kernel<Lut, Posterize, HsbAdjust, Search, false>;
+}
+
+template<SpanLutStage Lut, bool Posterize, bool HsbAdjust>
+QuantSpanKernel pick_span_kernel(SpanSearch search, bool expand_dither)
+{
+    switch (search) {
+    case SPAN_SEARCH_TABLE:
+        // ポスタリゼーション・HSB 補正は色ごと結果テーブルに含まれる
+        return &span_kernel<Lut, false, false, SPAN_SEARCH_TABLE, false>;
+    case SPAN_SEARCH_NEAREST_LUT:
+        return pick_span_kernel<Lut, Posterize, HsbAdjust, SPAN_SEARCH_NEAREST_LUT>(expand_dither);
+    case SPAN_SEARCH_GRID:
+        return pick_span_kernel<Lut, Posterize, HsbAdjust, SPAN_SEARCH_GRID>(expand_dither);
+    case SPAN_SEARCH_PALETTE_HSB:
+        return pick_span_kernel<Lut, Posterize, HsbAdjust, SPAN_SEARCH_PALETTE_HSB>(expand_dither);
+    case SPAN_SEARCH_PALETTE_RGB:
+        return pick_span_kernel<Lut, Posterize, HsbAdjust, SPAN_SEARCH_PALETTE_RGB>(expand_dither);
+    case SPAN_SEARCH_BASIC_HSB:
+        // ディザなしの基本15色探索は展開不要
+        return &span_kernel<Lut, Posterize, HsbAdjust, SPAN_SEARCH_BASIC_HSB, false>;
+    case SPAN_SEARCH_BASIC_RGB:
+    default:
+        return &span_kernel<Lut, Posterize, HsbAdjust, SPAN_SEARCH_BASIC_RGB, false>;
+    }
+}
+
+template<SpanLutStage Lut>
+QuantSpanKernel pick_span_kernel(bool posterize, bool hsb_adjust,
+                                 SpanSearch search, bool expand_dither)
+{
+    if (posterize) {
+        return hsb_adjust
+            ? pick_span_kernel<Lut, true, true>(search, expand_dither)
+            : pick_span_kernel<Lut, true, false>(search, expand_dither);
+    }
+    return hsb_adjust
+        ? pick_span_kernel<Lut, false, true>(search, expand_dither)
+        : pick_span_kernel<Lut, false, false>(search, expand_dither);
+}
+
+SpanSearch span_search_of(const QuantPlan& plan)
+{
+    const QuantInfo& qi = plan.qi;
+
+    if (plan.use_table) {
+        return SPAN_SEARCH_TABLE;
+    }
+    if (qi.nearest_lut) {
+        return SPAN_SEARCH_NEAREST_LUT;
+    }
+    if (qi.use_palette_color || qi.use_dither) {
+        if (qi.palette_grid) {
+            return SPAN_SEARCH_GRID;
+        }
+        return qi.use_hsb ? SPAN_SEARCH_PALETTE_HSB : SPAN_SEARCH_PALETTE_RGB;
+    }
+    return qi.use_hsb ? SPAN_SEARCH_BASIC_HSB : SPAN_SEARCH_BASIC_RGB;
+}
+
+// src を作業配列に取り込み、カーネルを適用して chunk ごとに emit(offset, n, indices) を呼ぶ
+template<typename EmitFn>
+void for_each_span_chunk(const QuantPlan& plan,
+                         const std::uint8_t* src,
+                         const PixelLayout& layout,
+                         std::int32_t count,
+                         std::int32_t x0,
+                         std::int32_t y,
+                         const EmitFn& emit)
+{
+    const QuantSpanKernel kernel =
+        plan.span_kernel ? plan.span_kernel : select_span_kernel(plan);
+
+    std::uint8_t r[kSpanChunk];
+    std::uint8_t g[kSpanChunk];
+    std::uint8_t b[kSpanChunk];
+    std::uint8_t idx[kSpanChunk];
+
+    for (std::int32_t pos = 0; pos < count; pos += kSpanChunk) {
+        const std::int32_t n = std::min(kSpanChunk, count - pos);
+        const std::uint8_t* p = src + pos * layout.stride;
+        for (std::int32_t i = 0; i < n; ++i, p += layout.stride) {
+            r[i] = p[layout.r];
+            g[i] = p[layout.g];
+            b[i] = p[layout.b];
+        }
+
+        kernel(plan, r, g, b, idx, n, x0 + pos, y);
+        emit(pos, n, idx);
+    }
+}
+
+} // namespace
+
+QuantSpanKernel select_span_kernel(const QuantPlan& plan)
+{
+    const QuantInfo& qi = plan.qi;
+    const SpanSearch search = span_search_of(plan);
+    const bool expand_dither = !qi.use_palette_color && qi.use_dither;
+
+    if (plan.baked_lut) {
+        return pick_span_kernel<SPAN_LUT_BAKED, false, false>(search, expand_dither);
+    }
+
+    // 色ごと結果テーブル使用時は LUT 段だけを行う
+    const bool posterize  = !plan.use_table && plan.do_posterize;
+    const bool hsb_adjust = !plan.use_table && plan.do_hsb_adjust;
+
+    if (uses_pre_lut3d_rows(plan)) {
+        return pick_span_kernel<SPAN_LUT_ROWS>(posterize, hsb_adjust, search, expand_dither);
+    }
+    if (plan.use_pre_lut) {
+        return pick_span_kernel<SPAN_LUT_PIXEL>(posterize, hsb_adjust, search, expand_dither);
+    }
+    return pick_span_kernel<SPAN_LUT_NONE>(posterize, hsb_adjust, search, expand_dither);
+}
+
+void quantize_span(const QuantPlan& plan,
+                   const std::uint8_t* src,
+                   const PixelLayout& src_layout,
+                   std::uint8_t* dst,
+                   const PixelLayout& dst_layout,
+                   std::int32_t count,
+                   std::int32_t x0,
+                   std::int32_t y)
+{
+    if (count <= 0) {
+        return;
+    }
+
+    const MSX1PQ::QuantColor* palette = get_output_palette(plan.qi);
+    for_each_span_chunk(plan, src, src_layout, count, x0, y,
+        [&](std::int32_t pos, std::int32_t n, const std::uint8_t* idx) {
+            std::uint8_t* p = dst + pos * dst_layout.stride;
+            for (std::int32_t i = 0; i < n; ++i, p += dst_layout.stride) {
+                const MSX1PQ::QuantColor& c = palette[idx[i]];
+                p[dst_layout.r] = c.r;
+                p[dst_layout.g] = c.g;
+                p[dst_layout.b] = c.b;
+            }
+        });
+}
+
+void quantize_span_indices(const QuantPlan& plan,
+                           const std::uint8_t* src,
+                           const PixelLayout& src_layout,
+                           std::uint8_t* indices,
+                           std::int32_t count,
+                           std::int32_t x0,
+                           std::int32_t y)
+{
+    if (count <= 0) {
+        return;
+    }
+
+    for_each_span_chunk(plan, src, src_layout, count, x0, y,
+        [&](std::int32_t pos, std::int32_t n, const std::uint8_t* idx) {
+            std::memcpy(indices + pos, idx, static_cast<std::size_t>(n));
+        });
+}
+
+// ------------------------------------------------------------
+// 並列実行
+// ------------------------------------------------------------
+namespace {
+
+#if defined(__linux__)
+// cgroup の CPU クォータから使える CPU 数を求める（制限が無い・読めないなら 0）
+int cgroup_cpu_limit()
+{
+    const auto limit_of = [](double quota, double period) {
+        if (quota <= 0.0 || period <= 0.0) {
+            return 0;
+        }
+        return std::max(1, static_cast<int>(std::ceil(quota / period)));
+    };
+
+    // v2: 自分の cgroup（コンテナ内では名前空間のルートになることが多い）の cpu.max
+    std::vector<std::string> v2_paths;
+    std::ifstream self("/proc/self/cgroup");
+    std::string line;
+    while (std::getline(self, line)) {
+        if (line.compare(0, 3, "0::") == 0 && line.size() > 3) {
+            std::string rel = line.substr(3);
+            if (rel != "/") {
+                v2_paths.push_back("/sys/fs/cgroup" + rel + "/cpu.max");
+            }
+        }
+    }
+    v2_paths.push_back("/sys/fs/cgroup/cpu.max");
+    for (const std::string& path : v2_paths) {
+        std::ifstream f(path);
+        std::string quota;
+        double period = 0.0;
+        if (f >> quota >> period) {
+            if (quota == "max") {
+                return 0;
+            }
+            return limit_of(std::atof(quota.c_str()), period);
+        }
+    }
+
+    // v1: cpu コントローラの CFS クォータ（-1 は無制限）
+    const char* const v1_dirs[] = {"/sys/fs/cgroup/cpu", "/sys/fs/cgroup/cpu,cpuacct"};
+    for (const char* dir : v1_dirs) {
+        std::ifstream fq(std::string(dir) + "/cpu.cfs_quota_us");
+        std::ifstream fp(std::string(dir) + "/cpu.cfs_period_us");
+        double quota = 0.0;
+        double period = 0.0;
+        if ((fq >> quota) && (fp >> period)) {
+            return limit_of(quota, period);
+        }
+    }
+    return 0;
+}
+#endif
+
+int detect_thread_count()
+{
+    int count = static_cast<int>(std::thread::hardware_concurrency());
+#if defined(__linux__)
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    if (sched_getaffinity(0, sizeof(set), &set) == 0) {
+        const int affinity = CPU_COUNT(&set);
+        if (affinity > 0) {
+            count = (count > 0) ? std::min(count, affinity) : affinity;
+        }
+    }
+    const int quota = cgroup_cpu_limit();
+    if (quota > 0) {
+        count = (count > 0) ? std::min(count, quota) : quota;
+    }
+#endif
+    return std::max(1, count);
+}
+
+} // namespace
+
+int default_thread_count()
+{
+    static const int count = detect_thread_count();
+    return count;
+}
+
+void parallel_for(const Executor* exec,
+                  std::int32_t count,
+                  ParallelTaskFunc task,
+                  void* task_ctx)
+{
+    if (count <= 0) {
+        return;
+    }
+    if (exec && exec->run && count > 1) {
+        exec->run(exec->run_ctx, count, task, task_ctx);
+        return;
+    }
+
+    unsigned num_threads = 1;
+    if (exec && count > 1) {
+        num_threads = static_cast<unsigned>((exec->num_threads > 0)
+            ? exec->num_threads
+            : default_thread_count());
+        num_threads = std::min(num_threads, static_cast<unsigned>(count));
+    }
+
+    if (num_threads <= 1) {
+        for (std::int32_t i = 0; i < count; ++i) {
+            task(task_ctx, i);
+        }
+        return;
+    }
+
+    // 仕事の重さが揃わない（帯ごとの色数が違う）ので、空いたスレッドが次を取りに行く
+    std::atomic<std::int32_t> next{0};
+    auto worker = [&next, count, task, task_ctx]() {
+        for (;;) {
+            const std::int32_t i = next.fetch_add(1);
+            if (i >= count) {
+                break;
+            }
+            task(task_ctx, i);
+        }
+    };
+
+    std::vector<std::thread> workers;
+    workers.reserve(num_threads - 1);
+    for (unsigned t = 1; t < num_threads; ++t) {
+        workers.emplace_back(worker);
+    }
+    worker();
+    for (auto& w : workers) {
+        w.join();
+    }
+}
+
+namespace {
+
+// 左右遷移ペナルティ
+const int COST_SAME          = 0;
+const int COST_SAME_BUT_SWAP = 3;
+const int COST_DIFFERENT     = 8;
+
+} // namespace
+
+int transition_cost_pair(int prevA, int prevB, int a, int b)
+{
+    if (prevA < 0 || prevB < 0) {
+        return COST_SAME;
+    }
+
+    if ((a == prevA && b == prevB)) return COST_SAME;
+    if ((a == prevB && b == prevA)) return COST_SAME_BUT_SWAP;
+    if (a == prevA || b == prevB)   return COST_SAME_BUT_SWAP;
+    if (a == prevB || b == prevA)   return COST_SAME_BUT_SWAP;
+
+    return COST_DIFFERENT;
+}
+
+// ------------------------------------------------------------
+// 横8ドット内2色制限（基本15色インデックスの面）
+// ------------------------------------------------------------
+namespace {
+
+// 8dot ブロックの範囲（幅の端数を含む）
+inline int block_width_at(std::int32_t x_start, std::int32_t width)
+{
+    std::int32_t x_end = x_start + 8;
+    if (x_end > width) {
+        x_end = width;
+    }
+    return static_cast<int>(x_end - x_start);
+}
+
+// ブロック内の出現色のビットマスク（ビット k が色 k）
+inline std::uint32_t block_color_mask(const std::uint8_t* block, int block_w)
+{
+    std::uint32_t mask = 0;
+    for (int i = 0; i < block_w; ++i) {
+        mask |= 1u << block[i];
+    }
+    return mask;
+}
+
+// 最下位ビットを 2 回落としても残れば 3 色以上
+inline bool has_three_colors(std::uint32_t mask)
+{
+    mask &= mask - 1;
+    mask &= mask - 1;
+    return mask != 0;
+}
+
+inline int count_colors(std::uint32_t mask)
+{
+    int n = 0;
+    for (; mask; mask &= mask - 1) {
+        ++n;
+    }
+    return n;
+}
+
+// 行 [y_begin, y_end) に違反ブロックがあるか（最初の違反で打ち切る）
+bool rows_have_violation(const std::uint8_t* indices,
+                         std::ptrdiff_t row_pitch,
+                         std::int32_t   width,
+                         std::int32_t   y_begin,
+                         std::int32_t   y_end)
+{
+    for (std::int32_t y = y_begin; y < y_end; ++y) {
+        const std::uint8_t* row = indices + y * row_pitch;
+        for (std::int32_t x = 0; x < width; x += 8) {
+            if (has_three_colors(block_color_mask(row + x, block_width_at(x, width)))) {
+                return true;
+            }
+        }
+    }
+    return false;
+}
+
+// ブロック内の出現色（インデックス順、最大 8 色）
+inline int collect_unique_indices(const int* block_counts, int* unique_indices)
+{
+    int num_unique = 0;
+    for (int k = 0; k < BASIC_COLORS && num_unique < 8; ++k) {
+        if (block_counts[k] > 0) {
+            unique_indices[num_unique++] = k;
+        }
+    }
+    return num_unique;
+}
+
+// 探索設定のセルの高さ（1..MAX_ATTRCELL_HEIGHT に丸める）
+std::int32_t eightdot_cell_height(const EightDotSearch* search)
+{
+    const int cell_height = search ? search->cell_height : ATTRCELL_HEIGHT;
+    return std::max(1, std::min(cell_height, MAX_ATTRCELL_HEIGHT));
+}
+
+// ---- 帯ごとの並列処理 ----
+// 面をセルの高さ (cell_height 行) の倍数の帯に分けて band(y_begin, y_end, stats) を呼ぶ。
+// 実行器が無ければ全体を 1 つの帯として処理する。統計は帯ごとに数えてから足す。
+const std::int32_t kEightDotBandCells = 4;
+
+template<typename BandFn>
+void run_eightdot_bands(std::int32_t height,
+                        std::int32_t cell_height,
+                        const EightDotSearch* search,
+                        const BandFn& band)
+{
+    const Executor* exec  = search ? search->executor : nullptr;
+    EightDotStats*  stats = search ? search->stats : nullptr;
+
+    const std::int32_t band_h    = kEightDotBandCells * cell_height;
+    const std::int32_t num_bands = exec ? (height + band_h - 1) / band_h : 1;
+    if (num_bands <= 1) {
+        band(0, height, stats);
+        return;
+    }
+
+    std::vector<EightDotStats> band_stats(stats ? static_cast<std::size_t>(num_bands) : 0);
+    parallel_for(exec, num_bands, [&](std::int32_t i) {
+        const std::int32_t y_begin = i * band_h;
+        const std::int32_t y_end   = std::min(height, y_begin + band_h);
+        band(y_begin, y_end, stats ? &band_stats[static_cast<std::size_t>(i)] : nullptr);
+    });
+
+    for (const EightDotStats& bs : band_stats) {
+        stats->blocks          += bs.blocks;
+        stats->candidate_pairs += bs.candidate_pairs;
+        stats->scored_pairs    += bs.scored_pairs;
+        stats->score           += bs.score;
+    }
+}
+
+// ---- ペア誤差エンジン ----
+// 105 ペアすべての誤差 err[p] = Σ_k counts[k] * pair_min[k][p] をまとめて求める。
+// 誤差は整数のまま厳密に足すので、ペアごとに走査していたときと同じ値になる
+// （最大でも MAX_ATTRCELL_HEIGHT 行 × 8 画素 × 3 * 255^2 で int32 に収まる）。
+typedef void (*PairErrorFunc)(const MSX1PQ::BasicPairMinRow* pair_min,
+                              const int* counts,
+                              std::int32_t* err);
+
+void accumulate_pair_errors_scalar(const MSX1PQ::BasicPairMinRow* pair_min,
+                                   const int* counts,
+                                   std::int32_t* err)
+{
+    for (int p = 0; p < MSX1PQ::kBasicPairRowStride; ++p) {
+        err[p] = 0;
+    }
+    for (int k = 0; k < BASIC_COLORS; ++k) {
+        const std::int32_t cnt = counts[k];
+        if (!cnt) continue;
+
+        const std::int32_t* row = pair_min[k];
+        for (int p = 0; p < MSX1PQ::kNumBasicPairs; ++p) {
+            err[p] += cnt * row[p];
+        }
+    }
+}
+
+#if defined(MSX1PQ_HAS_X86_SIMD)
+MSX1PQ_TARGET_AVX2
+void accumulate_pair_errors_avx2(const MSX1PQ::BasicPairMinRow* pair_min,
+                                 const int* counts,
+                                 std::int32_t* err)
+{
+    const int kVecs = MSX1PQ::kBasicPairRowStride / 8;
+
+    __m256i acc[kVecs];
+    for (int j = 0; j < kVecs; ++j) {
+        acc[j] = _mm256_setzero_si256();
+    }
+    for (int k = 0; k < BASIC_COLORS; ++k) {
+        const std::int32_t cnt = counts[k];
+        if (!cnt) continue;
+
+        const __m256i vcnt = _mm256_set1_epi32(cnt);
+        const std::int32_t* row = pair_min[k];
+        for (int j = 0; j < kVecs; ++j) {
+            const __m256i d = _mm256_load_si256(reinterpret_cast<const __m256i*>(row + j * 8));
+            acc[j] = _mm256_add_epi32(acc[j], _mm256_mullo_epi32(vcnt, d));
+        }
+    }
+    for (int j = 0; j < kVecs; ++j) {
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(err + j * 8), acc[j]);
+    }
+}
+#endif
+
+PairErrorFunc select_pair_error_func()
+{
+#if defined(MSX1PQ_HAS_X86_SIMD)
+    if (simd_level() >= SIMD_LEVEL_AVX2) {
+        return accumulate_pair_errors_avx2;
+    }
+#endif
+    return accumulate_pair_errors_scalar;
+}
+
+// 直前のペアからの遷移コスト（transition_cost_pair と同じ値。prev_pair < 0 は左端）
+// ペアは a < b で持つので、入れ替えは同一ペアになり、共通色があれば 1 色だけの変化
+inline int pair_transition_cost(int prev_pair, int pair)
+{
+    if (prev_pair < 0 || prev_pair == pair) {
+        return COST_SAME;
+    }
+    const MSX1PQ::BasicPairInfo& pairs = MSX1PQ::kBasicPairs;
+    if (pairs.a[prev_pair] == pairs.a[pair] || pairs.a[prev_pair] == pairs.b[pair] ||
+        pairs.b[prev_pair] == pairs.a[pair] || pairs.b[prev_pair] == pairs.b[pair]) {
+        return COST_SAME_BUT_SWAP;
+    }
+    return COST_DIFFERENT;
+}
+
+// ブロックの各画素を (a, b) の近い方に置き換える
+inline void remap_block_to_pair(const MSX1PQ::BasicDist2Row* dist2,
+                                std::uint8_t* block,
+                                int block_w,
+                                int a,
+                                int b)
+{
+    for (int i = 0; i < block_w; ++i) {
+        int src_idx = block[i];
+
+        long dA = dist2[src_idx][a];
+        long dB = dist2[src_idx][b];
+        block[i] = static_cast<std::uint8_t>((dA <= dB) ? a : b);
+    }
+}
+
+// ---- ペアの選択 ----
+// score = err_block + attr_lambda * err_cell (+ transition_lambda * 遷移コスト) が最小の
+// ペアを選ぶ。重みは 1/EIGHTDOT_WEIGHT_SCALE 単位の固定小数点で、スコアは整数のまま
+// 厳密に比べる。同点ならペア番号の小さい方で、候補を番号順に調べて厳密に小さいときだけ
+// 更新する総当たりと同じ結果になる。
+struct PairSearch {
+    const MSX1PQ::BasicDist2Row*   dist2;
+    const MSX1PQ::BasicPairMinRow* pair_min;
+    PairErrorFunc                  pair_errors;
+    int                            prune_max_unique; // 出現色がこれ以下のブロックだけ打ち切る
+    int                            cell_height;
+    std::int64_t                   attr_weight;
+    std::int64_t                   transition_weight;
+    EightDotStats*                 stats;
+};
+
+std::int64_t eightdot_weight(float lambda)
+{
+    if (!(lambda > 0.0f)) {
+        return 0;
+    }
+    return static_cast<std::int64_t>(
+        std::llround(static_cast<double>(lambda) * EIGHTDOT_WEIGHT_SCALE));
+}
+
+PairSearch make_pair_search(int color_system, const EightDotSearch* search)
+{
+    // 15×15 距離テーブルと [色][ペア] の最小距離テーブル（コンパイル時に生成済み）
+    const bool msx2 = (color_system == MSX1PQ_COLOR_SYS_MSX2);
+    const EightDotSearch defaults;
+    const EightDotSearch& s = search ? *search : defaults;
+
+    PairSearch ps;
+    ps.dist2       = MSX1PQ::basic_dist2_table(msx2);
+    ps.pair_min    = MSX1PQ::basic_pair_min_table(msx2);
+    ps.pair_errors = select_pair_error_func();
+    ps.stats       = nullptr; // 帯ごとに設定する
+
+    ps.cell_height       = eightdot_cell_height(&s);
+    ps.attr_weight       = eightdot_weight(s.attr_lambda);
+    ps.transition_weight = eightdot_weight(s.transition_lambda);
+
+    // AVX2 の総当たりは 105 ペアを一度に求めるので、出現色が多いブロックでは
+    // 打ち切りの前準備（出現色どうしの最小距離）のほうが高くつく
+    ps.prune_max_unique = 0;
+    if (s.prune) {
+        ps.prune_max_unique = (ps.pair_errors == accumulate_pair_errors_scalar) ? 8 : 4;
+    }
+    return ps;
+}
+
+template<bool UseAttr, bool UseTransition>
+inline std::int64_t pair_score(const PairSearch& ps,
+                               std::int32_t err_block,
+                               std::int32_t err_cell,
+                               int tc_h)
+{
+    std::int64_t score = static_cast<std::int64_t>(err_block) * EIGHTDOT_WEIGHT_SCALE;
+    if (UseAttr) {
+        score += ps.attr_weight * err_cell;
+    }
+    if (UseTransition) {
+        score += ps.transition_weight * tc_h;
+    }
+    return score;
+}
+
+// 総当たり: 105 ペアぶんのブロック誤差をまとめて求めてから候補を比べる
+template<bool UseAttr, bool UseTransition>
+inline int choose_pair_exhaustive(const PairSearch& ps,
+                           const int* block_counts,
+                           const int* unique_indices,
+                           int num_unique,
+                           const std::int32_t* cell_errors,
+                           int prev_pair,
+                           std::int64_t& best_score_out)
+{
+    alignas(32) std::int32_t block_errors[MSX1PQ::kBasicPairRowStride];
+    ps.pair_errors(ps.pair_min, block_counts, block_errors);
+
+    std::int64_t best_score = 0;
+    bool         first      = true;
+    int          best_pair  = MSX1PQ::kBasicPairs.index[unique_indices[0]][unique_indices[1]];
+
+    for (int ua = 0; ua < num_unique; ++ua) {
+        for (int ub = ua + 1; ub < num_unique; ++ub) {
+
+            int pair = MSX1PQ::kBasicPairs.index[unique_indices[ua]][unique_indices[ub]];
+            int tc_h = UseTransition ? pair_transition_cost(prev_pair, pair) : 0;
+
+            std::int64_t score = pair_score<UseAttr, UseTransition>(
+                ps, block_errors[pair], UseAttr ? cell_errors[pair] : 0, tc_h);
+
+            if (first || score < best_score) {
+                first      = false;
+                best_score = score;
+                best_pair  = pair;
+            }
+        }
+    }
+    best_score_out = best_score;
+    return best_pair;
+}
+
+// 分枝限定: ペアに含まれない出現色の誤差は「他の出現色までの最小距離」以上なので、
+// その下限でも現在の最良を超えられない候補はブロック誤差を計算せずに捨てる。
+// 最多色を含むペアから調べて、早い段階で良い上界を得る。
+template<bool UseAttr, bool UseTransition>
+int choose_pair_pruned(const PairSearch& ps,
+                       const int* block_counts,
+                       const int* unique_indices,
+                       int num_unique,
+                       const std::int32_t* cell_errors,
+                       int prev_pair,
+                       std::uint64_t& scored,
+                       std::int64_t& best_score_out)
+{
+    const MSX1PQ::BasicDist2Row* dist2 = ps.dist2;
+
+    std::int32_t count[8];
+    std::int32_t nearest[8];
+    std::int32_t lb_total = 0;
+    int dominant = 0;
+    for (int u = 0; u < num_unique; ++u) {
+        const int cu = unique_indices[u];
+        long nn = -1;
+        for (int v = 0; v < num_unique; ++v) {
+            if (v == u) continue;
+            const long d = dist2[cu][unique_indices[v]];
+            if (nn < 0 || d < nn) nn = d;
+        }
+        count[u]   = block_counts[cu];
+        nearest[u] = static_cast<std::int32_t>(nn);
+        lb_total  += count[u] * nearest[u];
+        if (count[u] > count[dominant]) {
+            dominant = u;
+        }
+    }
+
+    std::int64_t best_score = 0;
+    int          best_pair  = -1;
+
+    auto try_pair = [&](int ua, int ub) {
+        const int a    = unique_indices[ua];
+        const int b    = unique_indices[ub];
+        const int pair = MSX1PQ::kBasicPairs.index[a][b];
+        const int tc_h = UseTransition ? pair_transition_cost(prev_pair, pair) : 0;
+        const std::int32_t err_cell = UseAttr ? cell_errors[pair] : 0;
+
+        if (best_pair >= 0) {
+            const std::int32_t lb_block =
+                lb_total - count[ua] * nearest[ua] - count[ub] * nearest[ub];
+            const std::int64_t lb =
+                pair_score<UseAttr, UseTransition>(ps, lb_block, err_cell, tc_h);
+            if (lb > best_score || (lb == best_score && pair > best_pair)) {
+                return;
+            }
+        }
+
+        std::int32_t err_block = 0;
+        for (int u = 0; u < num_unique; ++u) {
+            if (u == ua || u == ub) continue;
+            const long dA = dist2[unique_indices[u]][a];
+            const long dB = dist2[unique_indices[u]][b];
+            err_block += count[u] * static_cast<std::int32_t>((dA < dB) ? dA : dB);
+        }
+        ++scored;
+
+        const std::int64_t score =
+            pair_score<UseAttr, UseTransition>(ps, err_block, err_cell, tc_h);
+        if (best_pair < 0 || score < best_score ||
+            (score == best_score && pair < best_pair)) {
+            best_score = score;
+            best_pair  = pair;
+        }
+    };
+
+    for (int v = 0; v < num_unique; ++v) {
+        if (v == dominant) continue;
+        if (v < dominant) {
+            try_pair(v, dominant);
+        } else {
+            try_pair(dominant, v);
+        }
+    }
+    for (int ua = 0; ua < num_unique; ++ua) {
+        if (ua == dominant) continue;
+        for (int ub = ua + 1; ub < num_unique; ++ub) {
+            if (ub == dominant) continue;
+            try_pair(ua, ub);
+        }
+    }
+    best_score_out = best_score;
+    return best_pair;
+}
+
+template<bool UseAttr, bool UseTransition>
+inline int choose_pair(const PairSearch& ps,
+                const int* block_counts,
+                const int* unique_indices,
+                int num_unique,
+                const std::int32_t* cell_errors,
+                int prev_pair)
+{
+    const std::uint64_t candidates =
+        static_cast<std::uint64_t>(num_unique * (num_unique - 1) / 2);
+    std::uint64_t scored = candidates;
+
+    int          best_pair;
+    std::int64_t best_score = 0;
+    if (num_unique <= ps.prune_max_unique) {
+        scored = 0;
+        best_pair = choose_pair_pruned<UseAttr, UseTransition>(
+            ps, block_counts, unique_indices, num_unique, cell_errors, prev_pair,
+            scored, best_score);
+    } else {
+        best_pair = choose_pair_exhaustive<UseAttr, UseTransition>(
+            ps, block_counts, unique_indices, num_unique, cell_errors, prev_pair,
+            best_score);
+    }
+
+    if (ps.stats) {
+        ps.stats->blocks          += 1;
+        ps.stats->candidate_pairs += candidates;
+        ps.stats->scored_pairs    += scored;
+        ps.stats->score           += static_cast<double>(best_score) / EIGHTDOT_WEIGHT_SCALE;
+    }
+    return best_pair;
+}
+
+// ---- 行全体の最適化（Viterbi / ビーム探索） ----
+// 状態は各ブロックの候補ペア（出現色の組、最大 28）、遷移コストは pair_transition_cost。
+// 単色のブロックは貪欲版と同じく飛ばし、その前後のブロックを直接つなぐ。
+struct ViterbiNode {
+    int          pair;
+    int          back;   // 直前のブロックのノード番号（行頭のブロックは -1）
+    std::int64_t cost;   // 行頭からこのノードまでの累積スコア
+};
+
+struct ViterbiRow {
+    std::vector<ViterbiNode> nodes;
+    std::vector<std::int32_t> block_x;   // 2色以上のブロックの x_start（左から順）
+    std::vector<int> alive;              // 直前のブロックで残っているノード（番号順）
+    std::vector<int> next_alive;
+    int node_of_pair[MSX1PQ::kNumBasicPairs];
+
+    ViterbiRow() { std::fill(node_of_pair, node_of_pair + MSX1PQ::kNumBasicPairs, -1); }
+};
+
+// 遷移コストは「同じペア / 1 色共通 / 共通なし」の 3 通りしかないので、直前のブロックの
+// 全体の最良・色ごとの最良・同じペアの 3 種類だけを比べれば最良の前ノードが決まる
+// （同点は番号の小さいノード）。コストを過大に見積もる組み合わせも混ざるが、
+// 正しいコストの候補が必ず同時に比べられるので結果は変わらない。
+inline void consider_prev(const PairSearch& ps,
+                          const std::vector<ViterbiNode>& nodes,
+                          int q,
+                          int tc,
+                          std::int64_t& best_cost,
+                          int& best_node)
+{
+    if (q < 0) {
+        return;
+    }
+    const std::int64_t c = nodes[q].cost + ps.transition_weight * tc;
+    if (best_node < 0 || c < best_cost || (c == best_cost && q < best_node)) {
+        best_cost = c;
+        best_node = q;
+    }
+}
+
+template<bool UseAttr>
+void choose_row_viterbi(const PairSearch& ps,
+                        std::uint8_t* row,
+                        std::int32_t width,
+                        std::int32_t num_blocks_x,
+                        const std::int32_t* strip_errors,
+                        int beam_width,
+                        ViterbiRow& vr)
+{
+    vr.nodes.clear();
+    vr.block_x.clear();
+    vr.alive.clear();
+
+    for (std::int32_t bx = 0; bx < num_blocks_x; ++bx) {
+
+        std::int32_t x_start = bx * 8;
+        if (x_start >= width) break;
+        int block_w = block_width_at(x_start, width);
+        if (block_w <= 0) continue;
+
+        int block_counts[BASIC_COLORS] = {0};
+        for (int i = 0; i < block_w; ++i) {
+            block_counts[row[x_start + i]]++;
+        }
+
+        int unique_indices[8];
+        int num_unique = collect_unique_indices(block_counts, unique_indices);
+        if (num_unique <= 1) {
+            continue;
+        }
+
+        alignas(32) std::int32_t block_errors[MSX1PQ::kBasicPairRowStride];
+        ps.pair_errors(ps.pair_min, block_counts, block_errors);
+        const std::int32_t* cell_errors = UseAttr
+            ? &strip_errors[static_cast<std::size_t>(bx) * MSX1PQ::kBasicPairRowStride]
+            : nullptr;
+
+        vr.block_x.push_back(x_start);
+        vr.next_alive.clear();
+
+        // 直前のブロックの最良ノード（全体・色ごと）
+        int best_any = -1;
+        int best_with[BASIC_COLORS];
+        std::fill(best_with, best_with + BASIC_COLORS, -1);
+        for (int q : vr.alive) {
+            const std::int64_t c = vr.nodes[q].cost;
+            const int a = MSX1PQ::kBasicPairs.a[vr.nodes[q].pair];
+            const int b = MSX1PQ::kBasicPairs.b[vr.nodes[q].pair];
+            if (best_any < 0 || c < vr.nodes[best_any].cost) best_any = q;
+            if (best_with[a] < 0 || c < vr.nodes[best_with[a]].cost) best_with[a] = q;
+            if (best_with[b] < 0 || c < vr.nodes[best_with[b]].cost) best_with[b] = q;
+            vr.node_of_pair[vr.nodes[q].pair] = q;
+        }
+
+        for (int ua = 0; ua < num_unique; ++ua) {
+            for (int ub = ua + 1; ub < num_unique; ++ub) {
+
+                const int a = unique_indices[ua];
+                const int b = unique_indices[ub];
+
+                ViterbiNode node;
+                node.pair = MSX1PQ::kBasicPairs.index[a][b];
+                node.back = -1;
+                node.cost = pair_score<UseAttr, false>(
+                    ps, block_errors[node.pair], UseAttr ? cell_errors[node.pair] : 0, 0);
+
+                std::int64_t best_prev = 0;
+                consider_prev(ps, vr.nodes, vr.node_of_pair[node.pair], COST_SAME, best_prev, node.back);
+                consider_prev(ps, vr.nodes, best_with[a], COST_SAME_BUT_SWAP, best_prev, node.back);
+                consider_prev(ps, vr.nodes, best_with[b], COST_SAME_BUT_SWAP, best_prev, node.back);
+                consider_prev(ps, vr.nodes, best_any, COST_DIFFERENT, best_prev, node.back);
+                node.cost += best_prev;
+
+                vr.next_alive.push_back(static_cast<int>(vr.nodes.size()));
+                vr.nodes.push_back(node);
+            }
+        }
+        for (int q : vr.alive) {
+            vr.node_of_pair[vr.nodes[q].pair] = -1;
+        }
+
+        // ビーム: 累積スコアの小さい beam_width 個だけを次のブロックへ渡す
+        if (beam_width > 0 && static_cast<int>(vr.next_alive.size()) > beam_width) {
+            const std::vector<ViterbiNode>& nodes = vr.nodes;
+            std::nth_element(vr.next_alive.begin(),
+                             vr.next_alive.begin() + (beam_width - 1),
+                             vr.next_alive.end(),
+                             [&nodes](int a, int b) {
+                                 return (nodes[a].cost < nodes[b].cost) ||
+                                        (nodes[a].cost == nodes[b].cost && a < b);
+                             });
+            vr.next_alive.resize(static_cast<std::size_t>(beam_width));
+            std::sort(vr.next_alive.begin(), vr.next_alive.end());
+        }
+        vr.alive.swap(vr.next_alive);
+
+        if (ps.stats) {
+            const std::uint64_t candidates =
+                static_cast<std::uint64_t>(num_unique * (num_unique - 1) / 2);
+            ps.stats->blocks          += 1;
+            ps.stats->candidate_pairs += candidates;
+            ps.stats->scored_pairs    += candidates;
+        }
+    }
+
+    if (vr.alive.empty()) {
+        return;
+    }
+
+    int best = vr.alive[0];
+    for (int q : vr.alive) {
+        if (vr.nodes[q].cost < vr.nodes[best].cost) {
+            best = q;
+        }
+    }
+    if (ps.stats) {
+        ps.stats->score += static_cast<double>(vr.nodes[best].cost) / EIGHTDOT_WEIGHT_SCALE;
+    }
+
+    // 右端から経路をたどってブロックを書き換える（ブロックは重ならないので順不同でよい）
+    std::size_t t = vr.block_x.size();
+    for (int node = best; node >= 0; node = vr.nodes[node].back) {
+        --t;
+        const std::int32_t x_start = vr.block_x[t];
+        const int pair = vr.nodes[node].pair;
+        remap_block_to_pair(ps.dist2, row + x_start, block_width_at(x_start, width),
+                            MSX1PQ::kBasicPairs.a[pair],
+                            MSX1PQ::kBasicPairs.b[pair]);
+    }
+}
+
+// ---- 設定値ごとの特殊化 ----
+// よく使うセルの高さ (4, 8) はコンパイル時定数として展開し、それ以外は実行時の値を使う。
+// 重みが 0 の項（セル傾向・左右遷移）は特殊化で計算ごと省く。
+template<typename Fn>
+void with_cell_height(int cell_height, const Fn& fn)
+{
+    switch (cell_height) {
+    case 4:
+        fn(std::integral_constant<int, 4>());
+        break;
+    case 8:
+        fn(std::integral_constant<int, 8>());
+        break;
+    default:
+        fn(std::integral_constant<int, 0>());
+        break;
+    }
+}
+
+template<typename Fn>
+void with_flag(bool flag, const Fn& fn)
+{
+    if (flag) {
+        fn(std::true_type());
+    } else {
+        fn(std::false_type());
+    }
+}
+
+// best1: セルのヒストグラムを 8dot 縦帯ごとに数え、セル内の各行のブロックを選ぶ
+template<int CellH, bool UseAttr>
+void best1_band(const PairSearch& ps,
+                std::uint8_t*  indices,
+                std::ptrdiff_t row_pitch,
+                std::int32_t   width,
+                std::int32_t   y_begin,
+                std::int32_t   y_end)
+{
+    const std::int32_t cell_height  = (CellH > 0) ? CellH : ps.cell_height;
+    const std::int32_t num_blocks_x = (width + 7) / 8;
+
+    for (std::int32_t y0 = y_begin; y0 < y_end; y0 += cell_height) {
+        std::int32_t cell_h = cell_height;
+        if (y0 + cell_h > y_end) {
+            cell_h = y_end - y0;
+        }
+        if (cell_h <= 0) break;
+
+        for (std::int32_t bx = 0; bx < num_blocks_x; ++bx) {
+            std::int32_t x_start = bx * 8;
+            if (x_start >= width) break;
+            int block_w = block_width_at(x_start, width);
+            if (block_w <= 0) continue;
+
+            // --- (1) このセル＆この 8dot 縦帯の basic15 ヒストグラム ---
+            alignas(32) std::int32_t cell_errors[MSX1PQ::kBasicPairRowStride];
+            if (UseAttr) {
+                int cell_counts[BASIC_COLORS] = {0};
+                for (std::int32_t yy = 0; yy < cell_h; ++yy) {
+                    const std::uint8_t* row = indices + (y0 + yy) * row_pitch;
+                    for (int i = 0; i < block_w; ++i) {
+                        cell_counts[row[x_start + i]]++;
+                    }
+                }
+                ps.pair_errors(ps.pair_min, cell_counts, cell_errors);
+            }
+
+            // --- (2) セル内の各行 8×1 ブロックごとに 2色ペアを選ぶ ---
+            for (std::int32_t yy = 0; yy < cell_h; ++yy) {
+                std::uint8_t* row = indices + (y0 + yy) * row_pitch;
+
+                int block_counts[BASIC_COLORS] = {0};
+                for (int i = 0; i < block_w; ++i) {
+                    block_counts[row[x_start + i]]++;
+                }
+
+                int unique_indices[8];
+                int num_unique = collect_unique_indices(block_counts, unique_indices);
+                if (num_unique <= 1) {
+                    continue;
+                }
+
+                const int best_pair = choose_pair<UseAttr, false>(
+                    ps, block_counts, unique_indices, num_unique,
+                    UseAttr ? cell_errors : nullptr, -1);
+
+                remap_block_to_pair(ps.dist2, row + x_start, block_w,
+                                    MSX1PQ::kBasicPairs.a[best_pair],
+                                    MSX1PQ::kBasicPairs.b[best_pair]);
+            }
+        }
+    }
+}
+
+// attr_best / attr_best_penalty / viterbi 共通
+// （どれもセル傾向と左右遷移ペナルティを加えた同じスコアで選ぶ。RowOptimum のときは
+// 行ごとの合計を choose_row_viterbi で最小にする）
+// セルのヒストグラムはストリップ（セルの高さの行）の処理前に全ブロック分を
+// 一度だけ数え、ストリップ内の各行はその時点の値に対してスコアを付ける。
+template<int CellH, bool UseAttr, bool UseTransition, bool RowOptimum>
+void attr_band(const PairSearch& ps,
+               std::uint8_t*  indices,
+               std::ptrdiff_t row_pitch,
+               std::int32_t   width,
+               std::int32_t   y_begin,
+               std::int32_t   y_end,
+               int            beam_width)
+{
+    const std::int32_t cell_height  = (CellH > 0) ? CellH : ps.cell_height;
+    const std::int32_t num_blocks_x = (width + 7) / 8;
+
+    ViterbiRow viterbi_row;
+
+    // [bx * BASIC_COLORS + 色] ストリップ内のセルごとのヒストグラム
+    std::vector<int> strip_counts;
+    // [bx * kBasicPairRowStride + ペア] セルのヒストグラムに対するペアごとの誤差
+    std::vector<std::int32_t> strip_errors;
+    if (UseAttr) {
+        strip_counts.resize(static_cast<std::size_t>(num_blocks_x) * BASIC_COLORS);
+        strip_errors.resize(static_cast<std::size_t>(num_blocks_x) * MSX1PQ::kBasicPairRowStride);
+    }
+
+    for (std::int32_t y0 = y_begin; y0 < y_end; y0 += cell_height) {
+
+        std::int32_t cell_h = cell_height;
+        if (y0 + cell_h > y_end) {
+            cell_h = y_end - y0;
+        }
+        if (cell_h <= 0) break;
+
+        if (UseAttr) {
+            // 行順に 1 回なめて全ブロックのセルヒストグラムを作る
+            std::fill(strip_counts.begin(), strip_counts.end(), 0);
+            for (std::int32_t yy = 0; yy < cell_h; ++yy) {
+                const std::uint8_t* rowc = indices + (y0 + yy) * row_pitch;
+                for (std::int32_t x = 0; x < width; ++x) {
+                    strip_counts[static_cast<std::size_t>(x >> 3) * BASIC_COLORS + rowc[x]]++;
+                }
+            }
+            for (std::int32_t bx = 0; bx < num_blocks_x; ++bx) {
+                ps.pair_errors(ps.pair_min,
+                               &strip_counts[static_cast<std::size_t>(bx) * BASIC_COLORS],
+                               &strip_errors[static_cast<std::size_t>(bx) * MSX1PQ::kBasicPairRowStride]);
+            }
+        }
+
+        for (std::int32_t yy = 0; yy < cell_h; ++yy) {
+
+            std::uint8_t* row = indices + (y0 + yy) * row_pitch;
+
+            if (RowOptimum) {
+                choose_row_viterbi<UseAttr>(ps, row, width, num_blocks_x,
+                                            UseAttr ? strip_errors.data() : nullptr,
+                                            beam_width, viterbi_row);
+                continue;
+            }
+
+            int prev_pair = -1;
+
+            for (std::int32_t bx = 0; bx < num_blocks_x; ++bx) {
+
+                std::int32_t x_start = bx * 8;
+                if (x_start >= width) break;
+                int block_w = block_width_at(x_start, width);
+                if (block_w <= 0) continue;
+
+                int block_counts[BASIC_COLORS] = {0};
+                for (int i = 0; i < block_w; ++i) {
+                    block_counts[row[x_start + i]]++;
+                }
+
+                int unique_indices[8];
+                int num_unique = collect_unique_indices(block_counts, unique_indices);
+                if (num_unique <= 1) {
+                    continue;
+                }
+
+                const std::int32_t* cell_errors = UseAttr
+                    ? &strip_errors[static_cast<std::size_t>(bx) * MSX1PQ::kBasicPairRowStride]
+                    : nullptr;
+                const int best_pair = choose_pair<UseAttr, UseTransition>(
+                    ps, block_counts, unique_indices, num_unique, cell_errors, prev_pair);
+
+                remap_block_to_pair(ps.dist2, row + x_start, block_w,
+                                    MSX1PQ::kBasicPairs.a[best_pair],
+                                    MSX1PQ::kBasicPairs.b[best_pair]);
+
+                prev_pair = best_pair;
+            }
+        }
+    }
+}
+
+void apply_8dot2col_attr_indices(std::uint8_t* indices,
+                                 std::ptrdiff_t row_pitch,
+                                 std::int32_t   width,
+                                 std::int32_t   height,
+                                 int            color_system,
+                                 const EightDotSearch* search,
+                                 bool           row_optimum)
+{
+    if (!indices || width <= 0 || height <= 0) {
+        return;
+    }
+
+    const PairSearch ps = make_pair_search(color_system, search);
+    const int beam_width = search ? search->beam_width : 0;
+
+    // 遷移の重みが 0 なら行全体の最適化は各ブロックの最良と同じ
+    const bool use_transition = (ps.transition_weight != 0);
+    row_optimum = row_optimum && use_transition;
+
+    with_flag(ps.attr_weight != 0, [&](auto use_attr) {
+    with_flag(use_transition, [&](auto use_trans) {
+    with_flag(row_optimum, [&](auto use_row_optimum) {
+    with_cell_height(ps.cell_height, [&](auto cell_h) {
+        run_eightdot_bands(height, ps.cell_height, search,
+            [&](std::int32_t y_begin, std::int32_t y_end, EightDotStats* stats) {
+                PairSearch band_ps = ps;
+                band_ps.stats = stats;
+                attr_band<decltype(cell_h)::value,
+                          decltype(use_attr)::value,
+                          decltype(use_trans)::value,
+                          decltype(use_row_optimum)::value && decltype(use_trans)::value>(
+                    band_ps, indices, row_pitch, width, y_begin, y_end, beam_width);
+            });
+    });
+    });
+    });
+    });
+}
+
+} // namespace
+
+void apply_8dot2col_basic1_indices(std::uint8_t* indices,
+                                   std::ptrdiff_t row_pitch,
+                                   std::int32_t   width,
+                                   std::int32_t   height,
+                                   int            color_system,
+                                   const EightDotSearch* search)
+{
+    if (!indices || width <= 0 || height <= 0) {
+        return;
+    }
+
+    const MSX1PQ::BasicDist2Row* dist2 =
+        MSX1PQ::basic_dist2_table(color_system == MSX1PQ_COLOR_SYS_MSX2);
+
+    run_eightdot_bands(height, ATTRCELL_HEIGHT, search,
+        [&](std::int32_t y_begin, std::int32_t y_end, EightDotStats* /*stats*/) {
+            for (std::int32_t y = y_begin; y < y_end; ++y) {
+                std::uint8_t* row = indices + y * row_pitch;
+
+                for (std::int32_t bx = 0; bx * 8 < width; ++bx) {
+                    std::int32_t x_start = bx * 8;
+                    int block_w = block_width_at(x_start, width);
+                    if (block_w <= 0) continue;
+
+                    // 1) ブロック内の basic15 インデックスをカウント
+                    int counts[BASIC_COLORS] = {0};
+                    for (int i = 0; i < block_w; ++i) {
+                        counts[row[x_start + i]]++;
+                    }
+
+                    // 2) 出現数 Top2
+                    int top1 = -1;
+                    int top2 = -1;
+                    for (int c = 0; c < BASIC_COLORS; ++c) {
+                        int cnt = counts[c];
+                        if (cnt <= 0) continue;
+
+                        if (top1 < 0 || cnt > counts[top1]) {
+                            top2 = top1;
+                            top1 = c;
+                        } else if (top2 < 0 || cnt > counts[top2]) {
+                            top2 = c;
+                        }
+                    }
+                    if (top1 < 0) continue;
+                    if (top2 < 0) top2 = top1;
+
+                    // 3) Top2 以外は “どちらに近いか” で寄せる
+                    for (int i = 0; i < block_w; ++i) {
+                        int idx = row[x_start + i];
+                        if (idx != top1 && idx != top2) {
+                            row[x_start + i] = static_cast<std::uint8_t>(
+                                (dist2[idx][top1] <= dist2[idx][top2]) ? top1 : top2);
+                        }
+                    }
+                }
+            }
+        });
+}
+
+void apply_8dot2col_fast1_indices(std::uint8_t* indices,
+                                  std::ptrdiff_t row_pitch,
+                                  std::int32_t   width,
+                                  std::int32_t   height,
+                                  int            color_system,
+                                  const EightDotSearch* search)
+{
+    if (!indices || width <= 0 || height <= 0) {
+        return;
+    }
+
+    const MSX1PQ::BasicDist2Row* dist2 =
+        MSX1PQ::basic_dist2_table(color_system == MSX1PQ_COLOR_SYS_MSX2);
+
+    run_eightdot_bands(height, ATTRCELL_HEIGHT, search,
+        [&](std::int32_t y_begin, std::int32_t y_end, EightDotStats* /*stats*/) {
+            for (std::int32_t y = y_begin; y < y_end; ++y) {
+                std::uint8_t* row = indices + y * row_pitch;
+
+                for (std::int32_t bx = 0; bx * 8 < width; ++bx) {
+                    std::int32_t x_start = bx * 8;
+                    int block_w = block_width_at(x_start, width);
+                    if (block_w <= 0) continue;
+
+                    int unique_idx[8];
+                    int unique_count[8];
+                    int num_unique = 0;
+
+                    // 1) ブロック内のユニーク色を出現順に集計（最大 8 種類）
+                    for (int i = 0; i < block_w; ++i) {
+                        const int idx = row[x_start + i];
+
+                        int j;
+                        for (j = 0; j < num_unique; ++j) {
+                            if (unique_idx[j] == idx) {
+                                unique_count[j]++;
+                                break;
+                            }
+                        }
+                        if (j == num_unique && num_unique < 8) {
+                            unique_idx[num_unique]   = idx;
+                            unique_count[num_unique] = 1;
+                            ++num_unique;
+                        }
+                    }
+
+                    if (num_unique <= 1) {
+                        // もともと 0～1 色なら 2色制限の必要なし
+                        continue;
+                    }
+
+                    // 2) 出現数 Top2 を探す
+                    int top1 = 0;
+                    int top2 = 1;
+                    if (unique_count[top2] > unique_count[top1]) {
+                        int tmp = top1; top1 = top2; top2 = tmp;
+                    }
+                    for (int i = 2; i < num_unique; ++i) {
+                        int c = unique_count[i];
+                        if (c > unique_count[top1]) {
+                            top2 = top1;
+                            top1 = i;
+                        } else if (c > unique_count[top2]) {
+                            top2 = i;
+                        }
+                    }
+
+                    const int c1 = unique_idx[top1];
+                    const int c2 = unique_idx[top2];
+
+                    // 3) Top2 以外の色は “どちらに近いか” で寄せる
+                    for (int i = 0; i < block_w; ++i) {
+                        const int idx = row[x_start + i];
+                        if (idx == c1 || idx == c2) {
+                            continue;
+                        }
+                        row[x_start + i] = static_cast<std::uint8_t>(
+                            (dist2[idx][c1] <= dist2[idx][c2]) ? c1 : c2);
+                    }
+                }
+            }
+        });
+}
+
+void apply_8dot2col_best1_indices(std::uint8_t* indices,
+                                  std::ptrdiff_t row_pitch,
+                                  std::int32_t   width,
+                                  std::int32_t   height,
+                                  int            color_system,
+                                  const EightDotSearch* search)
+{
+    if (!indices || width <= 0 || height <= 0) {
+        return;
+    }
+
+    const PairSearch ps = make_pair_search(color_system, search);
+
+    with_flag(ps.attr_weight != 0, [&](auto use_attr) {
+    with_cell_height(ps.cell_height, [&](auto cell_h) {
+        run_eightdot_bands(height, ps.cell_height, search,
+            [&](std::int32_t y_begin, std::int32_t y_end, EightDotStats* stats) {
+                PairSearch band_ps = ps;
+                band_ps.stats = stats;
+                best1_band<decltype(cell_h)::value, decltype(use_attr)::value>(
+                    band_ps, indices, row_pitch, width, y_begin, y_end);
+            });
+    });
+    });
+}
+
+void apply_8dot2col_attr_best_indices(std::uint8_t* indices,
+                                      std::ptrdiff_t row_pitch,
+                                      std::int32_t   width,
+                                      std::int32_t   height,
+                                      int            color_system,
+                                      const EightDotSearch* search)
+{
+    apply_8dot2col_attr_indices(indices, row_pitch, width, height, color_system, search, false);
+}
+
+void apply_8dot2col_attr_best_penalty_indices(std::uint8_t* indices,
+                                              std::ptrdiff_t row_pitch,
+                                              std::int32_t   width,
+                                              std::int32_t   height,
+                                              int            color_system,
+                                              const EightDotSearch* search)
+{
+    apply_8dot2col_attr_indices(indices, row_pitch, width, height, color_system, search, false);
+}
+
+void apply_8dot2col_viterbi_indices(std::uint8_t* indices,
+                                    std::ptrdiff_t row_pitch,
+                                    std::int32_t   width,
+                                    std::int32_t   height,
+                                    int            color_system,
+                                    const EightDotSearch* search)
+{
+    apply_8dot2col_attr_indices(indices, row_pitch, width, height, color_system, search, true);
+}
+
+namespace {
+
+void run_8dot2col_mode(int            mode,
+                       std::uint8_t*  indices,
+                       std::ptrdiff_t row_pitch,
+                       std::int32_t   width,
+                       std::int32_t   height,
+                       int            color_system,
+                       const EightDotSearch* search)
+{
+    switch (mode) {
+    case MSX1PQ_EIGHTDOT_MODE_FAST1:
+        apply_8dot2col_fast1_indices(indices, row_pitch, width, height, color_system, search);
+        break;
+    case MSX1PQ_EIGHTDOT_MODE_BASIC1:
+        apply_8dot2col_basic1_indices(indices, row_pitch, width, height, color_system, search);
+        break;
+    case MSX1PQ_EIGHTDOT_MODE_BEST1:
+        apply_8dot2col_best1_indices(indices, row_pitch, width, height, color_system, search);
+        break;
+    case MSX1PQ_EIGHTDOT_MODE_ATTR_BEST:
+        apply_8dot2col_attr_best_indices(indices, row_pitch, width, height, color_system, search);
+        break;
+    case MSX1PQ_EIGHTDOT_MODE_PENALTY_BEST:
+        apply_8dot2col_attr_best_penalty_indices(indices, row_pitch, width, height, color_system, search);
+        break;
+    case MSX1PQ_EIGHTDOT_MODE_VITERBI:
+        apply_8dot2col_viterbi_indices(indices, row_pitch, width, height, color_system, search);
+        break;
+    default:
+        break;
+    }
+}
+
+// 修正モード: セルの行（ストリップ）ごとに違反の有無を調べ、違反のある連続した
+// ストリップだけを部分面として元の処理に渡す。ストリップどうしは独立で、部分面の先頭も
+// セルの境界にそろうので、処理したストリップの結果は面全体を処理した場合と同じになる。
+void repair_8dot2col_indices(int            mode,
+                             std::uint8_t*  indices,
+                             std::ptrdiff_t row_pitch,
+                             std::int32_t   width,
+                             std::int32_t   height,
+                             int            color_system,
+                             const EightDotSearch& search)
+{
+    const std::int32_t cell_height = eightdot_cell_height(&search);
+    const std::int32_t num_strips  = (height + cell_height - 1) / cell_height;
+
+    std::vector<std::uint8_t> dirty(static_cast<std::size_t>(num_strips));
+    parallel_for(search.executor, num_strips, [&](std::int32_t i) {
+        const std::int32_t y_begin = i * cell_height;
+        const std::int32_t y_end   = std::min(height, y_begin + cell_height);
+        dirty[static_cast<std::size_t>(i)] =
+            rows_have_violation(indices, row_pitch, width, y_begin, y_end) ? 1 : 0;
+    });
+
+    EightDotSearch sub = search;
+    sub.repair_only = false;
+
+    std::int32_t i = 0;
+    while (i < num_strips) {
+        if (!dirty[static_cast<std::size_t>(i)]) {
+            ++i;
+            continue;
+        }
+        std::int32_t j = i + 1;
+        while (j < num_strips && dirty[static_cast<std::size_t>(j)]) {
+            ++j;
+        }
+        const std::int32_t y_begin = i * cell_height;
+        const std::int32_t y_end   = std::min(height, j * cell_height);
+        run_8dot2col_mode(mode, indices + y_begin * row_pitch, row_pitch,
+                          width, y_end - y_begin, color_system, &sub);
+        i = j;
+    }
+}
+
+} // namespace
+
+bool validate_8dot2col_indices(const std::uint8_t* indices,
+                               std::ptrdiff_t row_pitch,
+                               std::int32_t   width,
+                               std::int32_t   height,
+                               EightDotReport* report,
+                               std::size_t    max_listed)
+{
+    if (!indices || width <= 0 || height <= 0) {
+        return true;
+    }
+    if (!report) {
+        return !rows_have_violation(indices, row_pitch, width, 0, height);
+    }
+
+    for (std::int32_t y = 0; y < height; ++y) {
+        const std::uint8_t* row = indices + y * row_pitch;
+        for (std::int32_t x = 0; x < width; x += 8) {
+            const std::uint32_t mask = block_color_mask(row + x, block_width_at(x, width));
+            ++report->blocks;
+            if (!has_three_colors(mask)) {
+                continue;
+            }
+            ++report->violating_blocks;
+            if (report->violations.size() < max_listed) {
+                EightDotViolation v;
+                v.x      = x;
+                v.y      = y;
+                v.colors = count_colors(mask);
+                report->violations.push_back(v);
+            }
+        }
+    }
+    return report->violating_blocks == 0;
+}
+
+void apply_8dot2col_indices(int            mode,
+                            std::uint8_t*  indices,
+                            std::ptrdiff_t row_pitch,
+                            std::int32_t   width,
+                            std::int32_t   height,
+                            int            color_system,
+                            const EightDotSearch* search)
+{
+    if (!indices || width <= 0 || height <= 0) {
+        return;
+    }
+    if (search && search->repair_only) {
+        repair_8dot2col_indices(mode, indices, row_pitch, width, height, color_system, *search);
+        return;
+    }
+    run_8dot2col_mode(mode, indices, row_pitch, width, height, color_system, search);
+}
+
+// ------------------------------------------------------------
+// タイル単位の描画
+// ------------------------------------------------------------
+namespace {
+
+// 0 起点の格子にそろえる（v >= 0）
+inline std::int32_t align_down(std::int32_t v, std::int32_t a)
+{
+    return (v / a) * a;
+}
+
+inline std::int32_t align_up(std::int32_t v, std::int32_t a)
+{
+    return ((v + a - 1) / a) * a;
+}
+
+TileRect clip_tile(const TileRect& tile, std::int32_t frame_width, std::int32_t frame_height)
+{
+    TileRect r;
+    r.left   = std::max<std::int32_t>(tile.left, 0);
+    r.top    = std::max<std::int32_t>(tile.top, 0);
+    r.right  = std::min(tile.right, frame_width);
+    r.bottom = std::min(tile.bottom, frame_height);
+    return r;
+}
+
+} // namespace
+
+TileRequirements tile_requirements(const QuantInfo& qi)
+{
+    TileRequirements req;
+    const int mode = qi.use_8dot2col;
+    if (qi.use_palette_color ||
+        mode < MSX1PQ_EIGHTDOT_MODE_FAST1 || mode > MSX1PQ_EIGHTDOT_MODE_VITERBI) {
+        return req;
+    }
+    req.eightdot = true;
+    req.align_x  = 8;
+
+    // fast1 / basic1 はブロックごとに独立。best 系はセル傾向と左右遷移の重みしだい
+    if (mode == MSX1PQ_EIGHTDOT_MODE_FAST1 || mode == MSX1PQ_EIGHTDOT_MODE_BASIC1) {
+        return req;
+    }
+    if (eightdot_weight(qi.attr_lambda) != 0) {
+        req.align_y = std::max(1, std::min(qi.attr_cell_height, MAX_ATTRCELL_HEIGHT));
+    }
+    if (mode != MSX1PQ_EIGHTDOT_MODE_BEST1 && eightdot_weight(qi.transition_lambda) != 0) {
+        req.full_rows = true;
+    }
+    return req;
+}
+
+TileRect tile_source_rect(const TileRequirements& req,
+                          const TileRect& tile,
+                          std::int32_t frame_width,
+                          std::int32_t frame_height)
+{
+    TileRect r = clip_tile(tile, frame_width, frame_height);
+    if (r.left >= r.right || r.top >= r.bottom) {
+        return r;
+    }
+    if (req.full_rows) {
+        r.left  = 0;
+        r.right = frame_width;
+    } else {
+        r.left  = align_down(r.left, req.align_x);
+        r.right = std::min(align_up(r.right, req.align_x), frame_width);
+    }
+    r.top    = align_down(r.top, req.align_y);
+    r.bottom = std::min(align_up(r.bottom, req.align_y), frame_height);
+    return r;
+}
+
+bool render_tile(const QuantPlan& plan,
+                 const std::uint8_t* src,
+                 std::ptrdiff_t src_row_bytes,
+                 const PixelLayout& src_layout,
+                 std::int32_t frame_width,
+                 std::int32_t frame_height,
+                 const TileRect& tile,
+                 std::uint8_t* out,
+                 std::ptrdiff_t out_pitch,
+                 const EightDotSearch* search)
+{
+    const TileRect t = clip_tile(tile, frame_width, frame_height);
+    if (!src || !out || t.left >= t.right || t.top >= t.bottom) {
+        return true;
+    }
+
+    auto quantize_rows = [&](const TileRect& r, std::uint8_t* dst, std::ptrdiff_t dst_pitch) {
+        for (std::int32_t y = r.top; y < r.bottom; ++y) {
+            quantize_span_indices(plan,
+                                  src + y * src_row_bytes + r.left * src_layout.stride,
+                                  src_layout,
+                                  dst + (y - r.top) * dst_pitch,
+                                  r.right - r.left,
+                                  r.left,
+                                  y);
+        }
+    };
+
+    const TileRequirements req = tile_requirements(plan.qi);
+    if (!req.eightdot) {
+        quantize_rows(t, out, out_pitch);
+        return true;
+    }
+
+    // ハローを含む範囲を作業面で処理し、tile の部分だけを書き出す
+    const TileRect s = tile_source_rect(req, t, frame_width, frame_height);
+    const std::int32_t sw = s.right - s.left;
+    const std::int32_t sh = s.bottom - s.top;
+
+    std::vector<std::uint8_t> work;
+    try {
+        work.resize(static_cast<std::size_t>(sw) * static_cast<std::size_t>(sh));
+    } catch (const std::bad_alloc&) {
+        return false;
+    }
+    quantize_rows(s, work.data(), sw);
+
+    EightDotSearch s8 = make_eightdot_search(plan.qi);
+    if (search) {
+        s8.prune       = search->prune;
+        s8.stats       = search->stats;
+        s8.executor    = search->executor;
+        s8.beam_width  = search->beam_width;
+        s8.repair_only = search->repair_only;
+    }
+    apply_8dot2col_indices(plan.qi.use_8dot2col, work.data(), sw, sw, sh,
+                           plan.qi.color_system, &s8);
+
+    const std::int32_t tw = t.right - t.left;
+    for (std::int32_t y = t.top; y < t.bottom; ++y) {
+        std::memcpy(out + (y - t.top) * out_pitch,
+                    work.data() + static_cast<std::size_t>(y - s.top) * sw + (t.left - s.left),
+                    static_cast<std::size_t>(tw));
+    }
+    return true;
+}
+
+bool render_frame(const QuantPlan& plan,
+                  const std::uint8_t* src,
+                  std::ptrdiff_t src_row_bytes,
+                  const PixelLayout& src_layout,
+                  std::int32_t frame_width,
+                  std::int32_t frame_height,
+                  std::uint8_t* out,
+                  std::ptrdiff_t out_pitch,
+                  const EightDotSearch* search,
+                  const Executor* exec)
+{
+    if (!src || !out || frame_width <= 0 || frame_height <= 0) {
+        return true;
+    }
+
+    // 帯は揃え単位の倍数で 32 行前後。スレッド数より十分多く作り、空いたスレッドが
+    // 次の帯を取りに行く（8dot の色数で帯ごとの重さが揃わないため）
+    const TileRequirements req = tile_requirements(plan.qi);
+    const std::int32_t band_h    = req.align_y * std::max<std::int32_t>(1, 32 / req.align_y);
+    const std::int32_t num_bands = (frame_height + band_h - 1) / band_h;
+
+    // 統計は帯ごとに取り、最後に帯の順に足す（score の足し順をスレッド数に依存させない）
+    EightDotStats* stats = search ? search->stats : nullptr;
+    std::vector<EightDotStats> band_stats;
+    std::unique_ptr<std::atomic<bool>[]> band_ok;
+    try {
+        band_stats.resize(stats ? static_cast<std::size_t>(num_bands) : 0);
+        band_ok.reset(new std::atomic<bool>[static_cast<std::size_t>(num_bands)]);
+    } catch (const std::bad_alloc&) {
+        return false;
+    }
+
+    parallel_for(exec, num_bands, [&](std::int32_t i) {
+        EightDotSearch band_search;
+        if (search) {
+            band_search = *search;
+        }
+        band_search.executor = nullptr;
+        band_search.stats    = stats ? &band_stats[static_cast<std::size_t>(i)] : nullptr;
+
+        TileRect tile;
+        tile.left   = 0;
+        tile.top    = i * band_h;
+        tile.right  = frame_width;
+        tile.bottom = std::min(frame_height, tile.top + band_h);
+        band_ok[static_cast<std::size_t>(i)] =
+            render_tile(plan, src, src_row_bytes, src_layout, frame_width, frame_height, tile,
+                        out + tile.top * out_pitch, out_pitch, &band_search);
+    });
+
+    bool ok = true;
+    for (std::int32_t i = 0; i < num_bands; ++i) {
+        ok = ok && band_ok[static_cast<std::size_t>(i)];
+    }
+    for (const EightDotStats& bs : band_stats) {
+        stats->blocks          += bs.blocks;
+        stats->candidate_pairs += bs.candidate_pairs;
+        stats->scored_pairs    += bs.scored_pairs;
+        stats->score           += bs.score;
+    }
+    return ok;
+}
+
+} // namespace MSX1PQCore
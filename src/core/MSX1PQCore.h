@@ -1,7 +1,9 @@
 #pragma once
 
+#include <algorithm>
 #include <cstddef>
 #include <cstdint>
+#include <memory>
 #include <string>
 #include <vector>
 
@@ -22,7 +24,8 @@ enum MSX1PQ_EightDotMode {
     MSX1PQ_EIGHTDOT_MODE_BASIC1       = 3, // Standard version
     MSX1PQ_EIGHTDOT_MODE_BEST1        = 4, // Best version
     MSX1PQ_EIGHTDOT_MODE_ATTR_BEST    = 5, // Attribute cell BEST (8×N)
-    MSX1PQ_EIGHTDOT_MODE_PENALTY_BEST = 6  // Transition penalty BEST
+    MSX1PQ_EIGHTDOT_MODE_PENALTY_BEST = 6, // Transition penalty BEST
+    MSX1PQ_EIGHTDOT_MODE_VITERBI      = 7  // Transition penalty, whole-row optimum (Viterbi / beam)
 };
 
 enum MSX1PQ_ColorSystem {
@@ -30,6 +33,13 @@ enum MSX1PQ_ColorSystem {
     MSX1PQ_COLOR_SYS_MSX2 = 2
 };
 
+// 横8ドット内2色制限の既定値（QuantInfo / EightDotSearch で上書きできる）
+static const int ATTRCELL_HEIGHT   = 8;  // 4 or 8 で調整
+static const double ATTR_LAMBDA    = 0.3; // 行の見た目とセル傾向のバランス
+static const double TRANSITION_LAMBDA = 1.0; // 左右遷移ペナルティ
+static const int MAX_ATTRCELL_HEIGHT  = 64;
+static const int EIGHTDOT_WEIGHT_SCALE = 1000; // スコアの重みは 1/1000 単位の固定小数点
+
 struct QuantInfo {
     bool  use_dither{};
     bool  use_palette_color{};
@@ -48,6 +58,14 @@ struct QuantInfo {
     const std::uint8_t* pre_lut{nullptr};
     const float* pre_lut3d{nullptr};
     int pre_lut3d_size{0};
+    // 省略可: acquire_nearest_index_lut() の RGB → 探索結果テーブル
+    const std::uint8_t* nearest_lut{nullptr};
+    // 省略可: build_palette_grid() の候補グリッド（92色 / ディザ時の探索用）
+    const struct PaletteGrid* palette_grid{nullptr};
+    // 8dot2col のセルの高さ (1..MAX_ATTRCELL_HEIGHT) とスコアの重み
+    int   attr_cell_height{ATTRCELL_HEIGHT};
+    float attr_lambda{static_cast<float>(ATTR_LAMBDA)};
+    float transition_lambda{static_cast<float>(TRANSITION_LAMBDA)};
 };
 
 bool load_pre_lut(const std::string& path,
@@ -55,6 +73,40 @@ bool load_pre_lut(const std::string& path,
                   std::vector<float>& out3d,
                   int& lut3d_size);
 
+// 読み取り専用のファイルマッピング（空ファイルは length == 0）
+class MappedFile {
+public:
+    MappedFile() = default;
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+    ~MappedFile();
+
+    bool open(const std::string& path);
+
+    const char* bytes{nullptr};
+    std::size_t length{0};
+};
+
+// 前処理 LUT の読み込み結果
+// .lutbin キャッシュから読んだ 3D LUT はコピーせず mmap した領域を参照する
+struct PreLutData {
+    std::vector<std::uint8_t> lut1d;              // 256 × RGB（1D LUT の場合）
+    std::vector<float>        lut3d;              // .cube を解析した場合の 3D LUT
+    const float*              lut3d_data{nullptr}; // 参照先（lut3d または mmap 領域）
+    int                       lut3d_size{0};
+    std::shared_ptr<const MappedFile> mapping;
+
+    PreLutData() = default;
+    PreLutData(const PreLutData&) = delete;            // lut3d_data が自身を指すためコピー不可
+    PreLutData& operator=(const PreLutData&) = delete;
+    PreLutData(PreLutData&&) = default;
+    PreLutData& operator=(PreLutData&&) = default;
+};
+
+// use_cache が true のとき .cube と同じ場所の .lutbin（正規化済み float の 3D LUT）を使う。
+// .lutbin は元の .cube の内容ハッシュと自身のハッシュで検証し、無効なら解析して書き直す。
+bool load_pre_lut(const std::string& path, bool use_cache, PreLutData& out);
+
 float clamp01f(float v);
 
 template <typename T>
@@ -89,6 +141,31 @@ const MSX1PQ::QuantColor* get_basic_palette(int color_system);
 int find_basic_index_from_rgb(std::uint8_t r, std::uint8_t g, std::uint8_t b,
                               int color_system);
 
+// 量子化結果の色を引くパレット（92色 / 基本15色）
+const MSX1PQ::QuantColor* get_output_palette(const QuantInfo& qi);
+
+inline std::size_t rgb_key(std::uint8_t r, std::uint8_t g, std::uint8_t b)
+{
+    return (static_cast<std::size_t>(r) << 16) |
+           (static_cast<std::size_t>(g) << 8) |
+           static_cast<std::size_t>(b);
+}
+
+// ディザ展開前の探索結果
+// (92色 / ディザ時はパレットインデックス、ディザなしは基本15色インデックス)
+int search_palette_index(const QuantInfo& qi,
+                         std::uint8_t r,
+                         std::uint8_t g,
+                         std::uint8_t b);
+
+// quantize_pixel の結果を get_output_palette() のインデックスで返す
+int quantize_pixel_index(const QuantInfo& qi,
+                         std::uint8_t r,
+                         std::uint8_t g,
+                         std::uint8_t b,
+                         std::int32_t x,
+                         std::int32_t y);
+
 MSX1PQ::QuantColor quantize_pixel(const QuantInfo& qi,
                                   std::uint8_t r,
                                   std::uint8_t g,
@@ -97,716 +174,624 @@ MSX1PQ::QuantColor quantize_pixel(const QuantInfo& qi,
                                   std::int32_t y);
 
 // ------------------------------------------------------------
-// 横8ドット内2色制限
+// RGB 全色 → search_palette_index() の結果テーブル (2^24 エントリ, 16MB)
+// 結果は探索パラメータ (use_hsb / w_h / w_s / w_b / use_dither /
+// use_dark_dither / use_palette_color) だけで決まるため、同じパラメータの
+// 呼び出し間で共有する。初回利用時に全コアで並列に構築する。
 // ------------------------------------------------------------
-static const int BASIC_COLORS = 15;
+static const std::size_t NEAREST_LUT_ENTRIES = static_cast<std::size_t>(1) << 24;
 
-static const int ATTRCELL_HEIGHT   = 8;  // 4 or 8 で調整
-static const double ATTR_LAMBDA    = 0.3; // 行の見た目とセル傾向のバランス
-static const double TRANSITION_LAMBDA = 1.0; // 左右遷移ペナルティ
+struct NearestIndexLut {
+    std::vector<std::uint8_t> indices; // [rgb_key(r, g, b)]
+};
 
-// Helper for transition penalty
-int transition_cost_pair(int prevA, int prevB, int a, int b);
+std::shared_ptr<const NearestIndexLut> acquire_nearest_index_lut(const QuantInfo& qi);
 
-template<typename PixelT>
-void apply_8dot2col_basic1(
-    PixelT* data,
-    std::ptrdiff_t row_pitch,
-    std::int32_t   width,
-    std::int32_t   height,
-    int            color_system)
-{
-    if (!data || width <= 0 || height <= 0) {
-        return;
-    }
+// ------------------------------------------------------------
+// 省メモリ版の探索アクセラレータ
+// RGB (HSB 距離なら HSB) 空間を 32^3 のセルに分け、セル内のどこかで最近傍に
+// なりうるパレット色だけを候補として持つ。候補は昇順に走査するので
+// nearest_palette_rgb / nearest_palette_hsb と完全に同じ結果になる。
+// ------------------------------------------------------------
+static const int PALETTE_GRID_DIM = 32;
 
-    const MSX1PQ::QuantColor* table = get_basic_palette(color_system);
+struct PaletteGrid {
+    int   num_colors{0};
+    bool  use_hsb{false};
+    float w_h{};
+    float w_s{};
+    float w_b{};
+    std::vector<std::uint32_t> cell_begin;  // [cell] → candidates の開始位置（末尾に番兵）
+    std::vector<std::uint8_t>  candidates;  // セルごとの候補パレットインデックス（昇順）
+};
 
-    for (std::int32_t y = 0; y < height; ++y) {
-        PixelT* row = data + y * row_pitch;
+// 92色 / ディザ時の探索パラメータでグリッドを作る（ディザなしの基本15色探索は対象外）
+bool build_palette_grid(const QuantInfo& qi, PaletteGrid& grid);
 
-        for (std::int32_t bx = 0; bx * 8 < width; ++bx) {
-            std::int32_t x_start = bx * 8;
-            std::int32_t x_end   = x_start + 8;
-            if (x_end > width) {
-                x_end = width;
-            }
-            int block_w = static_cast<int>(x_end - x_start);
-            if (block_w <= 0) continue;
+// build_palette_grid() の結果を探索パラメータごとにプロセス内で共有する（対象外なら nullptr）
+std::shared_ptr<const PaletteGrid> acquire_palette_grid(const QuantInfo& qi);
 
-            int counts[BASIC_COLORS] = {0};
-            int idx_list[8];
+int nearest_palette_grid(const PaletteGrid& grid,
+                         std::uint8_t r8, std::uint8_t g8, std::uint8_t b8);
 
-            // 1) ブロック内の basic15 インデックスを取得＆カウント
-            for (int i = 0; i < block_w; ++i) {
-                PixelT& p = row[x_start + i];
+// ------------------------------------------------------------
+// ポスタリゼーション結果テーブル
+// ポスタリゼーション後は levels^3 色しか現れないため、以降の HSB 補正と
+// パレット探索の結果を色ごと・ディザ位相ごとに前計算しておく
+// ------------------------------------------------------------
+static const int POSTERIZE_TABLE_MAX_LEVELS = 32;
+static const int DITHER_PHASES = MSX1PQ::kNumDitherPhases; // (x % 2) × (y % 4) : 全ディザパターンの周期
+
+struct PosterizeTable {
+    int levels{0};
+    int phases{0};                           // ディザ時 DITHER_PHASES, それ以外 1
+    std::uint8_t level_of[256]{};            // 入力値 → ポスタリゼーション段階
+    const MSX1PQ::QuantColor* palette{nullptr};
+    std::vector<std::uint8_t> indices;       // [phase][r][g][b] → palette インデックス
+};
 
-                int idx = find_basic_index_from_rgb(
-                    p.red, p.green, p.blue, color_system);
+// pre_posterize が 2..POSTERIZE_TABLE_MAX_LEVELS のときだけテーブルを作る
+bool build_posterize_table(const QuantInfo& qi, PosterizeTable& table);
 
-                if (idx < 0) idx = 0;
-                if (idx >= BASIC_COLORS) idx = BASIC_COLORS - 1;
+inline int dither_phase(std::int32_t x, std::int32_t y)
+{
+    return MSX1PQ::dither_phase_of(x, y);
+}
 
-                idx_list[i] = idx;
-                counts[idx]++;
-            }
+// apply_preprocess + quantize_pixel と同じ結果をテーブル参照で返す
+MSX1PQ::QuantColor quantize_pixel_posterized(const QuantInfo& qi,
+                                             const PosterizeTable& table,
+                                             std::uint8_t r,
+                                             std::uint8_t g,
+                                             std::uint8_t b,
+                                             std::int32_t x,
+                                             std::int32_t y);
 
-            // 2) 出現数 Top2
-            int top1 = -1;
-            int top2 = -1;
-            for (int c = 0; c < BASIC_COLORS; ++c) {
-                int cnt = counts[c];
-                if (cnt <= 0) continue;
-
-                if (top1 < 0 || cnt > counts[top1]) {
-                    top2 = top1;
-                    top1 = c;
-                } else if (top2 < 0 || cnt > counts[top2]) {
-                    top2 = c;
-                }
-            }
-            if (top1 < 0) continue;
-            if (top2 < 0) top2 = top1;
-
-            // 3) Top2 以外は “どちらに近いか” で寄せる
-            for (int i = 0; i < block_w; ++i) {
-                int idx = idx_list[i];
-                int new_idx = idx;
-
-                if (idx != top1 && idx != top2) {
-                    const MSX1PQ::QuantColor& src = table[idx];
-                    const MSX1PQ::QuantColor& c1  = table[top1];
-                    const MSX1PQ::QuantColor& c2  = table[top2];
-
-                    long dr1 = static_cast<long>(src.r) - static_cast<long>(c1.r);
-                    long dg1 = static_cast<long>(src.g) - static_cast<long>(c1.g);
-                    long db1 = static_cast<long>(src.b) - static_cast<long>(c1.b);
-                    long d1  = dr1*dr1 + dg1*dg1 + db1*db1;
-
-                    long dr2 = static_cast<long>(src.r) - static_cast<long>(c2.r);
-                    long dg2 = static_cast<long>(src.g) - static_cast<long>(c2.g);
-                    long db2 = static_cast<long>(src.b) - static_cast<long>(c2.b);
-                    long d2  = dr2*dr2 + dg2*dg2 + db2*db2;
-
-                    new_idx = (d1 <= d2) ? top1 : top2;
-                }
-
-                const MSX1PQ::QuantColor& qc = table[new_idx];
-                PixelT& p = row[x_start + i];
-                p.red   = qc.r;
-                p.green = qc.g;
-                p.blue  = qc.b;
-            }
-        }
-    }
+// ------------------------------------------------------------
+// 量子化プラン
+// QuantInfo から前処理の派生定数（ポスタリゼーション表、V のガンマカーブ、
+// 各スケール）を一度だけ計算し、有効な処理の組み合わせに合う関数を選んでおく。
+// 画素ごとの処理は quantize_pixel_plan() から行い、結果は
+// apply_preprocess + quantize_pixel と完全に一致する。
+// ------------------------------------------------------------
+struct QuantPlan;
+struct PreprocessLut;
+
+typedef MSX1PQ::QuantColor (*QuantPlanFunc)(const QuantPlan& plan,
+                                             std::uint8_t r,
+                                             std::uint8_t g,
+                                             std::uint8_t b,
+                                             std::int32_t x,
+                                             std::int32_t y);
+
+// 作業配列の count 画素を前処理・探索して get_output_palette() のインデックスを書く
+// （r/g/b は前処理で書き換わる）。select_span_kernel() が設定の組み合わせごとの
+// 特殊化を返す。
+typedef void (*QuantSpanKernel)(const QuantPlan& plan,
+                                std::uint8_t* r,
+                                std::uint8_t* g,
+                                std::uint8_t* b,
+                                std::uint8_t* indices,
+                                std::int32_t count,
+                                std::int32_t x0,
+                                std::int32_t y);
+
+// .cube 3D LUT の軸ごとの前計算（入力値 0..255 → 格子点オフセットと補間位置）
+struct PreLut3dAxes {
+    const float* lut{nullptr};
+    std::int32_t off0[3][256]{};     // [軸 r/g/b][値] 下側格子点の float オフセット
+    std::int32_t off1[3][256]{};     // 上側格子点（端ではクランプ）
+    float        t[3][256]{};
+};
+
+struct QuantPlan {
+    // 探索に使う設定（nearest_lut / palette_grid は compile 後に設定してよい）
+    QuantInfo qi{};
+
+    bool  use_pre_lut{false};
+    bool  do_posterize{false};
+    bool  do_hsb_adjust{false};
+    bool  do_hue{false};
+    bool  do_sat{false};
+    bool  do_gamma{false};
+    bool  do_highlight{false};
+    float hue_offset{0.0f};          // pre_hue / 360
+    float sat_scale{1.0f};
+    float highlight_scale{1.0f};
+    std::uint8_t posterize_lut[256]{}; // 入力値 → ポスタリゼーション後の値
+    float gamma_curve[256]{};          // V (= max(r, g, b) / 255) → powf(V, gamma)
+
+    // ポスタリゼーション段階数が小さいときの色ごと結果テーブル
+    PosterizeTable table;
+    bool           use_table{false};
+
+    // 省略可: attach_preprocess_lut() で設定する焼き込み済み前処理 LUT
+    const PreprocessLut* baked_lut{nullptr};
+
+    // pre_lut3d 使用時の行単位適用テーブル（lut3d.lut が nullptr なら未使用）
+    PreLut3dAxes lut3d;
+
+    QuantPlanFunc quantize{nullptr};
+    // apply_pre_lut3d_row() で LUT を適用済みの画素用（LUT 以降の処理だけを行う）
+    QuantPlanFunc quantize_after_lut{nullptr};
+
+    // 92色 / ディザ時のパレット探索の対象色数
+    int num_search_colors{0};
+    // スパン単位の特殊化カーネル。compile_quant_plan() / attach_preprocess_lut() が設定する。
+    // qi.nearest_lut / qi.palette_grid を後から設定した場合は select_span_kernel() で選び直す。
+    QuantSpanKernel span_kernel{nullptr};
+};
+
+// use_preprocess が false のときは前処理 (LUT / ポスタリゼーション / HSB 補正) をすべて省く
+void compile_quant_plan(const QuantInfo& qi, bool use_preprocess, QuantPlan& plan);
+
+// plan の前処理だけを適用する（apply_preprocess と同じ結果）
+void apply_preprocess_plan(const QuantPlan& plan,
+                           std::uint8_t &r8,
+                           std::uint8_t &g8,
+                           std::uint8_t &b8);
+
+inline MSX1PQ::QuantColor quantize_pixel_plan(const QuantPlan& plan,
+                                              std::uint8_t r,
+                                              std::uint8_t g,
+                                              std::uint8_t b,
+                                              std::int32_t x,
+                                              std::int32_t y)
+{
+    return plan.quantize(plan, r, g, b, x, y);
 }
 
-template<typename PixelT>
-void apply_8dot2col_fast1(
-    PixelT* data,
-    std::ptrdiff_t row_pitch,
-    std::int32_t   width,
-    std::int32_t   height,
-    int            /*color_system*/)
+// 行単位の 3D LUT を使うか（焼き込み LUT 使用時は不要）
+inline bool uses_pre_lut3d_rows(const QuantPlan& plan)
 {
-    if (!data || width <= 0 || height <= 0) {
-        return;
-    }
+    return plan.lut3d.lut != nullptr && plan.baked_lut == nullptr;
+}
 
-    for (std::int32_t y = 0; y < height; ++y) {
-        PixelT* row = data + y * row_pitch;
+// 連続した count 画素に pre_lut3d を適用する（各チャンネルは pixel_stride バイト間隔）
+// 結果は画素ごとの apply_preprocess の LUT 段と完全に一致する
+void apply_pre_lut3d_row(const QuantPlan& plan,
+                         std::uint8_t* r,
+                         std::uint8_t* g,
+                         std::uint8_t* b,
+                         std::size_t   count,
+                         std::ptrdiff_t pixel_stride);
 
-        for (std::int32_t bx = 0; bx * 8 < width; ++bx) {
-            std::int32_t x_start = bx * 8;
-            std::int32_t x_end   = x_start + 8;
-            if (x_end > width) {
-                x_end = width;
-            }
-            int block_w = static_cast<int>(x_end - x_start);
-            if (block_w <= 0) continue;
-
-            struct ColorCount {
-                std::uint8_t r, g, b;
-                int          count;
-            };
-
-            ColorCount uniques[8];
-            int        num_unique = 0;
-
-            // 1) ブロック内のユニーク色を集計（最大 8 種類）
-            for (int i = 0; i < block_w; ++i) {
-                PixelT& p = row[x_start + i];
-
-                int j;
-                for (j = 0; j < num_unique; ++j) {
-                    if (uniques[j].r == p.red &&
-                        uniques[j].g == p.green &&
-                        uniques[j].b == p.blue) {
-                        uniques[j].count++;
-                        break;
-                    }
-                }
-                if (j == num_unique && num_unique < 8) {
-                    uniques[num_unique].r = p.red;
-                    uniques[num_unique].g = p.green;
-                    uniques[num_unique].b = p.blue;
-                    uniques[num_unique].count = 1;
-                    ++num_unique;
-                }
-            }
+// ------------------------------------------------------------
+// 前処理チェーンの 3D LUT
+// .cube / 1D LUT・ポスタリゼーション・HSB 補正をまとめて一度サンプリングし、
+// 画素ごとのコストを有効な補正の数に依存しない 1 回の参照にする。
+// size = 33 / 65 は格子点の値を四面体補間（近似）、
+// size = PREPROCESS_LUT_EXACT は 256^3 全色を持つ完全一致モード（48MB）。
+// ------------------------------------------------------------
+static const int PREPROCESS_LUT_EXACT = 256;
+
+struct PreprocessLut {
+    int  size{0};
+    bool pre_lut_only{false};        // 色ごと結果テーブル用に LUT 部分だけを焼き込んだか
+    std::vector<std::uint8_t> rgb;   // [(r * size + g) * size + b] * 3
+    // 格子モード用: 入力値 → 下側の格子インデックスと格子内位置 (0..256)
+    std::uint8_t  node_of[256]{};
+    std::uint16_t frac_of[256]{};
+};
 
-            if (num_unique <= 1) {
-                // もともと 0～1 色なら 2色制限の必要なし
-                continue;
-            }
+// plan の前処理（色ごと結果テーブル使用時は LUT 部分のみ）を焼き込む。
+// 焼き込む処理が無い場合やメモリ確保に失敗した場合は false。
+// 同じ QuantInfo から作った plan 間で共有できる。
+bool build_preprocess_lut(const QuantPlan& plan, int size, PreprocessLut& lut);
 
-            // 2) 出現数 Top2 を探す
-            int top1 = 0;
-            int top2 = 1;
-            if (uniques[top2].count > uniques[top1].count) {
-                int tmp = top1; top1 = top2; top2 = tmp;
-            }
-            for (int i = 2; i < num_unique; ++i) {
-                int c = uniques[i].count;
-                if (c > uniques[top1].count) {
-                    top2 = top1;
-                    top1 = i;
-                } else if (c > uniques[top2].count) {
-                    top2 = i;
-                }
-            }
+// plan の前処理を焼き込み済み LUT の参照に切り替える（lut は plan より長く保持すること）
+bool attach_preprocess_lut(QuantPlan& plan, const PreprocessLut& lut);
 
-            const ColorCount& c1 = uniques[top1];
-            const ColorCount& c2 = uniques[top2];
-
-            // 3) Top2 以外の色は “どちらに近いか” で寄せる
-            for (int i = 0; i < block_w; ++i) {
-                PixelT& p = row[x_start + i];
-
-                // すでに top1 / top2 ならそのまま
-                if ((p.red == c1.r && p.green == c1.g && p.blue == c1.b) ||
-                    (p.red == c2.r && p.green == c2.g && p.blue == c2.b)) {
-                    continue;
-                }
-
-                long dr1 = static_cast<long>(p.red)   - static_cast<long>(c1.r);
-                long dg1 = static_cast<long>(p.green) - static_cast<long>(c1.g);
-                long db1 = static_cast<long>(p.blue)  - static_cast<long>(c1.b);
-                long d1  = dr1*dr1 + dg1*dg1 + db1*db1;
-
-                long dr2 = static_cast<long>(p.red)   - static_cast<long>(c2.r);
-                long dg2 = static_cast<long>(p.green) - static_cast<long>(c2.g);
-                long db2 = static_cast<long>(p.blue)  - static_cast<long>(c2.b);
-                long d2  = dr2*dr2 + dg2*dg2 + db2*db2;
-
-                if (d1 <= d2) {
-                    p.red   = c1.r;
-                    p.green = c1.g;
-                    p.blue  = c1.b;
-                } else {
-                    p.red   = c2.r;
-                    p.green = c2.g;
-                    p.blue  = c2.b;
-                }
-            }
-        }
-    }
-}
+void apply_preprocess_lut(const PreprocessLut& lut,
+                          std::uint8_t &r8,
+                          std::uint8_t &g8,
+                          std::uint8_t &b8);
 
-template<typename PixelT>
-void apply_8dot2col_best1(
-    PixelT* data,
-    std::ptrdiff_t row_pitch,
-    std::int32_t   width,
-    std::int32_t   height,
-    int            color_system)
-{
-    if (!data || width <= 0 || height <= 0) {
-        return;
-    }
+// ------------------------------------------------------------
+// 行・スパン単位の量子化
+// 前処理の段・探索方法・ディザ展開の組み合わせはスパンごとに一度だけ決め、
+// 画素ごとの処理に分岐を残さない。結果は quantize_pixel_plan() と完全に一致する。
+// ------------------------------------------------------------
 
-    const MSX1PQ::QuantColor* table = get_basic_palette(color_system);
+// plan の設定（LUT 段・ポスタリゼーション・HSB 補正・探索方法・ディザ展開）に合う
+// 特殊化カーネルを選ぶ。フレームごとに一度呼べばよい。
+QuantSpanKernel select_span_kernel(const QuantPlan& plan);
 
-    // 15×15 距離テーブル（セル内共通）
-    long dist2[BASIC_COLORS][BASIC_COLORS];
-    for (int i = 0; i < BASIC_COLORS; ++i) {
-        const MSX1PQ::QuantColor& ci = table[i];
-        for (int j = 0; j < BASIC_COLORS; ++j) {
-            const MSX1PQ::QuantColor& cj = table[j];
-            long dr = static_cast<long>(ci.r) - static_cast<long>(cj.r);
-            long dg = static_cast<long>(ci.g) - static_cast<long>(cj.g);
-            long db = static_cast<long>(ci.b) - static_cast<long>(cj.b);
-            dist2[i][j] = dr*dr + dg*dg + db*db;
-        }
-    }
+// 画素の並び（画素間のバイト数と、画素内の各チャンネルのバイトオフセット）
+struct PixelLayout {
+    std::ptrdiff_t stride{4};
+    int r{0};
+    int g{1};
+    int b{2};
+};
+
+// 先頭画素の座標を (x0, y) として count 画素を量子化し、dst の RGB に書き込む
+// （それ以外のチャンネルは変更しない）。src と dst は同じバッファでもよい。
+void quantize_span(const QuantPlan& plan,
+                   const std::uint8_t* src,
+                   const PixelLayout& src_layout,
+                   std::uint8_t* dst,
+                   const PixelLayout& dst_layout,
+                   std::int32_t count,
+                   std::int32_t x0,
+                   std::int32_t y);
+
+// 量子化結果を get_output_palette() のインデックスで indices[0..count) に書き込む
+// （92色モード以外では基本15色インデックス）
+void quantize_span_indices(const QuantPlan& plan,
+                           const std::uint8_t* src,
+                           const PixelLayout& src_layout,
+                           std::uint8_t* indices,
+                           std::int32_t count,
+                           std::int32_t x0,
+                           std::int32_t y);
 
-    const std::int32_t num_blocks_x = (width + 7) / 8;
+// ------------------------------------------------------------
+// 並列実行
+// 互いに独立した仕事 0..count-1 を実行器に任せる。run があればホスト側の
+// スレッドプール（AE の iterate_generic など）を使い、無ければ num_threads 本の
+// std::thread で分ける（1 なら逐次、0 以下なら default_thread_count()）。
+// ------------------------------------------------------------
+typedef void (*ParallelTaskFunc)(void* task_ctx, std::int32_t index);
+typedef void (*ExecutorRunFunc)(void* run_ctx,
+                                std::int32_t count,
+                                ParallelTaskFunc task,
+                                void* task_ctx);
+
+struct Executor {
+    int             num_threads{1};
+    ExecutorRunFunc run{nullptr};
+    void*           run_ctx{nullptr};
+};
+
+// このプロセスが実際に使える CPU 数（1 以上）。Linux ではスレッドの affinity と
+// cgroup の CPU クォータ（v2 の cpu.max / v1 の cfs_quota_us）で絞り込み、
+// それ以外では hardware_concurrency() を返す。初回に求めた値を使い回す。
+int default_thread_count();
 
-    for (std::int32_t y0 = 0; y0 < height; y0 += ATTRCELL_HEIGHT) {
-        std::int32_t cell_h = ATTRCELL_HEIGHT;
-        if (y0 + cell_h > height) {
-            cell_h = height - y0;
+// task(task_ctx, i) を i = 0..count-1 について呼び、すべて終わってから戻る。
+// exec が null なら呼び出したスレッドで順に実行する。
+void parallel_for(const Executor* exec,
+                  std::int32_t count,
+                  ParallelTaskFunc task,
+                  void* task_ctx);
+
+template<typename Fn>
+void parallel_for(const Executor* exec, std::int32_t count, const Fn& fn)
+{
+    struct Thunk {
+        static void call(void* ctx, std::int32_t index)
+        {
+            (*static_cast<const Fn*>(ctx))(index);
         }
-        if (cell_h <= 0) break;
-
-        for (std::int32_t bx = 0; bx < num_blocks_x; ++bx) {
-            std::int32_t x_start = bx * 8;
-            if (x_start >= width) break;
-            std::int32_t x_end   = x_start + 8;
-            if (x_end > width) {
-                x_end = width;
-            }
-            int block_w = static_cast<int>(x_end - x_start);
-            if (block_w <= 0) continue;
+    };
+    parallel_for(exec, count, &Thunk::call,
+                 const_cast<void*>(static_cast<const void*>(&fn)));
+}
 
-            // --- (1) このセル＆この 8dot 縦帯の basic15 ヒストグラム ---
-            int cell_counts[BASIC_COLORS] = {0};
+// ------------------------------------------------------------
+// 横8ドット内2色制限
+// ------------------------------------------------------------
+static const int BASIC_COLORS = 15;
 
-            for (std::int32_t yy = 0; yy < cell_h; ++yy) {
-                PixelT* row = data + (y0 + yy) * row_pitch;
-                for (int i = 0; i < block_w; ++i) {
-                    PixelT& p = row[x_start + i];
+// Helper for transition penalty
+int transition_cost_pair(int prevA, int prevB, int a, int b);
 
-                    int idx = find_basic_index_from_rgb(
-                        p.red, p.green, p.blue, color_system);
-                    if (idx < 0) idx = 0;
-                    if (idx >= BASIC_COLORS) idx = BASIC_COLORS - 1;
+// ---- ペア探索の設定 ----
+// best1 / attr_best / attr_best_penalty の 2色ペア探索。prune のとき出現色の少ない
+// ブロックは誤差の下限で候補を打ち切る（選ばれるペアは総当たりと同じ）。
+// stats があれば件数を加算する（打ち切らなかったブロックは全候補を計算済みとして数える）。
+// executor があれば cell_height 行単位の帯に分けて並列に処理する。セルは帯を
+// またがないので、どのモードでも結果は逐次処理と同じになる。
+// 重みは EIGHTDOT_WEIGHT_SCALE 単位に丸めて使う。0 の項は計算自体を省く。
+struct EightDotStats {
+    std::uint64_t blocks{0};          // ペアを選んだ 8×1 ブロック数（単色ブロックは除く）
+    std::uint64_t candidate_pairs{0}; // 候補ペアの総数
+    std::uint64_t scored_pairs{0};    // 実際に誤差を計算したペア数
+    double        score{0.0};         // 選んだペアのスコアの合計（遷移コスト込み。モードの比較用）
+};
 
-                    cell_counts[idx]++;
-                }
-            }
+struct EightDotSearch {
+    bool            prune{true};
+    EightDotStats*  stats{nullptr};
+    const Executor* executor{nullptr};
+    int             beam_width{0};    // viterbi で各ブロックに残す状態数（0 なら全状態）
+    int             cell_height{ATTRCELL_HEIGHT};
+    float           attr_lambda{static_cast<float>(ATTR_LAMBDA)};
+    float           transition_lambda{static_cast<float>(TRANSITION_LAMBDA)};
+    // 違反ブロック（3色以上）を含むセルの行だけを処理する。2色以下のブロックはどのモードでも
+    // 書き換わらないので結果は通常と同じ（stats には処理した行の分だけが加算される）
+    bool            repair_only{false};
+};
 
-            // --- (2) セル内の各行 8×1 ブロックごとに 2色ペアを選ぶ ---
-            for (std::int32_t yy = 0; yy < cell_h; ++yy) {
-                std::int32_t y = y0 + yy;
-                PixelT* row = data + y * row_pitch;
-
-                int block_counts[BASIC_COLORS] = {0};
-                int idx_list[8];
-
-                for (int i = 0; i < block_w; ++i) {
-                    PixelT& p = row[x_start + i];
-
-                    int idx = find_basic_index_from_rgb(
-                        p.red, p.green, p.blue, color_system);
-                    if (idx < 0) idx = 0;
-                    if (idx >= BASIC_COLORS) idx = BASIC_COLORS - 1;
-
-                    idx_list[i] = idx;
-                    block_counts[idx]++;
-                }
-
-                int unique_indices[8];
-                int num_unique = 0;
-                for (int k = 0; k < BASIC_COLORS && num_unique < 8; ++k) {
-                    if (block_counts[k] > 0) {
-                        unique_indices[num_unique++] = k;
-                    }
-                }
-                if (num_unique <= 1) {
-                    continue;
-                }
-
-                double best_score = 0.0;
-                bool   first      = true;
-                int    best_a     = unique_indices[0];
-                int    best_b     = unique_indices[1];
-
-                for (int ua = 0; ua < num_unique; ++ua) {
-                    for (int ub = ua + 1; ub < num_unique; ++ub) {
-
-                        int a = unique_indices[ua];
-                        int b = unique_indices[ub];
-
-                        long err_block = 0;
-                        for (int k = 0; k < BASIC_COLORS; ++k) {
-                            int cnt = block_counts[k];
-                            if (!cnt) continue;
-
-                            long dA = dist2[k][a];
-                            long dB = dist2[k][b];
-                            long d  = (dA < dB) ? dA : dB;
-
-                            err_block += static_cast<long>(cnt) * d;
-                        }
-
-                        long err_cell = 0;
-                        for (int k = 0; k < BASIC_COLORS; ++k) {
-                            int cnt = cell_counts[k];
-                            if (!cnt) continue;
-
-                            long dA = dist2[k][a];
-                            long dB = dist2[k][b];
-                            long d  = (dA < dB) ? dA : dB;
-
-                            err_cell += static_cast<long>(cnt) * d;
-                        }
-
-                        double score =
-                            static_cast<double>(err_block) +
-                            ATTR_LAMBDA * static_cast<double>(err_cell);
-
-                        if (first || score < best_score) {
-                            first      = false;
-                            best_score = score;
-                            best_a     = a;
-                            best_b     = b;
-                        }
-                    }
-                }
-
-                for (int i = 0; i < block_w; ++i) {
-                    int src_idx = idx_list[i];
-
-                    long dA = dist2[src_idx][best_a];
-                    long dB = dist2[src_idx][best_b];
-                    int  new_idx = (dA <= dB) ? best_a : best_b;
-
-                    const MSX1PQ::QuantColor& qc = table[new_idx];
-                    PixelT& p = row[x_start + i];
-                    p.red   = qc.r;
-                    p.green = qc.g;
-                    p.blue  = qc.b;
-                }
-            }
-        }
-    }
+// QuantInfo のセル設定を写した探索設定（prune / stats / executor は既定値）
+inline EightDotSearch make_eightdot_search(const QuantInfo& qi)
+{
+    EightDotSearch search;
+    search.cell_height       = qi.attr_cell_height;
+    search.attr_lambda       = qi.attr_lambda;
+    search.transition_lambda = qi.transition_lambda;
+    return search;
 }
 
+// ---- 基本15色インデックスの面 (indices[y * row_pitch + x], 値は 0..14) ----
+// 各処理は面を直接書き換える。セル単位の処理は処理済みの上の行も参照する。
+void apply_8dot2col_basic1_indices(std::uint8_t* indices,
+                                   std::ptrdiff_t row_pitch,
+                                   std::int32_t   width,
+                                   std::int32_t   height,
+                                   int            color_system,
+                                   const EightDotSearch* search = nullptr);
+
+void apply_8dot2col_fast1_indices(std::uint8_t* indices,
+                                  std::ptrdiff_t row_pitch,
+                                  std::int32_t   width,
+                                  std::int32_t   height,
+                                  int            color_system,
+                                  const EightDotSearch* search = nullptr);
+
+void apply_8dot2col_best1_indices(std::uint8_t* indices,
+                                  std::ptrdiff_t row_pitch,
+                                  std::int32_t   width,
+                                  std::int32_t   height,
+                                  int            color_system,
+                                  const EightDotSearch* search = nullptr);
+
+void apply_8dot2col_attr_best_indices(std::uint8_t* indices,
+                                      std::ptrdiff_t row_pitch,
+                                      std::int32_t   width,
+                                      std::int32_t   height,
+                                      int            color_system,
+                                      const EightDotSearch* search = nullptr);
+
+void apply_8dot2col_attr_best_penalty_indices(std::uint8_t* indices,
+                                              std::ptrdiff_t row_pitch,
+                                              std::int32_t   width,
+                                              std::int32_t   height,
+                                              int            color_system,
+                                              const EightDotSearch* search = nullptr);
+
+// attr_best_penalty と同じスコア（ブロック誤差 + セル誤差 + 左右遷移コスト）の行ごとの
+// 合計を、左から貪欲に決める代わりに動的計画法で最小にする。
+// search->beam_width > 0 ならビーム探索（各ブロックで累積スコアの小さい状態だけを残す）。
+void apply_8dot2col_viterbi_indices(std::uint8_t* indices,
+                                    std::ptrdiff_t row_pitch,
+                                    std::int32_t   width,
+                                    std::int32_t   height,
+                                    int            color_system,
+                                    const EightDotSearch* search = nullptr);
+
+// mode (MSX1PQ_EIGHTDOT_MODE_*) に応じて上のいずれかを呼ぶ（NONE なら何もしない）
+// search->repair_only なら先に面を検査し、違反のあるセルの行だけに処理を適用する。
+void apply_8dot2col_indices(int            mode,
+                            std::uint8_t*  indices,
+                            std::ptrdiff_t row_pitch,
+                            std::int32_t   width,
+                            std::int32_t   height,
+                            int            color_system,
+                            const EightDotSearch* search = nullptr);
+
+// ---- 2色制限の検査 ----
+// 8×1 ブロック（右端は幅の余り）ごとに出現色をビットマスクで集め、3色以上を違反とする。
+// 面を 1 回読むだけで書き換えない。
+struct EightDotViolation {
+    std::int32_t x;       // ブロックの左端
+    std::int32_t y;
+    int          colors;  // 出現色数 (3..8)
+};
+
+struct EightDotReport {
+    std::uint64_t blocks{0};           // 検査した 8×1 ブロック数
+    std::uint64_t violating_blocks{0}; // 3色以上のブロック数
+    std::vector<EightDotViolation> violations; // 左上から行順に max_listed 件まで
+};
+
+// 違反ブロックが無ければ true。report が無ければ最初の違反で打ち切る。
+bool validate_8dot2col_indices(const std::uint8_t* indices,
+                               std::ptrdiff_t row_pitch,
+                               std::int32_t   width,
+                               std::int32_t   height,
+                               EightDotReport* report = nullptr,
+                               std::size_t    max_listed = 0);
+
+// ------------------------------------------------------------
+// タイル単位の描画
+// フレーム（左上が (0, 0) の width × height）の任意の矩形を、フレーム全体を一度に
+// 処理した場合と同じ結果で描く。8dot 処理のブロックとセルはフレーム座標の 8 / セルの
+// 高さの倍数にそろえるので、タイルの外側（ハロー）も読んで処理する必要がある。
+// ------------------------------------------------------------
+struct TileRect {
+    std::int32_t left{0};
+    std::int32_t top{0};
+    std::int32_t right{0};
+    std::int32_t bottom{0};
+};
+
+// 設定ごとの読み取り範囲の条件
+// （8dot 処理が無効なら画素ごとに独立なので 1 × 1、遷移の重みが 0 でなければ行全体）
+struct TileRequirements {
+    bool         eightdot{false};  // 量子化のあとに 8dot 処理を行うか
+    std::int32_t align_x{1};       // 読む範囲の左右をこの倍数にそろえる（8dot ブロック）
+    std::int32_t align_y{1};       // 上下をこの倍数にそろえる（セル傾向を使うときのセル）
+    bool         full_rows{false}; // 左右遷移ペナルティは行の左端から続くので行全体を読む
+};
+
+TileRequirements tile_requirements(const QuantInfo& qi);
+
+// tile を描くために量子化・8dot 処理する範囲（tile をハローまで広げてフレーム内に収めたもの）
+TileRect tile_source_rect(const TileRequirements& req,
+                          const TileRect& tile,
+                          std::int32_t frame_width,
+                          std::int32_t frame_height);
+
+// tile の量子化結果を get_output_palette() のインデックスで out に書く
+// （out は tile の左上、out_pitch は 1 行のバイト数）。
+// src はフレームの (0, 0) の画素を指し、tile_source_rect() の範囲が読めること。
+// 8dot 処理のモード・セルの高さ・重みは plan.qi を使い、search からは prune / stats /
+// executor / beam_width / repair_only だけを使う。作業面を確保できなければ false。
+bool render_tile(const QuantPlan& plan,
+                 const std::uint8_t* src,
+                 std::ptrdiff_t src_row_bytes,
+                 const PixelLayout& src_layout,
+                 std::int32_t frame_width,
+                 std::int32_t frame_height,
+                 const TileRect& tile,
+                 std::uint8_t* out,
+                 std::ptrdiff_t out_pitch,
+                 const EightDotSearch* search = nullptr);
+
+// フレーム全体を全幅の帯に分けて render_tile() し、帯を exec で並列に処理する。
+// 帯の高さは tile_requirements() の揃え単位の倍数なので、結果と search->stats は
+// スレッド数や帯の処理順によらず面全体を一度に処理した場合と同じになる。
+// search->executor は使わない（帯の中は逐次）。out はフレームの (0, 0) を指す。
+bool render_frame(const QuantPlan& plan,
+                  const std::uint8_t* src,
+                  std::ptrdiff_t src_row_bytes,
+                  const PixelLayout& src_layout,
+                  std::int32_t frame_width,
+                  std::int32_t frame_height,
+                  std::uint8_t* out,
+                  std::ptrdiff_t out_pitch,
+                  const EightDotSearch* search = nullptr,
+                  const Executor* exec = nullptr);
+
+// ---- RGB 画像用 ----
+// 量子化済み（基本15色だけからなる）画像を一度だけインデックスの面に変換し、
+// インデックス版で処理してから RGB に戻す。
+typedef void (*EightDotIndexFunc)(std::uint8_t* indices,
+                                  std::ptrdiff_t row_pitch,
+                                  std::int32_t   width,
+                                  std::int32_t   height,
+                                  int            color_system,
+                                  const EightDotSearch* search);
+
 template<typename PixelT>
-void apply_8dot2col_attr_best(
+void apply_8dot2col_rgb(
+    EightDotIndexFunc fn,
     PixelT* data,
     std::ptrdiff_t row_pitch,
     std::int32_t   width,
     std::int32_t   height,
-    int            color_system)
+    int            color_system,
+    const EightDotSearch* search = nullptr)
 {
     if (!data || width <= 0 || height <= 0) {
         return;
     }
 
     const MSX1PQ::QuantColor* table = get_basic_palette(color_system);
-
-    long dist2[BASIC_COLORS][BASIC_COLORS];
-    for (int i = 0; i < BASIC_COLORS; ++i) {
-        const MSX1PQ::QuantColor& ci = table[i];
-        for (int j = 0; j < BASIC_COLORS; ++j) {
-            const MSX1PQ::QuantColor& cj = table[j];
-            long dr = static_cast<long>(ci.r) - static_cast<long>(cj.r);
-            long dg = static_cast<long>(ci.g) - static_cast<long>(cj.g);
-            long db = static_cast<long>(ci.b) - static_cast<long>(cj.b);
-            dist2[i][j] = dr*dr + dg*dg + db*db;
-        }
-    }
-
-    const std::int32_t num_blocks_x = (width + 7) / 8;
-
-    for (std::int32_t y0 = 0; y0 < height; y0 += ATTRCELL_HEIGHT) {
-
-        std::int32_t cell_h = ATTRCELL_HEIGHT;
-        if (y0 + cell_h > height) {
-            cell_h = height - y0;
+    std::vector<std::uint8_t> indices(
+        static_cast<std::size_t>(width) * static_cast<std::size_t>(height));
+
+    // 変換と書き戻しも 1 セル分の行ずつ並列に行う
+    const Executor* exec = search ? search->executor : nullptr;
+    const std::int32_t num_bands = (height + ATTRCELL_HEIGHT - 1) / ATTRCELL_HEIGHT;
+
+    parallel_for(exec, num_bands, [&](std::int32_t band) {
+        const std::int32_t y_end = std::min(height, (band + 1) * ATTRCELL_HEIGHT);
+        for (std::int32_t y = band * ATTRCELL_HEIGHT; y < y_end; ++y) {
+            const PixelT* row = data + y * row_pitch;
+            std::uint8_t* irow = indices.data() + static_cast<std::size_t>(y) * width;
+            for (std::int32_t x = 0; x < width; ++x) {
+                irow[x] = static_cast<std::uint8_t>(find_basic_index_from_rgb(
+                    row[x].red, row[x].green, row[x].blue, color_system));
+            }
         }
-        if (cell_h <= 0) break;
+    });
 
-        for (std::int32_t yy = 0; yy < cell_h; ++yy) {
+    fn(indices.data(), width, width, height, color_system, search);
 
-            std::int32_t y = y0 + yy;
+    parallel_for(exec, num_bands, [&](std::int32_t band) {
+        const std::int32_t y_end = std::min(height, (band + 1) * ATTRCELL_HEIGHT);
+        for (std::int32_t y = band * ATTRCELL_HEIGHT; y < y_end; ++y) {
             PixelT* row = data + y * row_pitch;
-
-            int prevA = -1;
-            int prevB = -1;
-
-            for (std::int32_t bx = 0; bx < num_blocks_x; ++bx) {
-
-                std::int32_t x_start = bx * 8;
-                if (x_start >= width) break;
-                std::int32_t x_end   = x_start + 8;
-                if (x_end > width) {
-                    x_end = width;
-                }
-                int block_w = static_cast<int>(x_end - x_start);
-                if (block_w <= 0) continue;
-
-                int block_counts[BASIC_COLORS] = {0};
-                int idx_list[8];
-
-                for (int i = 0; i < block_w; ++i) {
-                    PixelT& p = row[x_start + i];
-
-                    int idx = find_basic_index_from_rgb(
-                        p.red, p.green, p.blue, color_system);
-                    if (idx < 0) idx = 0;
-                    if (idx >= BASIC_COLORS) idx = BASIC_COLORS - 1;
-
-                    idx_list[i] = idx;
-                    block_counts[idx]++;
-                }
-
-                int unique_indices[8];
-                int num_unique = 0;
-                for (int k = 0; k < BASIC_COLORS && num_unique < 8; ++k) {
-                    if (block_counts[k] > 0) {
-                        unique_indices[num_unique++] = k;
-                    }
-                }
-                if (num_unique <= 1) {
-                    continue;
-                }
-
-                int cell_counts[BASIC_COLORS] = {0};
-                for (std::int32_t yyc = 0; yyc < cell_h; ++yyc) {
-                    PixelT* rowc = data + (y0 + yyc) * row_pitch;
-                    for (int i = 0; i < block_w; ++i) {
-                        PixelT& p = rowc[x_start + i];
-
-                        int idx = find_basic_index_from_rgb(
-                            p.red, p.green, p.blue, color_system);
-                        if (idx < 0) idx = 0;
-                        if (idx >= BASIC_COLORS) idx = BASIC_COLORS - 1;
-
-                        cell_counts[idx]++;
-                    }
-                }
-
-                double best_score = 0.0;
-                bool   first      = true;
-                int    best_a     = unique_indices[0];
-                int    best_b     = unique_indices[1];
-
-                for (int ua = 0; ua < num_unique; ++ua) {
-                    for (int ub = ua + 1; ub < num_unique; ++ub) {
-
-                        int a = unique_indices[ua];
-                        int b = unique_indices[ub];
-
-                        long err_block = 0;
-                        for (int k = 0; k < BASIC_COLORS; ++k) {
-                            int cnt = block_counts[k];
-                            if (!cnt) continue;
-
-                            long dA = dist2[k][a];
-                            long dB = dist2[k][b];
-                            long d  = (dA < dB) ? dA : dB;
-
-                            err_block += static_cast<long>(cnt) * d;
-                        }
-
-                        long err_cell = 0;
-                        for (int k = 0; k < BASIC_COLORS; ++k) {
-                            int cnt = cell_counts[k];
-                            if (!cnt) continue;
-
-                            long dA = dist2[k][a];
-                            long dB = dist2[k][b];
-                            long d  = (dA < dB) ? dA : dB;
-
-                            err_cell += static_cast<long>(cnt) * d;
-                        }
-
-                        int tc_h = transition_cost_pair(prevA, prevB, a, b);
-
-                        double score =
-                            static_cast<double>(err_block) +
-                            ATTR_LAMBDA       * static_cast<double>(err_cell) +
-                            TRANSITION_LAMBDA * static_cast<double>(tc_h);
-
-                        if (first || score < best_score) {
-                            first      = false;
-                            best_score = score;
-                            best_a     = a;
-                            best_b     = b;
-                        }
-                    }
-                }
-
-                for (int i = 0; i < block_w; ++i) {
-                    int src_idx = idx_list[i];
-
-                    long dA = dist2[src_idx][best_a];
-                    long dB = dist2[src_idx][best_b];
-                    int  new_idx = (dA <= dB) ? best_a : best_b;
-
-                    const MSX1PQ::QuantColor& qc = table[new_idx];
-                    PixelT& p = row[x_start + i];
-                    p.red   = qc.r;
-                    p.green = qc.g;
-                    p.blue  = qc.b;
-                }
-
-                prevA = best_a;
-                prevB = best_b;
+            const std::uint8_t* irow = indices.data() + static_cast<std::size_t>(y) * width;
+            for (std::int32_t x = 0; x < width; ++x) {
+                const MSX1PQ::QuantColor& qc = table[irow[x]];
+                row[x].red   = qc.r;
+                row[x].green = qc.g;
+                row[x].blue  = qc.b;
             }
         }
-    }
+    });
 }
 
 template<typename PixelT>
-void apply_8dot2col_attr_best_penalty(
+void apply_8dot2col_basic1(
     PixelT* data,
     std::ptrdiff_t row_pitch,
     std::int32_t   width,
     std::int32_t   height,
-    int            color_system)
+    int            color_system,
+    const EightDotSearch* search = nullptr)
 {
-    if (!data || width <= 0 || height <= 0) {
-        return;
-    }
-
-    const MSX1PQ::QuantColor* table = get_basic_palette(color_system);
-
-    long dist2[BASIC_COLORS][BASIC_COLORS];
-    for (int i = 0; i < BASIC_COLORS; ++i) {
-        const MSX1PQ::QuantColor& ci = table[i];
-        for (int j = 0; j < BASIC_COLORS; ++j) {
-            const MSX1PQ::QuantColor& cj = table[j];
-            long dr = static_cast<long>(ci.r) - static_cast<long>(cj.r);
-            long dg = static_cast<long>(ci.g) - static_cast<long>(cj.g);
-            long db = static_cast<long>(ci.b) - static_cast<long>(cj.b);
-            dist2[i][j] = dr*dr + dg*dg + db*db;
-        }
-    }
-
-    const std::int32_t num_blocks_x = (width + 7) / 8;
+    apply_8dot2col_rgb(apply_8dot2col_basic1_indices,
+                       data, row_pitch, width, height, color_system, search);
+}
 
-    for (std::int32_t y0 = 0; y0 < height; y0 += ATTRCELL_HEIGHT) {
+template<typename PixelT>
+void apply_8dot2col_fast1(
+    PixelT* data,
+    std::ptrdiff_t row_pitch,
+    std::int32_t   width,
+    std::int32_t   height,
+    int            color_system,
+    const EightDotSearch* search = nullptr)
+{
+    apply_8dot2col_rgb(apply_8dot2col_fast1_indices,
+                       data, row_pitch, width, height, color_system, search);
+}
 
-        std::int32_t cell_h = ATTRCELL_HEIGHT;
-        if (y0 + cell_h > height) {
-            cell_h = height - y0;
-        }
-        if (cell_h <= 0) break;
+template<typename PixelT>
+void apply_8dot2col_best1(
+    PixelT* data,
+    std::ptrdiff_t row_pitch,
+    std::int32_t   width,
+    std::int32_t   height,
+    int            color_system,
+    const EightDotSearch* search = nullptr)
+{
+    apply_8dot2col_rgb(apply_8dot2col_best1_indices,
+                       data, row_pitch, width, height, color_system, search);
+}
 
-        for (std::int32_t yy = 0; yy < cell_h; ++yy) {
+template<typename PixelT>
+void apply_8dot2col_attr_best(
+    PixelT* data,
+    std::ptrdiff_t row_pitch,
+    std::int32_t   width,
+    std::int32_t   height,
+    int            color_system,
+    const EightDotSearch* search = nullptr)
+{
+    apply_8dot2col_rgb(apply_8dot2col_attr_best_indices,
+                       data, row_pitch, width, height, color_system, search);
+}
 
-            std::int32_t y = y0 + yy;
-            PixelT* row = data + y * row_pitch;
+template<typename PixelT>
+void apply_8dot2col_attr_best_penalty(
+    PixelT* data,
+    std::ptrdiff_t row_pitch,
+    std::int32_t   width,
+    std::int32_t   height,
+    int            color_system,
+    const EightDotSearch* search = nullptr)
+{
+    apply_8dot2col_rgb(apply_8dot2col_attr_best_penalty_indices,
+                       data, row_pitch, width, height, color_system, search);
+}
 
-            int prevA = -1;
-            int prevB = -1;
-
-            for (std::int32_t bx = 0; bx < num_blocks_x; ++bx) {
-
-                std::int32_t x_start = bx * 8;
-                if (x_start >= width) break;
-                std::int32_t x_end   = x_start + 8;
-                if (x_end > width) {
-                    x_end = width;
-                }
-                int block_w = static_cast<int>(x_end - x_start);
-                if (block_w <= 0) continue;
-
-                int block_counts[BASIC_COLORS] = {0};
-                int idx_list[8];
-
-                for (int i = 0; i < block_w; ++i) {
-                    PixelT& p = row[x_start + i];
-
-                    int idx = find_basic_index_from_rgb(
-                        p.red, p.green, p.blue, color_system);
-                    if (idx < 0) idx = 0;
-                    if (idx >= BASIC_COLORS) idx = BASIC_COLORS - 1;
-
-                    idx_list[i] = idx;
-                    block_counts[idx]++;
-                }
-
-                int unique_indices[8];
-                int num_unique = 0;
-                for (int k = 0; k < BASIC_COLORS && num_unique < 8; ++k) {
-                    if (block_counts[k] > 0) {
-                        unique_indices[num_unique++] = k;
-                    }
-                }
-                if (num_unique <= 1) {
-                    continue;
-                }
-
-                int cell_counts[BASIC_COLORS] = {0};
-                for (std::int32_t yyc = 0; yyc < cell_h; ++yyc) {
-                    PixelT* rowc = data + (y0 + yyc) * row_pitch;
-                    for (int i = 0; i < block_w; ++i) {
-                        PixelT& p = rowc[x_start + i];
-
-                        int idx = find_basic_index_from_rgb(
-                            p.red, p.green, p.blue, color_system);
-                        if (idx < 0) idx = 0;
-                        if (idx >= BASIC_COLORS) idx = BASIC_COLORS - 1;
-
-                        cell_counts[idx]++;
-                    }
-                }
-
-                double best_score = 0.0;
-                bool   first      = true;
-                int    best_a     = unique_indices[0];
-                int    best_b     = unique_indices[1];
-
-                for (int ua = 0; ua < num_unique; ++ua) {
-                    for (int ub = ua + 1; ub < num_unique; ++ub) {
-
-                        int a = unique_indices[ua];
-                        int b = unique_indices[ub];
-
-                        long err_block = 0;
-                        for (int k = 0; k < BASIC_COLORS; ++k) {
-                            int cnt = block_counts[k];
-                            if (!cnt) continue;
-
-                            long dA = dist2[k][a];
-                            long dB = dist2[k][b];
-                            long d  = (dA < dB) ? dA : dB;
-
-                            err_block += static_cast<long>(cnt) * d;
-                        }
-
-                        long err_cell = 0;
-                        for (int k = 0; k < BASIC_COLORS; ++k) {
-                            int cnt = cell_counts[k];
-                            if (!cnt) continue;
-
-                            long dA = dist2[k][a];
-                            long dB = dist2[k][b];
-                            long d  = (dA < dB) ? dA : dB;
-
-                            err_cell += static_cast<long>(cnt) * d;
-                        }
-
-                        int tc_h = transition_cost_pair(prevA, prevB, a, b);
-
-                        double score =
-                            static_cast<double>(err_block) +
-                            ATTR_LAMBDA       * static_cast<double>(err_cell) +
-                            TRANSITION_LAMBDA * static_cast<double>(tc_h);
-
-                        if (first || score < best_score) {
-                            first      = false;
-                            best_score = score;
-                            best_a     = a;
-                            best_b     = b;
-                        }
-                    }
-                }
-
-                for (int i = 0; i < block_w; ++i) {
-                    int src_idx = idx_list[i];
-
-                    long dA = dist2[src_idx][best_a];
-                    long dB = dist2[src_idx][best_b];
-                    int  new_idx = (dA <= dB) ? best_a : best_b;
-
-                    const MSX1PQ::QuantColor& qc = table[new_idx];
-                    PixelT& p = row[x_start + i];
-                    p.red   = qc.r;
-                    p.green = qc.g;
-                    p.blue  = qc.b;
-                }
-
-                prevA = best_a;
-                prevB = best_b;
-            }
-        }
-    }
+template<typename PixelT>
+void apply_8dot2col_viterbi(
+    PixelT* data,
+    std::ptrdiff_t row_pitch,
+    std::int32_t   width,
+    std::int32_t   height,
+    int            color_system,
+    const EightDotSearch* search = nullptr)
+{
+    apply_8dot2col_rgb(apply_8dot2col_viterbi_indices,
+                       data, row_pitch, width, height, color_system, search);
 }
 
 } // namespace MSX1PQCore
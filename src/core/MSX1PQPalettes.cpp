@@ -1,7 +1,7 @@
 #include "MSX1PQPalettes.h"
 #include <limits.h>
 
-const MSX1PQ::QuantColor MSX1PQ::kQuantColors[] = {
+constexpr MSX1PQ::QuantColor MSX1PQ::kQuantColors[] = {
 
     // ---- basic_colors_msx1 ----
     {   0,   0,   0 },   //  1: 黒
@@ -113,7 +113,7 @@ const MSX1PQ::QuantColor MSX1PQ::kQuantColors[] = {
     {  61,  34,  61 },   // 95: dark_dithering(1,13)
 };
 
-const MSX1PQ::QuantColor MSX1PQ::kBasicColorsMsx2[15] = {
+constexpr MSX1PQ::QuantColor MSX1PQ::kBasicColorsMsx2[15] = {
     { 0x00, 0x00, 0x00 }, // 1
     { 0x22, 0xDD, 0x22 }, // 2
     { 0x66, 0xFF, 0x66 }, // 3
@@ -131,20 +131,23 @@ const MSX1PQ::QuantColor MSX1PQ::kBasicColorsMsx2[15] = {
     { 0xFF, 0xFF, 0xFF }, // 15
 };
 
-const int MSX1PQ::kNumQuantColors = sizeof(MSX1PQ::kQuantColors) / sizeof(MSX1PQ::kQuantColors[0]);
-const int MSX1PQ::kNumBasicColors = 15;
-const int MSX1PQ::kNumDarkDitherColors  = 6; // palette_low_luminance の個数
-const int MSX1PQ::kFirstDarkDitherIndex = MSX1PQ::kNumQuantColors - MSX1PQ::kNumDarkDitherColors;
+constexpr int MSX1PQ::kNumQuantColors = sizeof(MSX1PQ::kQuantColors) / sizeof(MSX1PQ::kQuantColors[0]);
+constexpr int MSX1PQ::kNumBasicColors = 15;
+constexpr int MSX1PQ::kNumDarkDitherColors  = 6; // palette_low_luminance の個数
+constexpr int MSX1PQ::kFirstDarkDitherIndex = MSX1PQ::kNumQuantColors - MSX1PQ::kNumDarkDitherColors;
+
+static_assert(MSX1PQ::kNumQuantColors <= MSX1PQ::kPaletteSoaSize,
+              "kPaletteSoaSize must cover kQuantColors");
 
 // ---- ディザパターン生成マクロ ----
 #define MAKE_LINE_PATTERN(NAME, COL1_ID, COL2_ID) \
-    static const std::uint8_t NAME[] = { \
+    static constexpr std::uint8_t NAME[] = { \
         (std::uint8_t)((COL1_ID) - 1), \
         (std::uint8_t)((COL2_ID) - 1)  \
     }
 
 #define MAKE_DARK_PATTERN(NAME, COL1_ID, COL2_ID) \
-    static const std::uint8_t NAME[] = { \
+    static constexpr std::uint8_t NAME[] = { \
         (std::uint8_t)((COL1_ID) - 1), (std::uint8_t)((COL1_ID) - 1), \
         (std::uint8_t)((COL1_ID) - 1), (std::uint8_t)((COL2_ID) - 1), \
         (std::uint8_t)((COL1_ID) - 1), (std::uint8_t)((COL1_ID) - 1), \
@@ -152,21 +155,21 @@ const int MSX1PQ::kFirstDarkDitherIndex = MSX1PQ::kNumQuantColors - MSX1PQ::kNum
     }
 
 // 基本15色の 1x1 パターン (id 1..15 → index 0..14)
-static const std::uint8_t kPattern_basic_1[]  = {  0 };
-static const std::uint8_t kPattern_basic_2[]  = {  1 };
-static const std::uint8_t kPattern_basic_3[]  = {  2 };
-static const std::uint8_t kPattern_basic_4[]  = {  3 };
-static const std::uint8_t kPattern_basic_5[]  = {  4 };
-static const std::uint8_t kPattern_basic_6[]  = {  5 };
-static const std::uint8_t kPattern_basic_7[]  = {  6 };
-static const std::uint8_t kPattern_basic_8[]  = {  7 };
-static const std::uint8_t kPattern_basic_9[]  = {  8 };
-static const std::uint8_t kPattern_basic_10[] = {  9 };
-static const std::uint8_t kPattern_basic_11[] = { 10 };
-static const std::uint8_t kPattern_basic_12[] = { 11 };
-static const std::uint8_t kPattern_basic_13[] = { 12 };
-static const std::uint8_t kPattern_basic_14[] = { 13 };
-static const std::uint8_t kPattern_basic_15[] = { 14 };
+static constexpr std::uint8_t kPattern_basic_1[]  = {  0 };
+static constexpr std::uint8_t kPattern_basic_2[]  = {  1 };
+static constexpr std::uint8_t kPattern_basic_3[]  = {  2 };
+static constexpr std::uint8_t kPattern_basic_4[]  = {  3 };
+static constexpr std::uint8_t kPattern_basic_5[]  = {  4 };
+static constexpr std::uint8_t kPattern_basic_6[]  = {  5 };
+static constexpr std::uint8_t kPattern_basic_7[]  = {  6 };
+static constexpr std::uint8_t kPattern_basic_8[]  = {  7 };
+static constexpr std::uint8_t kPattern_basic_9[]  = {  8 };
+static constexpr std::uint8_t kPattern_basic_10[] = {  9 };
+static constexpr std::uint8_t kPattern_basic_11[] = { 10 };
+static constexpr std::uint8_t kPattern_basic_12[] = { 11 };
+static constexpr std::uint8_t kPattern_basic_13[] = { 12 };
+static constexpr std::uint8_t kPattern_basic_14[] = { 13 };
+static constexpr std::uint8_t kPattern_basic_15[] = { 14 };
 
 // ---- line_dithering 用 (dith_col2 のペア全部) ----
 MAKE_LINE_PATTERN(kPattern_1_4,   1,  4);
@@ -261,7 +264,7 @@ MAKE_DARK_PATTERN(kPattern_dark_1_13,  1, 13);
 
 // ---- パレットインデックス → ディザパターン ----
 // MSX1PQ::kQuantColors と同じ順番で並べる
-const MSX1PQ::DitherPattern MSX1PQ::kPaletteDither[] = {
+constexpr MSX1PQ::DitherPattern MSX1PQ::kPaletteDither[] = {
     // basic 15 (1x1)
     { kPattern_basic_1,  1, 1 }, //  0
     { kPattern_basic_2,  1, 1 }, //  1
@@ -372,46 +375,209 @@ const MSX1PQ::DitherPattern MSX1PQ::kPaletteDither[] = {
     { kPattern_dark_1_13,  2, 4 }, // 94
 };
 
-const int MSX1PQ::kNumPaletteDither =
+constexpr int MSX1PQ::kNumPaletteDither =
     sizeof(MSX1PQ::kPaletteDither) / sizeof(MSX1PQ::kPaletteDither[0]);
 
-// ---- MSX1PQ::palette_index_to_basic_index ----
-int
-MSX1PQ::palette_index_to_basic_index(int palette_idx, std::int32_t xL, std::int32_t yL)
+// ---- コンパイル時に生成する派生テーブル ----
+// 実行時の初期化が無いので、どのスレッドから最初に参照しても安全
+namespace {
+
+constexpr MSX1PQ::PaletteSoA make_palette_soa()
 {
-    if (palette_idx < 0) {
-        palette_idx = 0;
-    } else if (palette_idx >= MSX1PQ::kNumQuantColors) {
-        palette_idx = MSX1PQ::kNumQuantColors - 1;
+    MSX1PQ::PaletteSoA soa{};
+    for (int i = 0; i < MSX1PQ::kNumQuantColors; ++i) {
+        const MSX1PQ::QuantColor& qc = MSX1PQ::kQuantColors[i];
+        const MSX1PQ::HsbColor hsb = MSX1PQ::rgb8_to_hsb(qc.r, qc.g, qc.b);
+        soa.r[i] = static_cast<float>(qc.r);
+        soa.g[i] = static_cast<float>(qc.g);
+        soa.b[i] = static_cast<float>(qc.b);
+        soa.h[i] = hsb.h;
+        soa.s[i] = hsb.s;
+        soa.v[i] = hsb.v;
     }
+    return soa;
+}
+
+struct BasicDist2Table {
+    long d[15][15];
+};
+
+constexpr BasicDist2Table make_basic_dist2(const MSX1PQ::QuantColor* table)
+{
+    BasicDist2Table t{};
+    for (int i = 0; i < 15; ++i) {
+        for (int j = 0; j < 15; ++j) {
+            long dr = static_cast<long>(table[i].r) - static_cast<long>(table[j].r);
+            long dg = static_cast<long>(table[i].g) - static_cast<long>(table[j].g);
+            long db = static_cast<long>(table[i].b) - static_cast<long>(table[j].b);
+            t.d[i][j] = dr*dr + dg*dg + db*db;
+        }
+    }
+    return t;
+}
 
-    const MSX1PQ::DitherPattern* dp = nullptr;
-    if (palette_idx < MSX1PQ::kNumPaletteDither) {
-        dp = &MSX1PQ::kPaletteDither[palette_idx];
+constexpr MSX1PQ::BasicPairInfo make_basic_pairs()
+{
+    MSX1PQ::BasicPairInfo info{};
+    int p = 0;
+    for (int a = 0; a < 15; ++a) {
+        info.index[a][a] = -1;
+        for (int b = a + 1; b < 15; ++b) {
+            info.a[p] = static_cast<std::uint8_t>(a);
+            info.b[p] = static_cast<std::uint8_t>(b);
+            info.index[a][b] = static_cast<std::int8_t>(p);
+            info.index[b][a] = static_cast<std::int8_t>(p);
+            ++p;
+        }
     }
+    return info;
+}
+
+struct BasicPairMinTable {
+    alignas(32) MSX1PQ::BasicPairMinRow d[15];
+};
 
-    if (!dp || !dp->pattern || dp->width == 0 || dp->height == 0) {
-        // 未定義時はとりあえず basic 15 に丸める
-        if (palette_idx < MSX1PQ::kNumBasicColors) {
-            return palette_idx;
-        } else {
-            return palette_idx % MSX1PQ::kNumBasicColors;
+constexpr BasicPairMinTable make_basic_pair_min(const BasicDist2Table& dist2,
+                                                const MSX1PQ::BasicPairInfo& pairs)
+{
+    BasicPairMinTable t{};
+    for (int k = 0; k < 15; ++k) {
+        for (int p = 0; p < MSX1PQ::kNumBasicPairs; ++p) {
+            const long da = dist2.d[k][pairs.a[p]];
+            const long db = dist2.d[k][pairs.b[p]];
+            t.d[k][p] = static_cast<std::int32_t>((da < db) ? da : db);
         }
     }
+    return t;
+}
 
-    std::int32_t ix = (xL >= 0) ? xL : -xL;
-    std::int32_t iy = (yL >= 0) ? yL : -yL;
+// 基本15色が衝突せずに収まる乗数を探して完全ハッシュを作る（見つからなければ mul = 0）
+constexpr MSX1PQ::BasicColorHash make_basic_color_hash(const MSX1PQ::QuantColor* table)
+{
+    const std::uint32_t kEmpty = 0xFFFFFFFFu;
+    for (std::uint32_t mul = 0x9E3779B1u, tries = 0; tries < 4096; mul += 2, ++tries) {
+        MSX1PQ::BasicColorHash h{};
+        h.mul = mul;
+        for (int s = 0; s < MSX1PQ::kBasicColorHashSize; ++s) {
+            h.keys[s]  = kEmpty;
+            h.index[s] = -1;
+        }
 
-    std::int32_t dx = ix % dp->width;
-    std::int32_t dy = iy % dp->height;
+        bool ok = true;
+        for (int i = 0; i < MSX1PQ::kNumBasicColors; ++i) {
+            const std::uint32_t key =
+                (static_cast<std::uint32_t>(table[i].r) << 16) |
+                (static_cast<std::uint32_t>(table[i].g) << 8) |
+                static_cast<std::uint32_t>(table[i].b);
+            const std::uint32_t slot = (key * mul) >> (32 - MSX1PQ::kBasicColorHashBits);
+            if (h.keys[slot] != kEmpty) {
+                ok = false;  // 衝突（同じ色が 2 つある場合もここで弾かれる）
+                break;
+            }
+            h.keys[slot]  = key;
+            h.index[slot] = static_cast<std::int8_t>(i);
+        }
+        if (ok) {
+            return h;
+        }
+    }
+    return MSX1PQ::BasicColorHash{};
+}
 
-    std::int32_t idx = dy * dp->width + dx;
+// 全パターンの幅が 2 の約数、高さが 4 の約数であれば 8 位相で表せる
+constexpr bool dither_patterns_fit_phases()
+{
+    for (int i = 0; i < MSX1PQ::kNumPaletteDither; ++i) {
+        const MSX1PQ::DitherPattern& dp = MSX1PQ::kPaletteDither[i];
+        if (dp.width == 0 || dp.height == 0 || 2 % dp.width != 0 || 4 % dp.height != 0) {
+            return false;
+        }
+    }
+    return true;
+}
+static_assert(dither_patterns_fit_phases(),
+              "dither patterns must tile a 2x4 phase grid");
 
-    int basic_idx = dp->pattern[idx]; // 0..14
-    if (basic_idx < 0) basic_idx = 0;
-    if (basic_idx >= MSX1PQ::kNumBasicColors) basic_idx = kNumBasicColors - 1;
+struct DitherBasicIndexTable {
+    std::uint8_t idx[MSX1PQ::kPaletteSoaSize][MSX1PQ::kNumDitherPhases];
+};
+
+constexpr DitherBasicIndexTable make_dither_basic_index()
+{
+    DitherBasicIndexTable t{};
+    for (int i = 0; i < MSX1PQ::kNumQuantColors; ++i) {
+        for (int phase = 0; phase < MSX1PQ::kNumDitherPhases; ++phase) {
+            if (i >= MSX1PQ::kNumPaletteDither) {
+                // 未定義時はとりあえず basic 15 に丸める
+                t.idx[i][phase] = static_cast<std::uint8_t>(i % MSX1PQ::kNumBasicColors);
+                continue;
+            }
+            const MSX1PQ::DitherPattern& dp = MSX1PQ::kPaletteDither[i];
+            if (!dp.pattern) {
+                t.idx[i][phase] = static_cast<std::uint8_t>(i % MSX1PQ::kNumBasicColors);
+                continue;
+            }
+            const int dx = (phase & 1) % dp.width;
+            const int dy = (phase >> 1) % dp.height;
+            int basic_idx = dp.pattern[dy * dp.width + dx]; // 0..14
+            if (basic_idx >= MSX1PQ::kNumBasicColors) basic_idx = MSX1PQ::kNumBasicColors - 1;
+            t.idx[i][phase] = static_cast<std::uint8_t>(basic_idx);
+        }
+    }
+    return t;
+}
+
+constexpr BasicDist2Table kBasicDist2Msx1Table = make_basic_dist2(MSX1PQ::kQuantColors);
+constexpr BasicDist2Table kBasicDist2Msx2Table = make_basic_dist2(MSX1PQ::kBasicColorsMsx2);
+constexpr DitherBasicIndexTable kDitherBasicIndexTable = make_dither_basic_index();
+
+} // namespace
+
+constexpr MSX1PQ::BasicPairInfo MSX1PQ::kBasicPairs = make_basic_pairs();
+
+namespace {
+
+constexpr BasicPairMinTable kBasicPairMinMsx1Table = make_basic_pair_min(kBasicDist2Msx1Table, MSX1PQ::kBasicPairs);
+constexpr BasicPairMinTable kBasicPairMinMsx2Table = make_basic_pair_min(kBasicDist2Msx2Table, MSX1PQ::kBasicPairs);
+
+} // namespace
+
+constexpr MSX1PQ::PaletteSoA MSX1PQ::kPaletteSoA = make_palette_soa();
+constexpr MSX1PQ::BasicColorHash MSX1PQ::kBasicColorHashMsx1 = make_basic_color_hash(MSX1PQ::kQuantColors);
+constexpr MSX1PQ::BasicColorHash MSX1PQ::kBasicColorHashMsx2 = make_basic_color_hash(MSX1PQ::kBasicColorsMsx2);
+
+static_assert(MSX1PQ::kBasicColorHashMsx1.mul != 0 && MSX1PQ::kBasicColorHashMsx2.mul != 0,
+              "basic colors must be distinct and hash without collisions");
+
+const MSX1PQ::BasicDist2Row*
+MSX1PQ::basic_dist2_table(bool msx2)
+{
+    return msx2 ? kBasicDist2Msx2Table.d : kBasicDist2Msx1Table.d;
+}
+
+const MSX1PQ::BasicPairMinRow*
+MSX1PQ::basic_pair_min_table(bool msx2)
+{
+    return msx2 ? kBasicPairMinMsx2Table.d : kBasicPairMinMsx1Table.d;
+}
+
+const MSX1PQ::DitherPhaseRow*
+MSX1PQ::dither_basic_index_table()
+{
+    return kDitherBasicIndexTable.idx;
+}
+
+// ---- MSX1PQ::palette_index_to_basic_index ----
+int
+MSX1PQ::palette_index_to_basic_index(int palette_idx, std::int32_t xL, std::int32_t yL)
+{
+    if (palette_idx < 0) {
+        palette_idx = 0;
+    } else if (palette_idx >= MSX1PQ::kNumQuantColors) {
+        palette_idx = MSX1PQ::kNumQuantColors - 1;
+    }
 
-    return basic_idx;
+    return kDitherBasicIndexTable.idx[palette_idx][MSX1PQ::dither_phase_of(xL, yL)];
 }
 
 // ---- ディザ無し用 最近傍 basic15 ----
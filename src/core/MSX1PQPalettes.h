@@ -40,4 +40,126 @@ namespace MSX1PQ {
 
     extern const QuantColor kBasicColorsMsx2[];
 
+    // ---- コンパイル時に生成する派生テーブル (MSX1PQPalettes.cpp) ----
+
+    // RGB(0..255) → HSB(各 0〜1)
+    // パレット表の生成と実行時の変換で同じ式を使い、結果をビット単位で一致させる
+    typedef struct {
+        float h;
+        float s;
+        float v;
+    } HsbColor;
+
+    constexpr HsbColor rgb8_to_hsb(std::uint8_t r8, std::uint8_t g8, std::uint8_t b8)
+    {
+        const float r = r8 / 255.0f;
+        const float g = g8 / 255.0f;
+        const float b = b8 / 255.0f;
+
+        float maxc = (r > g) ? r : g;
+        maxc = (maxc > b) ? maxc : b;
+        float minc = (r < g) ? r : g;
+        minc = (minc < b) ? minc : b;
+        const float delta = maxc - minc;
+
+        HsbColor out{0.0f, 0.0f, maxc};
+        if (maxc <= 0.0f) {
+            return out;
+        }
+
+        out.s = (delta <= 0.0f) ? 0.0f : (delta / maxc);
+
+        if (delta > 0.0f) {
+            float hue = 0.0f;
+            if (maxc == r) {
+                hue = (g - b) / delta;
+            } else if (maxc == g) {
+                hue = 2.0f + (b - r) / delta;
+            } else {
+                hue = 4.0f + (r - g) / delta;
+            }
+            hue *= 60.0f;
+            if (hue < 0.0f) {
+                hue += 360.0f;
+            }
+            out.h = hue / 360.0f; // 0〜1 に正規化
+        }
+        return out;
+    }
+
+    // SIMD 用 SoA パレット (kQuantColors の RGB / HSB)
+    // ベクタ幅 8 の倍数までパディングし、余りは 0 埋め (探索側でマスクして除外する)
+    const int kPaletteSoaSize = 96;
+
+    struct alignas(32) PaletteSoA {
+        float r[kPaletteSoaSize];
+        float g[kPaletteSoaSize];
+        float b[kPaletteSoaSize];
+        float h[kPaletteSoaSize];
+        float s[kPaletteSoaSize];
+        float v[kPaletteSoaSize];
+    };
+
+    extern const PaletteSoA kPaletteSoA;
+
+    // 基本15色どうしの距離^2 (MSX1: kQuantColors 先頭15色 / MSX2: kBasicColorsMsx2)
+    typedef long BasicDist2Row[15];
+    const BasicDist2Row* basic_dist2_table(bool msx2);
+
+    // 基本15色の RGB 完全一致 → インデックス (衝突の無い乗算ハッシュ)
+    // 量子化後の画素はすべて基本色なので、距離の走査をせずに 1 回の比較で引ける
+    const int kBasicColorHashBits = 6;
+    const int kBasicColorHashSize = 1 << kBasicColorHashBits;
+
+    struct BasicColorHash {
+        std::uint32_t mul;                        // 衝突しないようにコンパイル時に選んだ乗数
+        std::uint32_t keys[kBasicColorHashSize];  // 0xRRGGBB, 空きは 0xFFFFFFFF
+        std::int8_t   index[kBasicColorHashSize];
+    };
+
+    extern const BasicColorHash kBasicColorHashMsx1;
+    extern const BasicColorHash kBasicColorHashMsx2;
+
+    // 基本色と完全一致すればそのインデックス、それ以外は -1
+    inline int exact_basic_index(const BasicColorHash& hash,
+                                 std::uint8_t r, std::uint8_t g, std::uint8_t b)
+    {
+        const std::uint32_t key =
+            (static_cast<std::uint32_t>(r) << 16) |
+            (static_cast<std::uint32_t>(g) << 8) |
+            static_cast<std::uint32_t>(b);
+        const std::uint32_t slot = (key * hash.mul) >> (32 - kBasicColorHashBits);
+        return (hash.keys[slot] == key) ? hash.index[slot] : -1;
+    }
+
+    // 基本15色の 2 色ペア (a < b) は 105 通り。番号は (a, b) の辞書順
+    const int kNumBasicPairs      = 105;
+    const int kBasicPairRowStride = 112;  // SIMD 8 レーンの倍数までパディング (余りは 0)
+
+    struct BasicPairInfo {
+        std::uint8_t a[kNumBasicPairs];
+        std::uint8_t b[kNumBasicPairs];
+        std::int8_t  index[15][15];       // (a, b) → ペア番号（a == b は -1、順不同）
+    };
+    extern const BasicPairInfo kBasicPairs;
+
+    // [色 k][ペア] = min(dist2[k][a], dist2[k][b])
+    // ヒストグラムとの内積がそのペアで表したときの誤差になる
+    typedef std::int32_t BasicPairMinRow[kBasicPairRowStride];
+    const BasicPairMinRow* basic_pair_min_table(bool msx2);
+
+    // ディザパターンは幅 1/2 × 高さ 1/2/4 なので、座標は 2x4 の 8 位相に畳み込める
+    const int kNumDitherPhases = 8;
+
+    inline int dither_phase_of(std::int32_t x, std::int32_t y)
+    {
+        const std::int32_t ix = (x >= 0) ? x : -x;
+        const std::int32_t iy = (y >= 0) ? y : -y;
+        return static_cast<int>((ix & 1) | ((iy & 3) << 1));
+    }
+
+    // パレットインデックス × 位相 → 基本15色インデックス
+    typedef std::uint8_t DitherPhaseRow[kNumDitherPhases];
+    const DitherPhaseRow* dither_basic_index_table();
+
 } // namespace MSX1PQ
@@ -45,7 +45,7 @@ msx1pq_cli.exe --input "%INPUT_PATH%" --output "%OUTPUT_DIR%" --output-prefix "0
 if errorlevel 1 goto :abort
 msx1pq_cli.exe --input "%INPUT_PATH%" --output "%OUTPUT_DIR%" --output-prefix "09_clean_" --no-dither --pre-posterize 24 --pre-hue -12 --force
 if errorlevel 1 goto :abort
-msx1pq_cli.exe --input "%INPUT_PATH%" --output "%OUTPUT_DIR%" --output-prefix "10_lut_" --pre-lut "%LUT_PATH%" --force
+msx1pq_cli.exe --input "%INPUT_PATH%" --output "%OUTPUT_DIR%" --output-prefix "10_lut_" --pre-lut "%LUT_PATH%" --lut-cache --force
 if errorlevel 1 goto :abort
 
 